@@ -1,12 +1,41 @@
+import argparse
+import errno
+import os
+import secrets
+import shutil
+import socketserver
 import sqlite3
 import struct
+import threading
+import time
 import urllib.parse
-from http.server import BaseHTTPRequestHandler, HTTPServer
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
 
 DB_FILE = "yufs.db"
 SERVER_PORT = 8080
 ROOT_INO = 1000
+S_IFMT = 0o170000
 S_IFDIR = 0o040000
+# клиент открывает сессию заново, если сервер её не знает (например, после рестарта)
+SESSION_STALE = -116
+# секунды без запросов, после которых сессия забывается; клиент её просто переоткроет
+SESSION_IDLE = 15 * 60
+# условное чтение: у inode всё ещё версия, которую знает клиент
+NOT_MODIFIED = -304
+# флаги rename, как RENAME_* в ядре
+RENAME_NOREPLACE = 1
+RENAME_EXCHANGE = 2
+# режимы fallocate, как FALLOC_FL_* в ядре
+FALLOC_KEEP_SIZE = 1
+FALLOC_PUNCH_HOLE = 2
+# сколько полоса записи ждёт предыдущую полосу своей цепочки, секунды
+CHAIN_WAIT = 10
+
+
+def touch_dir(conn, token, dir_id):
+    # версия каталога растёт при каждом изменении его записей,
+    # по ней клиент проверяет закэшированные dentry
+    conn.execute("UPDATE inodes SET version = version + 1 WHERE token=? AND id=?", (token, dir_id))
 
 def get_db():
     conn = sqlite3.connect(DB_FILE)
@@ -15,6 +44,8 @@ def get_db():
 
 def init_fs():
     with get_db() as conn:
+        # WAL позволяет нескольким инстансам бэкенда работать с одной базой
+        conn.execute("PRAGMA journal_mode=WAL")
         # Добавляем колонку token и включаем её в PRIMARY KEY
         conn.executescript("""
                            CREATE TABLE IF NOT EXISTS inodes (
@@ -24,8 +55,13 @@ def init_fs():
                                                                  nlink INTEGER DEFAULT 1,
                                                                  size INTEGER DEFAULT 0,
                                                                  content BLOB,
+                                                                 version INTEGER DEFAULT 1,
                                                                  PRIMARY KEY (token, id)
                                );
+                           CREATE TABLE IF NOT EXISTS id_leases (
+                                                                  token TEXT PRIMARY KEY,
+                                                                  next_id INTEGER
+                               );
                            CREATE TABLE IF NOT EXISTS dirents (
                                                                   token TEXT,
                                                                   parent_id INTEGER,
@@ -34,9 +70,123 @@ def init_fs():
                                                                   PRIMARY KEY(token, parent_id, name)
                                );
                            """)
+        # базы, созданные до появления версий
+        columns = [r['name'] for r in conn.execute("PRAGMA table_info(inodes)")]
+        if 'version' not in columns:
+            conn.execute("ALTER TABLE inodes ADD COLUMN version INTEGER DEFAULT 1")
+
+class Session:
+    """Состояние сессии: тенант и соединения с базой.
+
+    root проверяется один раз при открытии сессии. sqlite3 кэширует
+    подготовленные запросы внутри соединения, поэтому соединения живут
+    вместе с сессией, по одному на поток сервера.
+    """
+
+    def __init__(self, token):
+        self.token = token
+        self.local = threading.local()
+        self.last_used = time.monotonic()
+
+    def db(self):
+        conn = getattr(self.local, 'conn', None)
+        if conn is None:
+            conn = get_db()
+            self.local.conn = conn
+        return conn
+
+
+sessions = {}
+sessions_lock = threading.Lock()
+
+
+def session_open(token):
+    """sid - 63 случайных бита: его нельзя угадать по соседним sid."""
+    now = time.monotonic()
+    with sessions_lock:
+        for sid in [s for s, v in sessions.items() if now - v.last_used > SESSION_IDLE]:
+            del sessions[sid]
+        while True:
+            sid = secrets.randbits(63)
+            if sid != 0 and sid not in sessions:
+                break
+        sessions[sid] = Session(token)
+    return sid
+
+
+def session_get(sid):
+    now = time.monotonic()
+    with sessions_lock:
+        session = sessions.get(sid)
+        if session is not None and now - session.last_used > SESSION_IDLE:
+            del sessions[sid]
+            session = None
+        if session is not None:
+            session.last_used = now
+    return session
+
+
+class Chain:
+    def __init__(self):
+        self.next = 0
+        self.broken = False
+        self.touched = time.monotonic()
+
+
+# Полосы одной записи приходят параллельно по разным соединениям, а
+# применяются по порядку seq: каждая ждёт предыдущую, и после сбоя одной
+# следующие уже не пишутся. Так за возвращённым клиенту числом байт ничего
+# не остаётся. Все полосы inode приходят на один бэкенд, цепочки - в памяти.
+chains = {}
+chains_cv = threading.Condition()
+
+
+def chain_enter(key, seq):
+    with chains_cv:
+        now = time.monotonic()
+        for k in [k for k, c in chains.items() if now - c.touched > 2 * CHAIN_WAIT]:
+            del chains[k]
+        chain = chains.setdefault(key, Chain())
+        chains_cv.wait_for(lambda: chain.broken or chain.next == seq, timeout=CHAIN_WAIT)
+        if chain.next != seq:
+            chain.broken = True
+            chains_cv.notify_all()
+            return False
+        return True
+
+
+def chain_leave(key, ok, last):
+    with chains_cv:
+        chain = chains.get(key)
+        if chain is None:
+            return
+        chain.touched = time.monotonic()
+        if ok:
+            chain.next += 1
+        else:
+            chain.broken = True
+        # сломанная цепочка живёт, пока не устареет: её полосы ещё придут
+        if ok and last:
+            del chains[key]
+        chains_cv.notify_all()
+
 
 class YUFSHandler(BaseHTTPRequestHandler):
+    # keep-alive: клиент держит пул соединений и шлёт запросы конвейером
+    protocol_version = "HTTP/1.1"
+    # заголовки и тело уходят отдельными write: с Nagle второй ждёт
+    # отложенный ACK клиента (~40 мс на каждый ответ)
+    disable_nagle_algorithm = True
+
     def do_GET(self):
+        self.handle_api(None)
+
+    def do_POST(self):
+        # тело запроса - сырые данные (write), без url-кодирования
+        length = int(self.headers.get('Content-Length', 0))
+        self.handle_api(self.rfile.read(length))
+
+    def handle_api(self, payload):
         ret_val = -1
         body = b""
         try:
@@ -44,21 +194,35 @@ class YUFSHandler(BaseHTTPRequestHandler):
             cmd = parsed.path.replace("/api/", "")
             qs = urllib.parse.parse_qs(parsed.query)
 
-            # Получаем токен из запроса. Если нет - "default"
-            token = qs.get('token', ['default'])[0]
-
             # Остальные аргументы
-            args = {k: v[0] for k, v in qs.items() if k != 'token'}
-
-            with get_db() as conn:
-                # Для каждого запроса проверяем, создан ли ROOT для этого токена
-                self.ensure_root_exists(conn, token)
-
-                method = getattr(self, f"handle_{cmd}", None)
-                if method:
-                    ret_val, body = method(conn, token, args)
+            args = {k: v[0] for k, v in qs.items() if k not in ('token', 'sid')}
+            if payload is not None:
+                args['body'] = payload
+
+            if 'sid' in qs:
+                sid = int(qs['sid'][0])
+                session = session_get(sid)
+                if session is None:
+                    ret_val = SESSION_STALE
+                elif cmd == 'session_close':
+                    with sessions_lock:
+                        sessions.pop(sid, None)
+                    ret_val = 0
                 else:
-                    print(f"Unknown command: {cmd}")
+                    with session.db() as conn:
+                        ret_val, body = self.dispatch(conn, session.token, cmd, args)
+            else:
+                # Получаем токен из запроса. Если нет - "default"
+                token = qs.get('token', ['default'])[0]
+
+                with get_db() as conn:
+                    # Без сессии проверяем, создан ли ROOT для этого токена
+                    self.ensure_root_exists(conn, token)
+
+                    if cmd == 'session':
+                        ret_val = session_open(token)
+                    else:
+                        ret_val, body = self.dispatch(conn, token, cmd, args)
         except Exception as e:
             print(f"Server Error: {e}")
             ret_val = -1
@@ -70,6 +234,19 @@ class YUFSHandler(BaseHTTPRequestHandler):
         self.end_headers()
         self.wfile.write(response)
 
+    def dispatch(self, conn, token, cmd, args):
+        method = getattr(self, f"handle_{cmd}", None)
+        if method:
+            return method(conn, token, args)
+        print(f"Unknown command: {cmd}")
+        return -1, b""
+
+    def address_string(self):
+        # у unix-сокета нет адреса клиента
+        if isinstance(self.client_address, tuple):
+            return super().address_string()
+        return "uds"
+
     def ensure_root_exists(self, conn, token):
         # Проверяем, есть ли root (1000) для этого токена
         exists = conn.execute("SELECT 1 FROM inodes WHERE token=? AND id=?", (token, ROOT_INO)).fetchone()
@@ -79,36 +256,52 @@ class YUFSHandler(BaseHTTPRequestHandler):
                          (token, ROOT_INO, S_IFDIR | 0o777))
             print(f"Initialized root for token: {token}")
 
-    def pack_stat(self, id, mode, size):
-        return struct.pack('<IIQ', id, mode, size)
+    def pack_stat(self, id, mode, size, version, nlink):
+        return struct.pack('<IIQQI', id, mode, size, version, nlink)
 
     # --- Обработчики (теперь принимают token) ---
 
     def handle_lookup(self, conn, token, args):
         row = conn.execute("""
-                           SELECT i.id, i.mode, i.size FROM dirents d
+                           SELECT i.id, i.mode, i.size, i.version, i.nlink FROM dirents d
                                                                 JOIN inodes i ON d.inode_id = i.id AND d.token = i.token
                            WHERE d.token=? AND d.parent_id=? AND d.name=?
                            """, (token, args['parent_id'], args['name'])).fetchone()
 
-        if row: return 0, self.pack_stat(row['id'], row['mode'], row['size'])
+        if row: return 0, self.pack_stat(row['id'], row['mode'], row['size'], row['version'], row['nlink'])
         return -1, b""
 
+    def allocate_ids(self, conn, token, count):
+        # Один счётчик на токен и для create, и для диапазонов, которые клиент
+        # арендует (lease), поэтому выданные id не повторяются.
+        if not conn.in_transaction:
+            conn.execute("BEGIN IMMEDIATE")
+        max_id = conn.execute("SELECT MAX(id) FROM inodes WHERE token=?", (token,)).fetchone()[0]
+        row = conn.execute("SELECT next_id FROM id_leases WHERE token=?", (token,)).fetchone()
+        first = max((max_id if max_id else ROOT_INO) + 1, row['next_id'] if row else 0)
+        conn.execute("INSERT OR REPLACE INTO id_leases (token, next_id) VALUES (?, ?)", (token, first + count))
+        return first
+
+    def handle_lease(self, conn, token, args):
+        count = int(args['count'])
+        if count <= 0: return -1, b""
+        return self.allocate_ids(conn, token, count), b""
+
     def handle_create(self, conn, token, args):
         mode = int(args['mode'])
         try:
-            # ID генерируем "глобально уникальный" или MAX(id)+1 для токена.
-            # Для простоты SQLite Autoincrement не сработает с составным ключом идеально,
-            # поэтому выберем MAX id для данного токена.
-            max_id = conn.execute("SELECT MAX(id) FROM inodes WHERE token=?", (token,)).fetchone()[0]
-            new_id = (max_id if max_id else ROOT_INO) + 1
+            # id приходит от клиента, если он взял его из арендованного диапазона
+            new_id = int(args['id']) if 'id' in args else self.allocate_ids(conn, token, 1)
 
             conn.execute("INSERT INTO inodes (token, id, mode, size, content) VALUES (?, ?, ?, 0, NULL)",
                          (token, new_id, mode))
             conn.execute("INSERT INTO dirents (token, parent_id, name, inode_id) VALUES (?, ?, ?, ?)",
                          (token, int(args['parent_id']), args['name'], new_id))
-            return 0, self.pack_stat(new_id, mode, 0)
+            touch_dir(conn, token, int(args['parent_id']))
+            return 0, self.pack_stat(new_id, mode, 0, 1, 1)
         except Exception as e:
+            # имя уже занято: inode без dirent не оставляем
+            conn.rollback()
             return -1, b""
 
     def handle_link(self, conn, token, args):
@@ -119,6 +312,7 @@ class YUFSHandler(BaseHTTPRequestHandler):
             conn.execute("INSERT INTO dirents (token, parent_id, name, inode_id) VALUES (?, ?, ?, ?)",
                          (token, int(args['parent_id']), args['name'], int(args['target_id'])))
             conn.execute("UPDATE inodes SET nlink = nlink + 1 WHERE token=? AND id=?", (token, int(args['target_id'])))
+            touch_dir(conn, token, int(args['parent_id']))
             return 0, b""
         except:
             return -1, b""
@@ -131,29 +325,100 @@ class YUFSHandler(BaseHTTPRequestHandler):
 
             conn.execute("DELETE FROM dirents WHERE token=? AND parent_id=? AND name=?",
                          (token, int(args['parent_id']), args['name']))
-            # (Логику уменьшения nlink опустим для краткости, но она должна быть тут с WHERE token=?)
+            conn.execute("UPDATE inodes SET nlink = nlink - 1 WHERE token=? AND id=?", (token, d['inode_id']))
+            touch_dir(conn, token, int(args['parent_id']))
             return 0, b""
         except:
             return -1, b""
 
     def handle_rmdir(self, conn, token, args):
         try:
-            conn.execute("DELETE FROM dirents WHERE token=? AND parent_id=? AND name=?",
-                         (token, int(args['parent_id']), args['name']))
+            cur = conn.execute("DELETE FROM dirents WHERE token=? AND parent_id=? AND name=?",
+                               (token, int(args['parent_id']), args['name']))
+            if cur.rowcount: touch_dir(conn, token, int(args['parent_id']))
             return 0, b""
         except:
             return -1, b""
 
+    def dirent(self, conn, token, parent_id, name):
+        return conn.execute("""
+                            SELECT d.inode_id, i.mode FROM dirents d
+                                                           JOIN inodes i ON d.inode_id=i.id AND d.token=i.token
+                            WHERE d.token=? AND d.parent_id=? AND d.name=?
+                            """, (token, parent_id, name)).fetchone()
+
+    def is_ancestor(self, conn, token, dir_id, inode_id):
+        # поднимаемся от inode_id к корню: у каталога ровно один dirent
+        while inode_id != ROOT_INO:
+            if inode_id == dir_id: return True
+            row = conn.execute("SELECT parent_id FROM dirents WHERE token=? AND inode_id=?",
+                               (token, inode_id)).fetchone()
+            if not row: return False
+            inode_id = row['parent_id']
+        return dir_id == ROOT_INO
+
+    def handle_rename(self, conn, token, args):
+        # переносится только dirent: inode и содержимое остаются на месте.
+        # Отказ - это -1 и <i errno> причины
+        parent, name = int(args['parent_id']), args['name']
+        new_parent, new_name = int(args['new_parent_id']), args['new_name']
+        flags = int(args.get('flags', 0))
+        try:
+            if not conn.in_transaction:
+                conn.execute("BEGIN IMMEDIATE")
+            src = self.dirent(conn, token, parent, name)
+            dst = self.dirent(conn, token, new_parent, new_name)
+            if not src: return -1, struct.pack('<i', errno.ENOENT)
+            if (parent, name) == (new_parent, new_name): return 0, b""
+
+            if flags & RENAME_EXCHANGE:
+                if not dst: return -1, struct.pack('<i', errno.ENOENT)
+                if src['mode'] & S_IFDIR and self.is_ancestor(conn, token, src['inode_id'], new_parent):
+                    return -1, struct.pack('<i', errno.EINVAL)
+                if dst['mode'] & S_IFDIR and self.is_ancestor(conn, token, dst['inode_id'], parent):
+                    return -1, struct.pack('<i', errno.EINVAL)
+                # дети каталога ссылаются на его id, поэтому достаточно обменять inode_id
+                conn.execute("UPDATE dirents SET inode_id=? WHERE token=? AND parent_id=? AND name=?",
+                             (dst['inode_id'], token, parent, name))
+                conn.execute("UPDATE dirents SET inode_id=? WHERE token=? AND parent_id=? AND name=?",
+                             (src['inode_id'], token, new_parent, new_name))
+            else:
+                if dst:
+                    if flags & RENAME_NOREPLACE: return -1, struct.pack('<i', errno.EEXIST)
+                    if dst['inode_id'] == src['inode_id']: return 0, b""
+                    if (src['mode'] & S_IFDIR) != (dst['mode'] & S_IFDIR):
+                        return -1, struct.pack('<i', errno.EISDIR if dst['mode'] & S_IFDIR else errno.ENOTDIR)
+                    if dst['mode'] & S_IFDIR and conn.execute(
+                            "SELECT 1 FROM dirents WHERE token=? AND parent_id=? LIMIT 1",
+                            (token, dst['inode_id'])).fetchone():
+                        return -1, struct.pack('<i', errno.ENOTEMPTY)
+                if src['mode'] & S_IFDIR and self.is_ancestor(conn, token, src['inode_id'], new_parent):
+                    return -1, struct.pack('<i', errno.EINVAL)
+                if dst:
+                    conn.execute("UPDATE inodes SET nlink = nlink - 1 WHERE token=? AND id=?", (token, dst['inode_id']))
+                conn.execute("DELETE FROM dirents WHERE token=? AND parent_id=? AND name=?",
+                             (token, new_parent, new_name))
+                conn.execute("UPDATE dirents SET parent_id=?, name=? WHERE token=? AND parent_id=? AND name=?",
+                             (new_parent, new_name, token, parent, name))
+            touch_dir(conn, token, parent)
+            if new_parent != parent: touch_dir(conn, token, new_parent)
+            return 0, b""
+        except Exception:
+            conn.rollback()
+            return -1, struct.pack('<i', errno.EIO)
+
     def handle_getattr(self, conn, token, args):
-        row = conn.execute("SELECT id, mode, size FROM inodes WHERE token=? AND id=?",
+        row = conn.execute("SELECT id, mode, size, version, nlink FROM inodes WHERE token=? AND id=?",
                            (token, int(args['id']))).fetchone()
-        if row: return 0, self.pack_stat(row['id'], row['mode'], row['size'])
+        if row: return 0, self.pack_stat(row['id'], row['mode'], row['size'], row['version'], row['nlink'])
         return -1, b""
 
     def handle_read(self, conn, token, args):
         offset = int(args['offset'])
         size = int(args['size'])
-        row = conn.execute("SELECT content FROM inodes WHERE token=? AND id=?", (token, int(args['id']))).fetchone()
+        row = conn.execute("SELECT content, version FROM inodes WHERE token=? AND id=?", (token, int(args['id']))).fetchone()
+        if row and 'if_version' in args and row['version'] == int(args['if_version']):
+            return NOT_MODIFIED, b""
 
         content = row['content'] if row and row['content'] else b''
         if offset >= len(content): return 0, b""
@@ -161,26 +426,128 @@ class YUFSHandler(BaseHTTPRequestHandler):
         return len(chunk), chunk
 
     def handle_write(self, conn, token, args):
+        if 'chain' not in args:
+            return self.write_range(conn, token, args)
+        key = (token, int(args['id']), int(args['chain']))
+        if not chain_enter(key, int(args['seq'])):
+            return -1, b""
+        ok = False
+        try:
+            ret_val, body = self.write_range(conn, token, args)
+            # следующая полоса должна увидеть эту уже записанной
+            if ret_val >= 0:
+                conn.commit()
+                ok = True
+            return ret_val, body
+        finally:
+            chain_leave(key, ok, args.get('last') == '1')
+
+    def write_range(self, conn, token, args):
         try:
             inode_id = int(args['id'])
             offset = int(args['offset'])
-            buf = urllib.parse.unquote_to_bytes(args['buf'])
-
-            row = conn.execute("SELECT content FROM inodes WHERE token=? AND id=?", (token, inode_id)).fetchone()
+            if 'body' in args:
+                buf = args['body']
+            else:
+                buf = urllib.parse.unquote_to_bytes(args['buf'])
+
+            # клиент пишет полосами параллельно: блокировка записи берётся до
+            # чтения, иначе две полосы затрут друг друга
+            if not conn.in_transaction:
+                conn.execute("BEGIN IMMEDIATE")
+            row = conn.execute("SELECT content, version FROM inodes WHERE token=? AND id=?",
+                               (token, inode_id)).fetchone()
             content = bytearray(row['content']) if row and row['content'] else bytearray()
 
             new_end = offset + len(buf)
             if new_end > len(content): content.extend(b'\0' * (new_end - len(content)))
             content[offset : offset + len(buf)] = buf
 
-            conn.execute("UPDATE inodes SET content=?, size=? WHERE token=? AND id=?", (content, len(content), token, inode_id))
-            return len(buf), b""
+            conn.execute("UPDATE inodes SET content=?, size=?, version=version+1 WHERE token=? AND id=?",
+                         (content, len(content), token, inode_id))
+            # версия после записи: клиент по ней узнаёт свои же изменения
+            return len(buf), struct.pack('<Q', row['version'] + 1 if row else 0)
         except:
             return -1, b""
 
+    def handle_fallocate(self, conn, token, args):
+        # BLOB в sqlite не бывает длиннее size, поэтому резервировать место с
+        # KEEP_SIZE нечем: такой вызов только проверяет inode. Ответ - <Q версия>
+        # после вызова
+        inode_id = int(args['id'])
+        mode = int(args['mode'])
+        offset = int(args['offset'])
+        end = offset + int(args['len'])
+        try:
+            if mode & ~(FALLOC_KEEP_SIZE | FALLOC_PUNCH_HOLE): return -1, b""
+            if mode & FALLOC_PUNCH_HOLE and not mode & FALLOC_KEEP_SIZE: return -1, b""
+            if not conn.in_transaction:
+                conn.execute("BEGIN IMMEDIATE")
+            row = conn.execute("SELECT mode, content, version FROM inodes WHERE token=? AND id=?",
+                               (token, inode_id)).fetchone()
+            if not row or row['mode'] & S_IFDIR: return -1, b""
+            content = bytearray(row['content']) if row['content'] else bytearray()
+
+            if mode & FALLOC_PUNCH_HOLE:
+                end = min(end, len(content))
+                if offset >= end: return 0, struct.pack('<Q', row['version'])
+                content[offset:end] = bytes(end - offset)
+            elif not mode & FALLOC_KEEP_SIZE and end > len(content):
+                content.extend(bytes(end - len(content)))
+            else:
+                return 0, struct.pack('<Q', row['version'])
+            conn.execute("UPDATE inodes SET content=?, size=?, version=version+1 WHERE token=? AND id=?",
+                         (content, len(content), token, inode_id))
+            return 0, struct.pack('<Q', row['version'] + 1)
+        except Exception:
+            conn.rollback()
+            return -1, b""
+
+    def handle_copy_range(self, conn, token, args):
+        # копия целиком внутри бэкенда, клиенту уходит только число байт и
+        # <Q версия> приёмника после неё
+        src_id, src_offset = int(args['src_id']), int(args['src_offset'])
+        dst_id, dst_offset = int(args['id']), int(args['offset'])
+        length = int(args['len'])
+        try:
+            if not conn.in_transaction:
+                conn.execute("BEGIN IMMEDIATE")
+            src = conn.execute("SELECT mode, size FROM inodes WHERE token=? AND id=?", (token, src_id)).fetchone()
+            dst = conn.execute("SELECT mode, size, version FROM inodes WHERE token=? AND id=?",
+                               (token, dst_id)).fetchone()
+            if not src or not dst or (src['mode'] | dst['mode']) & S_IFDIR: return -1, b""
+            length = max(0, min(length, src['size'] - src_offset))
+            if length == 0: return 0, struct.pack('<Q', dst['version'])
+
+            if src_offset == 0 and dst_offset == 0 and length >= dst['size'] and length == src['size']:
+                # весь файл поверх не более длинного: BLOB копируется в самой sqlite
+                conn.execute("""
+                             UPDATE inodes SET content = (SELECT content FROM inodes WHERE token=? AND id=?),
+                                               size = ?, version = version + 1
+                             WHERE token=? AND id=?
+                             """, (token, src_id, length, token, dst_id))
+                return length, struct.pack('<Q', dst['version'] + 1)
+
+            chunk = conn.execute("SELECT substr(content, ?, ?) FROM inodes WHERE token=? AND id=?",
+                                 (src_offset + 1, length, token, src_id)).fetchone()[0]
+            row = conn.execute("SELECT content FROM inodes WHERE token=? AND id=?", (token, dst_id)).fetchone()
+            content = bytearray(row['content']) if row['content'] else bytearray()
+            end = dst_offset + length
+            if end > len(content): content.extend(bytes(end - len(content)))
+            content[dst_offset:end] = chunk
+            conn.execute("UPDATE inodes SET content=?, size=?, version=version+1 WHERE token=? AND id=?",
+                         (content, len(content), token, dst_id))
+            return length, struct.pack('<Q', dst['version'] + 1)
+        except Exception:
+            conn.rollback()
+            return -1, b""
+
     def handle_iterate(self, conn, token, args):
+        # Записи <IIH id mode name_len> + имя, начиная с offset: '.', '..',
+        # затем дети по rowid, сколько влезет в size. 0 записей - конец.
         inode_id = int(args['id'])
         offset = int(args['offset'])
+        budget = int(args['size'])
 
         entries = []
         entries.append((inode_id, ".", S_IFDIR | 0o777))
@@ -189,19 +556,100 @@ class YUFSHandler(BaseHTTPRequestHandler):
         rows = conn.execute("""
                             SELECT d.name, d.inode_id, i.mode FROM dirents d
                                                                        JOIN inodes i ON d.inode_id=i.id AND d.token=i.token
-                            WHERE d.token=? AND d.parent_id=?
+                            WHERE d.token=? AND d.parent_id=? ORDER BY d.rowid
                             """, (token, inode_id)).fetchall()
 
         for r in rows: entries.append((r['inode_id'], r['name'], r['mode']))
 
-        if offset >= len(entries): return -1, b""
-        e = entries[offset]
-        name_bytes = e[1].encode('utf-8')
-        packed = struct.pack('<I256sI', e[0], name_bytes, e[2])
-        return 0, packed
+        records = []
+        for e in entries[offset:]:
+            name = e[1].encode('utf-8')
+            record = struct.pack('<IIH', e[0], e[2], len(name)) + name
+            if len(record) > budget:
+                break
+            budget -= len(record)
+            records.append(record)
+        return len(records), b"".join(records)
+
+    def handle_statfs(self, conn, token, args):
+        # '<QQQQ': байт всего и занято, inode всего и занято. Место - это
+        # занятое тенантом плюс свободное на диске с базой
+        row = conn.execute("SELECT COUNT(*) AS inodes, COALESCE(SUM(size), 0) AS bytes FROM inodes WHERE token=?",
+                           (token,)).fetchone()
+        free = shutil.disk_usage(os.path.dirname(os.path.abspath(DB_FILE))).free
+        return 0, struct.pack('<QQQQ', row['bytes'] + free, row['bytes'], 0xFFFFFFFF - ROOT_INO, row['inodes'])
+
+    def handle_prefetch(self, conn, token, args):
+        # Все записи поддерева одним ответом: <q курсор> затем записи
+        # <IIIQQIH parent_id id mode size version nlink name_len> + имя. Записи идут по rowid,
+        # клиент продолжает с курсора, пока не придёт 0 записей.
+        root = int(args.get('root', ROOT_INO))
+        after = int(args.get('after', 0))
+        budget = int(args['size']) - 8
+
+        if root == ROOT_INO:
+            rows = conn.execute("""
+                                SELECT d.rowid, d.parent_id, d.name, i.id, i.mode, i.size, i.version, i.nlink FROM dirents d
+                                    JOIN inodes i ON d.inode_id = i.id AND d.token = i.token
+                                WHERE d.token=? AND d.rowid > ? ORDER BY d.rowid
+                                """, (token, after))
+        else:
+            rows = conn.execute("""
+                                WITH RECURSIVE tree(id) AS (
+                                    SELECT ?
+                                    UNION
+                                    SELECT d.inode_id FROM dirents d
+                                        JOIN inodes i ON d.inode_id = i.id AND d.token = i.token
+                                        JOIN tree t ON d.parent_id = t.id
+                                    WHERE d.token=? AND (i.mode & ?) = ?
+                                )
+                                SELECT d.rowid, d.parent_id, d.name, i.id, i.mode, i.size, i.version, i.nlink FROM dirents d
+                                    JOIN inodes i ON d.inode_id = i.id AND d.token = i.token
+                                WHERE d.token=? AND d.parent_id IN tree AND d.rowid > ? ORDER BY d.rowid
+                                """, (root, token, S_IFMT, S_IFDIR, token, after))
+
+        records = []
+        cursor = after
+        for r in rows:
+            name = r['name'].encode('utf-8')
+            record = struct.pack('<IIIQQIH', r['parent_id'], r['id'], r['mode'], r['size'], r['version'],
+                                 r['nlink'], len(name)) + name
+            if len(record) > budget:
+                break
+            budget -= len(record)
+            records.append(record)
+            cursor = r['rowid']
+        return len(records), struct.pack('<q', cursor) + b"".join(records)
+
+class ThreadingUnixHTTPServer(socketserver.ThreadingMixIn, socketserver.UnixStreamServer):
+    daemon_threads = True
+
+
+class YUFSUnixHandler(YUFSHandler):
+    # TCP_NODELAY на unix-сокете - EOPNOTSUPP, да и Nagle там нет
+    disable_nagle_algorithm = False
+
+
+def make_server(cli):
+    if cli.uds:
+        if os.path.exists(cli.uds):
+            os.unlink(cli.uds)
+        return ThreadingUnixHTTPServer(cli.uds, YUFSUnixHandler), f"unix socket {cli.uds}"
+    return ThreadingHTTPServer(('0.0.0.0', cli.port), YUFSHandler), f"port {cli.port}"
+
 
 if __name__ == '__main__':
+    # Несколько инстансов на разных портах делят одну базу, клиент
+    # распределяет запросы между ними: mount -o backends=127.0.0.1:8080+127.0.0.1:8081
+    parser = argparse.ArgumentParser(description="YUFS backend")
+    parser.add_argument("--port", type=int, default=SERVER_PORT)
+    parser.add_argument("--db", default=DB_FILE)
+    # локальный бэкенд без TCP: mount -o uds=/run/yufs.sock
+    parser.add_argument("--uds", help="listen on a unix socket instead of --port")
+    cli = parser.parse_args()
+    DB_FILE = cli.db
+
     init_fs()
-    server = HTTPServer(('0.0.0.0', SERVER_PORT), YUFSHandler)
-    print(f"Multi-tenant YUFS Backend running on port {SERVER_PORT}...")
+    server, where = make_server(cli)
+    print(f"Multi-tenant YUFS Backend running on {where}...")
     server.serve_forever()
\ No newline at end of file
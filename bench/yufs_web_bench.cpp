@@ -0,0 +1,302 @@
+// Drives the web engine (http.c + yufs_core.c built for userspace) against a
+// backend/main.py it starts itself, against running backends given by -c, or
+// against the in-process mock backend (-m) to see the client overhead alone.
+//
+//   yufs_web_bench [-c backends] [-b main.py] [-m] [-d us] [-n files] [-t threads] [-s bytes] [-u]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern "C" {
+#include "yufs_core.h"
+}
+
+#include "mock_backend.h"
+
+#ifndef YUFS_BACKEND_SCRIPT
+#define YUFS_BACKEND_SCRIPT "backend/main.py"
+#endif
+
+namespace {
+
+const uint32_t ROOT_ID = 1000;
+
+struct Options {
+    std::string backends;
+    std::string script = YUFS_BACKEND_SCRIPT;
+    int files = 2000;
+    int threads = 8;
+    size_t bytes = 4 * 1024 * 1024;
+    bool uds = false;
+    bool mock = false;
+    unsigned delay_us = 0;
+};
+
+struct Backend {
+    pid_t pid = -1;
+    std::string dir;
+};
+
+void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [-c backends] [-b main.py] [-m] [-d us] [-n files] [-t threads] [-s bytes] [-u]\n"
+            "  -c  use running backends (mount option syntax), no backend is started\n"
+            "  -m  serve from the in-process mock backend instead of main.py\n"
+            "  -d  delay every mock response by us microseconds\n"
+            "  -u  start the backend on a unix socket instead of tcp\n",
+            name);
+}
+
+bool parse(int argc, char **argv, Options &opts) {
+    int c;
+    while ((c = getopt(argc, argv, "c:b:md:n:t:s:uh")) != -1) {
+        switch (c) {
+        case 'c': opts.backends = optarg; break;
+        case 'b': opts.script = optarg; break;
+        case 'm': opts.mock = true; break;
+        case 'd': opts.delay_us = strtoul(optarg, nullptr, 10); break;
+        case 'n': opts.files = atoi(optarg); break;
+        case 't': opts.threads = atoi(optarg); break;
+        case 's': opts.bytes = strtoull(optarg, nullptr, 10); break;
+        case 'u': opts.uds = true; break;
+        default: return false;
+        }
+    }
+    return opts.files > 0 && opts.threads > 0 && opts.bytes > 0;
+}
+
+// a port the kernel just handed out, the backend binds it right after
+int free_port() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    socklen_t len = sizeof(addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        getsockname(fd, (struct sockaddr *)&addr, &len) != 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+bool can_connect(const std::string &spec) {
+    int fd;
+    int ret;
+    if (spec.rfind("unix:", 0) == 0) {
+        struct sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", spec.c_str() + 5);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        ret = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+    } else {
+        struct sockaddr_in addr = {};
+        size_t colon = spec.rfind(':');
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(atoi(spec.c_str() + colon + 1));
+        inet_pton(AF_INET, spec.substr(0, colon).c_str(), &addr.sin_addr);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        ret = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    close(fd);
+    return ret == 0;
+}
+
+bool start_backend(const Options &opts, Backend &backend, std::string &spec) {
+    char dir[] = "/tmp/yufs_bench.XXXXXX";
+    if (!mkdtemp(dir)) return false;
+    backend.dir = dir;
+
+    std::string db = backend.dir + "/yufs.db";
+    std::vector<std::string> args = {"python3", opts.script, "--db", db};
+    if (opts.uds) {
+        std::string path = backend.dir + "/yufs.sock";
+        args.insert(args.end(), {"--uds", path});
+        spec = "unix:" + path;
+    } else {
+        int port = free_port();
+        if (port < 0) return false;
+        args.insert(args.end(), {"--port", std::to_string(port)});
+        spec = "127.0.0.1:" + std::to_string(port);
+    }
+
+    backend.pid = fork();
+    if (backend.pid < 0) return false;
+    if (backend.pid == 0) {
+        std::vector<char *> argv;
+        for (auto &arg : args) argv.push_back(const_cast<char *>(arg.c_str()));
+        argv.push_back(nullptr);
+        // the backend logs every request, keep the numbers readable
+        freopen((backend.dir + "/backend.log").c_str(), "w", stdout);
+        freopen((backend.dir + "/backend.log").c_str(), "a", stderr);
+        execvp("python3", argv.data());
+        _exit(127);
+    }
+
+    for (int i = 0; i < 100; i++) {
+        if (can_connect(spec)) return true;
+        if (waitpid(backend.pid, nullptr, WNOHANG) == backend.pid) {
+            backend.pid = -1;
+            return false;
+        }
+        usleep(100 * 1000);
+    }
+    return false;
+}
+
+void stop_backend(Backend &backend) {
+    if (backend.pid > 0) {
+        kill(backend.pid, SIGTERM);
+        waitpid(backend.pid, nullptr, 0);
+    }
+    if (!backend.dir.empty()) {
+        std::string cmd = "rm -rf '" + backend.dir + "'";
+        if (system(cmd.c_str()) != 0) fprintf(stderr, "failed to remove %s\n", backend.dir.c_str());
+    }
+}
+
+void report(const char *phase, long ops, std::chrono::steady_clock::duration elapsed, int failed) {
+    double sec = std::chrono::duration<double>(elapsed).count();
+    printf("%-10s %8ld ops %9.3f s %12.1f ops/s", phase, ops, sec, sec > 0 ? ops / sec : 0.0);
+    if (failed) printf("  (%d failed)", failed);
+    printf("\n");
+}
+
+// runs fn(thread, &failed) on every thread, reports the total and returns seconds
+double timed(const char *phase, long ops, int threads, const std::function<void(int, int &)> &fn) {
+    std::vector<std::thread> workers;
+    std::vector<int> failed(threads, 0);
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < threads; t++) workers.emplace_back([&, t] { fn(t, failed[t]); });
+    for (auto &worker : workers) worker.join();
+    int total = 0;
+    for (int f : failed) total += f;
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    report(phase, ops, elapsed, total);
+    return std::chrono::duration<double>(elapsed).count();
+}
+
+bool count_entry(void *ctx, const char *, int, uint32_t, umode_t) {
+    ++*static_cast<long *>(ctx);
+    return true;
+}
+
+void run(const Options &opts, const char *token) {
+    struct YUFS_stat stat;
+    std::string dir_name = std::string("bench.") + std::to_string(getpid());
+
+    if (YUFSCore_create(token, ROOT_ID, dir_name.c_str(), S_IFDIR | 0755, &stat) != 0) {
+        fprintf(stderr, "can't create the bench directory\n");
+        return;
+    }
+    uint32_t dir = stat.id;
+    std::vector<std::string> names(opts.files);
+    for (int i = 0; i < opts.files; i++) names[i] = "file" + std::to_string(i);
+
+    timed("create", opts.files, 1, [&](int, int &failed) {
+        struct YUFS_stat st;
+        for (auto &name : names) failed += YUFSCore_create(token, dir, name.c_str(), S_IFREG | 0644, &st) != 0;
+        failed += YUFSCore_sync(token, 0) != 0;
+    });
+
+    // every thread walks all names, identical lookups meet in flight
+    timed("lookup", (long)opts.files * opts.threads, opts.threads, [&](int t, int &failed) {
+        struct YUFS_stat st;
+        for (int i = 0; i < opts.files; i++) {
+            const std::string &name = names[(i + t * 7) % opts.files];
+            failed += YUFSCore_lookup(token, dir, name.c_str(), &st) != 0;
+        }
+    });
+
+    timed("getattr", (long)opts.files * opts.threads, opts.threads, [&](int, int &failed) {
+        struct YUFS_stat st;
+        for (int i = 0; i < opts.files; i++) failed += YUFSCore_getattr(token, dir, &st) != 0;
+    });
+
+    long entries = 0;
+    timed("iterate", opts.files + 2, 1, [&](int, int &failed) {
+        failed += YUFSCore_iterate(token, dir, count_entry, &entries, 0) != 0;
+    });
+    if (entries != opts.files + 2) printf("iterate saw %ld entries\n", entries);
+
+    std::vector<char> data(opts.bytes);
+    std::vector<char> back(opts.bytes);
+    for (size_t i = 0; i < data.size(); i++) data[i] = (char)(i * 31 + 7);
+    if (YUFSCore_create(token, dir, "big", S_IFREG | 0644, &stat) != 0) return;
+    uint32_t big = stat.id;
+
+    double mb = opts.bytes / (1024.0 * 1024.0);
+    double sec = timed("write", 1, 1, [&](int, int &failed) {
+        failed += YUFSCore_write(token, big, data.data(), data.size(), 0) != (int)data.size();
+    });
+    printf("%-10s %8.1f MB/s\n", "", sec > 0 ? mb / sec : 0.0);
+    sec = timed("read", 1, 1, [&](int, int &failed) {
+        failed += YUFSCore_read(token, big, back.data(), back.size(), 0) != (int)back.size();
+        failed += back != data;
+    });
+    printf("%-10s %8.1f MB/s\n", "", sec > 0 ? mb / sec : 0.0);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    Options opts;
+    Backend backend;
+    MockBackend mock;
+    std::string spec;
+    char token[32];
+
+    if (!parse(argc, argv, opts)) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (opts.mock) {
+        spec = mock.start(opts.uds);
+        if (spec.empty()) {
+            fprintf(stderr, "mock backend didn't start\n");
+            return 1;
+        }
+        mock.set_delay_us(opts.delay_us);
+    } else if (opts.backends.empty()) {
+        if (!start_backend(opts, backend, spec)) {
+            fprintf(stderr, "backend %s didn't start\n", opts.script.c_str());
+            stop_backend(backend);
+            return 1;
+        }
+    } else {
+        spec = opts.backends;
+    }
+
+    int ret = 1;
+    snprintf(token, sizeof(token), "bench-%d", (int)getpid());
+    if (YUFSCore_init() == 0) {
+        if (YUFSCore_configure("backends", spec.c_str()) == 0 && YUFSCore_open_session(token) == 0) {
+            printf("backends %s, %d files, %d threads, %zu bytes\n", spec.c_str(), opts.files, opts.threads,
+                   opts.bytes);
+            run(opts, token);
+
+            std::vector<char> stats(64 * 1024);
+            YUFSCore_stats(token, stats.data(), stats.size());
+            printf("\n%s", stats.data());
+            YUFSCore_close_session(token);
+            ret = 0;
+        } else {
+            fprintf(stderr, "can't reach %s\n", spec.c_str());
+        }
+        YUFSCore_destroy();
+    }
+    mock.stop();
+    stop_backend(backend);
+    return ret;
+}
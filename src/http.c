@@ -1,68 +1,888 @@
 #include "http.h"
 
-const char *SERVER_IP = "127.0.0.1";
-const int SERVER_PORT = 8080;
-
-// callee should call free_request on received buffer
-int fill_request(struct kvec *vec, const char *token, const char *method,
-                 size_t arg_size, va_list args) {
-  // 2048 bytes for URL and 64 bytes for anything else
-  char *request_buffer = kzalloc(2048 + 64, GFP_KERNEL);
+#define VTFS_DEFAULT_BACKENDS "127.0.0.1:8080"
+#define VTFS_UNIX_PREFIX "unix:"
+#define VTFS_MAX_ENDPOINTS 16
+// virtual nodes per backend on the hash ring, more nodes - smoother spread
+#define VTFS_RING_VNODES 64
+#define VTFS_FNV_OFFSET 2166136261u
+#define VTFS_FNV_PRIME 16777619u
+// keep-alive connections per backend
+#define VTFS_POOL_SIZE 8
+// the first connections of a pool are never given to bulk transfers
+#define VTFS_META_RESERVED 2
+// requests written to one connection before their responses are read
+#define VTFS_PIPELINE_MAX 16
+#define VTFS_HEADER_MAX 1024
+
+// stale keep-alive connection, the server closed it before answering
+#define VTFS_CLOSED 1
+// tokens with an open session per backend, one per mount normally
+#define VTFS_MAX_SESSIONS 8
+// the backend doesn't know the sid, it was restarted or closed the session
+#define VTFS_SESSION_STALE (-116)
+// "token=" + 63 chars of token
+#define VTFS_AUTH_MAX 80
+
+struct vtfs_conn {
+  struct socket *sock;
+  bool busy;
+  // bytes received past the end of the previous response
+  char buf[VTFS_HEADER_MAX];
+  size_t buf_start;
+  size_t buf_len;
+  char header[VTFS_HEADER_MAX + 1];
+};
+
+struct vtfs_session {
+  char token[64];
+  int64_t sid; // 0 - free slot
+};
+
+struct vtfs_endpoint {
+  // "ip:port" or "unix:/path" as given in mount options, also the ring label
+  char spec[128];
+  char host[48];
+  int family;
+  union {
+    struct sockaddr_in in;
+    struct sockaddr_un un;
+  } addr;
+  int addr_len;
+
+  yufs_mutex_t pool_lock;
+  yufs_waitq_t pool_wait;
+  struct vtfs_conn *conns;
+  int meta_waiting;
+
+  yufs_mutex_t session_lock;
+  struct vtfs_session sessions[VTFS_MAX_SESSIONS];
+};
+
+struct vtfs_ring_point {
+  uint32_t hash;
+  int endpoint;
+};
+
+static struct vtfs_endpoint endpoints[VTFS_MAX_ENDPOINTS];
+static int endpoint_count;
+
+static struct vtfs_ring_point ring[VTFS_MAX_ENDPOINTS * VTFS_RING_VNODES];
+static int ring_size;
+
+// The backends and the ring are shared by every mount. They are replaced
+// only under backends_lock and only while no session is open, so requests
+// of a mounted token read them without locking.
+static yufs_mutex_t backends_lock;
+static int sessions_open;
+
+// counters are kept per token, that is per mount. The last slot collects
+// requests of tokens without a session.
+#define VTFS_STATS_SLOTS (VTFS_MAX_SESSIONS + 1)
+#define VTFS_STATS_UNKEYED (VTFS_STATS_SLOTS - 1)
+
+static const char *const methods[] = {
+    "lookup", "create",  "link",    "unlink",  "rmdir",
+    "getattr", "read",   "write",   "iterate", "session",
+    "session_close", "prefetch", "lease", "statfs", "rename",
+    "fallocate", "copy_range", "other",
+};
+#define VTFS_METHOD_COUNT (sizeof(methods) / sizeof(methods[0]))
+
+struct vtfs_cpu_stats {
+  struct vtfs_method_stats methods[VTFS_METHOD_MAX];
+};
+
+// A token takes a slot with its first session and gives it back with the
+// last one. The per-cpu counters live as long as the module, a request
+// racing the close only counts into a slot that is being reused.
+struct vtfs_token_stats {
+  char token[64];
+  int sessions;
+  struct vtfs_class_stats classes[VTFS_PRIO_COUNT];
+  struct vtfs_cpu_stats *cpu;
+};
+
+static yufs_mutex_t stats_lock;
+static struct vtfs_token_stats token_stats[VTFS_STATS_SLOTS];
+
+static uint32_t vtfs_fnv1a(const void *data, size_t len, uint32_t hash) {
+  const unsigned char *p = data;
+  while (len--) {
+    hash ^= *p++;
+    hash *= VTFS_FNV_PRIME;
+  }
+  return hash;
+}
+
+// murmur3 finalizer, spreads fnv output over the whole ring
+static uint32_t vtfs_mix(uint32_t hash) {
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6b;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+static int ring_point_cmp(const void *a, const void *b) {
+  const struct vtfs_ring_point *l = a, *r = b;
+  if (l->hash == r->hash) {
+    return 0;
+  }
+  return l->hash < r->hash ? -1 : 1;
+}
+
+// a local backend listening on a unix stream socket
+static int parse_unix_endpoint(const char *spec,
+                               struct vtfs_endpoint *endpoint) {
+  const char *path = spec + strlen(VTFS_UNIX_PREFIX);
+
+  if (*path == '\0' || strlen(path) >= sizeof(endpoint->addr.un.sun_path)) {
+    return -EINVAL;
+  }
+
+  endpoint->family = AF_UNIX;
+  endpoint->addr.un.sun_family = AF_UNIX;
+  strcpy(endpoint->addr.un.sun_path, path);
+  endpoint->addr_len = sizeof(struct sockaddr_un);
+  strcpy(endpoint->host, "localhost");
+  return 0;
+}
+
+static int parse_endpoint(const char *spec, struct vtfs_endpoint *endpoint) {
+  if (strlen(spec) >= sizeof(endpoint->spec)) {
+    return -EINVAL;
+  }
+  memset(endpoint, 0, sizeof(struct vtfs_endpoint));
+  strcpy(endpoint->spec, spec);
+
+  if (strncmp(spec, VTFS_UNIX_PREFIX, strlen(VTFS_UNIX_PREFIX)) == 0) {
+    return parse_unix_endpoint(spec, endpoint);
+  }
+
+  const char *colon = strrchr(spec, ':');
+  int port;
+
+  if (colon == 0 || colon == spec || colon - spec >= sizeof(endpoint->host)) {
+    return -EINVAL;
+  }
+  if (kstrtoint(colon + 1, 10, &port) != 0 || port <= 0 || port > 65535) {
+    return -EINVAL;
+  }
+
+  memcpy(endpoint->host, spec, colon - spec);
+
+  endpoint->family = AF_INET;
+  endpoint->addr.in.sin_family = AF_INET;
+  endpoint->addr.in.sin_port = htons(port);
+  endpoint->addr_len = sizeof(struct sockaddr_in);
+  if (in4_pton(endpoint->host, -1, (u8 *)&endpoint->addr.in.sin_addr.s_addr,
+               -1, NULL) != 1) {
+    return -EINVAL;
+  }
+  return 0;
+}
+
+static void endpoints_destroy(void) {
+  for (int i = 0; i < endpoint_count; i++) {
+    for (int c = 0; c < VTFS_POOL_SIZE; c++) {
+      struct socket *sock = endpoints[i].conns[c].sock;
+      if (sock != 0) {
+        kernel_sock_shutdown(sock, SHUT_RDWR);
+        sock_release(sock);
+      }
+    }
+    kfree(endpoints[i].conns);
+  }
+  endpoint_count = 0;
+  ring_size = 0;
+}
+
+static bool backends_equal(const struct vtfs_endpoint *parsed, int count) {
+  if (count != endpoint_count) {
+    return false;
+  }
+  for (int i = 0; i < count; i++) {
+    if (strcmp(parsed[i].spec, endpoints[i].spec) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// spec is a '+' separated list of "ip:port" or "unix:/path" backends.
+// Every backend owns VTFS_RING_VNODES points on the ring, so adding one
+// backend moves only ~1/n of the keys to it. Mounting with the backends
+// already in use is fine, other backends are refused with -EBUSY while a
+// session is open.
+int vtfs_http_set_backends(const char *spec) {
+  int count = 0;
+
+  struct vtfs_endpoint *parsed =
+      kcalloc(VTFS_MAX_ENDPOINTS, sizeof(struct vtfs_endpoint), GFP_KERNEL);
+  char *copy = kstrdup(spec, GFP_KERNEL);
+  if (parsed == 0 || copy == 0) {
+    kfree(parsed);
+    kfree(copy);
+    return -ENOMEM;
+  }
+
+  char *cursor = copy;
+  char *item;
+  while ((item = strsep(&cursor, "+")) != 0) {
+    if (*item == '\0') {
+      continue;
+    }
+    if (count == VTFS_MAX_ENDPOINTS || parse_endpoint(item, &parsed[count]) != 0) {
+      printk(KERN_ERR "YUFS: bad backend '%s'\n", item);
+      kfree(copy);
+      kfree(parsed);
+      return -EINVAL;
+    }
+    count++;
+  }
+  kfree(copy);
+
+  if (count == 0) {
+    kfree(parsed);
+    return -EINVAL;
+  }
+
+  for (int i = 0; i < count; i++) {
+    parsed[i].conns =
+        kcalloc(VTFS_POOL_SIZE, sizeof(struct vtfs_conn), GFP_KERNEL);
+    if (parsed[i].conns == 0) {
+      while (i--) {
+        kfree(parsed[i].conns);
+      }
+      kfree(parsed);
+      return -ENOMEM;
+    }
+  }
+
+  YUFS_MUTEX_LOCK(&backends_lock);
+  bool same = backends_equal(parsed, count);
+  if (same || sessions_open > 0) {
+    int error = same ? 0 : -EBUSY;
+    YUFS_MUTEX_UNLOCK(&backends_lock);
+    if (error != 0) {
+      printk(KERN_ERR "YUFS: backends can't change while mounted\n");
+    }
+    for (int i = 0; i < count; i++) {
+      kfree(parsed[i].conns);
+    }
+    kfree(parsed);
+    return error;
+  }
+
+  endpoints_destroy();
+  memcpy(endpoints, parsed, sizeof(struct vtfs_endpoint) * count);
+  endpoint_count = count;
+  kfree(parsed);
+  for (int i = 0; i < endpoint_count; i++) {
+    YUFS_MUTEX_INIT(&endpoints[i].pool_lock);
+    YUFS_WAITQ_INIT(&endpoints[i].pool_wait);
+    YUFS_MUTEX_INIT(&endpoints[i].session_lock);
+  }
+
+  ring_size = 0;
+  for (int i = 0; i < endpoint_count; i++) {
+    for (int v = 0; v < VTFS_RING_VNODES; v++) {
+      char label[sizeof(endpoints[i].spec) + 16];
+      int len = snprintf(label, sizeof(label), "%s#%d", endpoints[i].spec, v);
+      ring[ring_size].hash = vtfs_mix(vtfs_fnv1a(label, len, VTFS_FNV_OFFSET));
+      ring[ring_size].endpoint = i;
+      ring_size++;
+    }
+  }
+  sort(ring, ring_size, sizeof(struct vtfs_ring_point), ring_point_cmp, NULL);
+
+  for (int i = 0; i < endpoint_count; i++) {
+    printk(KERN_INFO "YUFS: backend %d is %s\n", i, endpoints[i].spec);
+  }
+  YUFS_MUTEX_UNLOCK(&backends_lock);
+  return 0;
+}
+
+static void stats_free(void) {
+  for (int i = 0; i < VTFS_STATS_SLOTS; i++) {
+    YUFS_PERCPU_FREE(token_stats[i].cpu);
+    token_stats[i].cpu = 0;
+  }
+}
+
+int vtfs_http_init(void) {
+  YUFS_MUTEX_INIT(&backends_lock);
+  sessions_open = 0;
+  YUFS_MUTEX_INIT(&stats_lock);
+  memset(token_stats, 0, sizeof(token_stats));
+  for (int i = 0; i < VTFS_STATS_SLOTS; i++) {
+    token_stats[i].cpu = YUFS_PERCPU_ALLOC(struct vtfs_cpu_stats);
+    if (token_stats[i].cpu == 0) {
+      stats_free();
+      return -ENOMEM;
+    }
+  }
+  int error = vtfs_http_set_backends(VTFS_DEFAULT_BACKENDS);
+  if (error != 0) {
+    stats_free();
+  }
+  return error;
+}
+
+// stats_lock held, -1 when the token has no session
+static int stats_find(const char *token) {
+  for (int i = 0; i < VTFS_STATS_UNKEYED; i++) {
+    if (token_stats[i].sessions > 0 &&
+        strcmp(token_stats[i].token, token) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// the slot a request of token counts into
+static int stats_slot(const char *token) {
+  if (token == 0) {
+    return VTFS_STATS_UNKEYED;
+  }
+  YUFS_MUTEX_LOCK(&stats_lock);
+  int slot = stats_find(token);
+  YUFS_MUTEX_UNLOCK(&stats_lock);
+  return slot < 0 ? VTFS_STATS_UNKEYED : slot;
+}
+
+// stats_lock held
+static void stats_clear(struct vtfs_token_stats *stats) {
+  int cpu;
+
+  memset(stats->classes, 0, sizeof(stats->classes));
+  YUFS_FOR_EACH_CPU(cpu) {
+    memset(YUFS_PERCPU_PTR(stats->cpu, cpu), 0, sizeof(struct vtfs_cpu_stats));
+  }
+}
+
+static void stats_attach(const char *token) {
+  YUFS_MUTEX_LOCK(&stats_lock);
+  int slot = stats_find(token);
+  if (slot < 0) {
+    for (int i = 0; i < VTFS_STATS_UNKEYED && slot < 0; i++) {
+      if (token_stats[i].sessions == 0) {
+        slot = i;
+      }
+    }
+    if (slot >= 0) {
+      strlcpy(token_stats[slot].token, token, sizeof(token_stats[slot].token));
+      stats_clear(&token_stats[slot]);
+    }
+  }
+  // more tokens than slots share the unkeyed one
+  if (slot >= 0) {
+    token_stats[slot].sessions++;
+  }
+  YUFS_MUTEX_UNLOCK(&stats_lock);
+}
+
+static void stats_detach(const char *token) {
+  YUFS_MUTEX_LOCK(&stats_lock);
+  int slot = stats_find(token);
+  if (slot >= 0) {
+    token_stats[slot].sessions--;
+  }
+  YUFS_MUTEX_UNLOCK(&stats_lock);
+}
+
+void vtfs_http_class_stats(const char *token, int prio,
+                           struct vtfs_class_stats *out) {
+  memset(out, 0, sizeof(*out));
+  YUFS_MUTEX_LOCK(&stats_lock);
+  int slot = stats_find(token);
+  if (slot >= 0) {
+    *out = token_stats[slot].classes[prio];
+  }
+  YUFS_MUTEX_UNLOCK(&stats_lock);
+}
+
+static void account(const struct vtfs_http_req *req, uint64_t latency_ns) {
+  struct vtfs_class_stats *stats = &token_stats[req->stats].classes[req->prio];
+  int64_t ret = req->ret;
+
+  YUFS_MUTEX_LOCK(&stats_lock);
+  stats->count++;
+  // backend -1 is a normal "no such entry", only transport errors count
+  if (ret < -1) {
+    stats->errors++;
+  }
+  stats->total_ns += latency_ns;
+  if (latency_ns > stats->max_ns) {
+    stats->max_ns = latency_ns;
+  }
+  YUFS_MUTEX_UNLOCK(&stats_lock);
+}
+
+int vtfs_http_method_count(void) { return VTFS_METHOD_COUNT; }
+
+const char *vtfs_http_method_name(int method) { return methods[method]; }
+
+static int method_index(const char *method) {
+  for (int i = 0; i < VTFS_METHOD_COUNT - 1; i++) {
+    if (strcmp(methods[i], method) == 0) {
+      return i;
+    }
+  }
+  return VTFS_METHOD_COUNT - 1;
+}
+
+void vtfs_http_method_stats(const char *token, int method,
+                            struct vtfs_method_stats *out) {
+  int cpu;
+
+  memset(out, 0, sizeof(*out));
+  YUFS_MUTEX_LOCK(&stats_lock);
+  int slot = stats_find(token);
+  YUFS_MUTEX_UNLOCK(&stats_lock);
+  if (slot < 0) {
+    return;
+  }
+  YUFS_FOR_EACH_CPU(cpu) {
+    const struct vtfs_method_stats *stats =
+        &YUFS_PERCPU_PTR(token_stats[slot].cpu, cpu)->methods[method];
+    for (int phase = 0; phase < VTFS_PHASE_COUNT; phase++) {
+      for (int b = 0; b < VTFS_HIST_BUCKETS; b++) {
+        out->hist[phase][b] += stats->hist[phase][b];
+      }
+      out->total_ns[phase] += stats->total_ns[phase];
+    }
+    out->bytes_sent += stats->bytes_sent;
+    out->bytes_received += stats->bytes_received;
+  }
+}
+
+void vtfs_http_reset_stats(const char *token) {
+  YUFS_MUTEX_LOCK(&stats_lock);
+  int slot = stats_find(token);
+  if (slot >= 0) {
+    stats_clear(&token_stats[slot]);
+  }
+  YUFS_MUTEX_UNLOCK(&stats_lock);
+}
+
+static int hist_bucket(uint64_t ns) {
+  uint64_t us = ns / 1000;
+  int bucket = 0;
+  while (us != 0 && bucket < VTFS_HIST_BUCKETS - 1) {
+    us >>= 1;
+    bucket++;
+  }
+  return bucket;
+}
+
+// returns the end time, it starts the next phase
+static uint64_t phase_done(const struct vtfs_http_req *req, int phase,
+                           uint64_t start) {
+  uint64_t now = YUFS_NOW_NS();
+  struct vtfs_cpu_stats *stats = YUFS_PERCPU_GET(token_stats[req->stats].cpu);
+  struct vtfs_method_stats *method = &stats->methods[req->method];
+
+  YUFS_STAT_ADD(&method->hist[phase][hist_bucket(now - start)], 1);
+  YUFS_STAT_ADD(&method->total_ns[phase], now - start);
+  YUFS_PERCPU_PUT(token_stats[req->stats].cpu);
+  return now;
+}
+
+static void count_bytes(const struct vtfs_http_req *req, size_t sent,
+                        size_t received) {
+  struct vtfs_cpu_stats *stats = YUFS_PERCPU_GET(token_stats[req->stats].cpu);
+  struct vtfs_method_stats *method = &stats->methods[req->method];
+
+  YUFS_STAT_ADD(&method->bytes_sent, sent);
+  YUFS_STAT_ADD(&method->bytes_received, received);
+  YUFS_PERCPU_PUT(token_stats[req->stats].cpu);
+}
+
+void vtfs_http_destroy(void) {
+  endpoints_destroy();
+  stats_free();
+}
+
+// first ring point clockwise from hash(token, route_id)
+static struct vtfs_endpoint *vtfs_route(const char *token, uint32_t route_id) {
+  uint32_t key = vtfs_fnv1a(token, strlen(token), VTFS_FNV_OFFSET);
+  key = vtfs_mix(vtfs_fnv1a(&route_id, sizeof(route_id), key));
+
+  int lo = 0;
+  int hi = ring_size;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (ring[mid].hash < key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == ring_size) {
+    lo = 0;
+  }
+  return &endpoints[ring[lo].endpoint];
+}
+
+// Bulk transfers stay off the reserved connections and yield every free
+// connection to waiting metadata requests, so a lookup never queues behind
+// more than one bulk chunk.
+static struct vtfs_conn *pool_pick(struct vtfs_endpoint *endpoint, int prio) {
+  int first = prio == VTFS_PRIO_META ? 0 : VTFS_META_RESERVED;
+  if (prio == VTFS_PRIO_BULK && endpoint->meta_waiting > 0) {
+    return 0;
+  }
+
+  // prefer a connection that is already open
+  struct vtfs_conn *found = 0;
+  for (int i = first; i < VTFS_POOL_SIZE; i++) {
+    struct vtfs_conn *conn = &endpoint->conns[i];
+    if (!conn->busy && (found == 0 || (found->sock == 0 && conn->sock != 0))) {
+      found = conn;
+    }
+  }
+  return found;
+}
+
+static struct vtfs_conn *pool_acquire(struct vtfs_endpoint *endpoint,
+                                      int prio) {
+  bool waiting = false;
+
+  while (true) {
+    YUFS_MUTEX_LOCK(&endpoint->pool_lock);
+    struct vtfs_conn *found = pool_pick(endpoint, prio);
+    if (found != 0) {
+      found->busy = true;
+      if (waiting) {
+        endpoint->meta_waiting--;
+      }
+      YUFS_MUTEX_UNLOCK(&endpoint->pool_lock);
+      if (waiting) {
+        // bulk waiters may go again
+        YUFS_WAKE_UP(&endpoint->pool_wait);
+      }
+      return found;
+    }
+    if (prio == VTFS_PRIO_META && !waiting) {
+      endpoint->meta_waiting++;
+      waiting = true;
+    }
+    YUFS_MUTEX_UNLOCK(&endpoint->pool_lock);
+    YUFS_WAIT_EVENT(&endpoint->pool_wait, pool_pick(endpoint, prio) != 0);
+  }
+}
+
+static void conn_close(struct vtfs_conn *conn) {
+  if (conn->sock != 0) {
+    kernel_sock_shutdown(conn->sock, SHUT_RDWR);
+    sock_release(conn->sock);
+    conn->sock = 0;
+  }
+  conn->buf_start = 0;
+  conn->buf_len = 0;
+}
+
+// broken connections are closed, the stream can't be resynchronized
+static void pool_release(struct vtfs_endpoint *endpoint, struct vtfs_conn *conn,
+                         bool broken) {
+  if (broken) {
+    conn_close(conn);
+  }
+  YUFS_MUTEX_LOCK(&endpoint->pool_lock);
+  conn->busy = false;
+  YUFS_MUTEX_UNLOCK(&endpoint->pool_lock);
+  YUFS_WAKE_UP(&endpoint->pool_wait);
+}
+
+// -2 when the backend can't be reached, -1 is left to the backend's own
+// refusals
+static int conn_open(struct vtfs_endpoint *endpoint, struct vtfs_conn *conn) {
+  int protocol = endpoint->family == AF_INET ? IPPROTO_TCP : 0;
+  int error = sock_create_kern(&init_net, endpoint->family, SOCK_STREAM,
+                               protocol, &conn->sock);
+  if (error < 0) {
+    conn->sock = 0;
+    return -2;
+  }
+
+  error = kernel_connect(conn->sock, (struct sockaddr *)&endpoint->addr,
+                         endpoint->addr_len, 0);
+  if (error != 0) {
+    sock_release(conn->sock);
+    conn->sock = 0;
+    return -2;
+  }
+  conn->buf_start = 0;
+  conn->buf_len = 0;
+  return 0;
+}
+
+// "sid=N" once a session with the backend is open, "token=T" otherwise
+static void session_auth(struct vtfs_endpoint *endpoint, const char *token,
+                         char *auth) {
+  int64_t sid = 0;
+
+  YUFS_MUTEX_LOCK(&endpoint->session_lock);
+  for (int i = 0; i < VTFS_MAX_SESSIONS; i++) {
+    struct vtfs_session *session = &endpoint->sessions[i];
+    if (session->sid != 0 && strcmp(session->token, token) == 0) {
+      sid = session->sid;
+      break;
+    }
+  }
+  YUFS_MUTEX_UNLOCK(&endpoint->session_lock);
+
+  if (sid != 0) {
+    snprintf(auth, VTFS_AUTH_MAX, "sid=%lld", (long long)sid);
+  } else {
+    snprintf(auth, VTFS_AUTH_MAX, "token=%s", token);
+  }
+}
+
+static void session_store(struct vtfs_endpoint *endpoint, const char *token,
+                          int64_t sid) {
+  struct vtfs_session *slot = &endpoint->sessions[0];
+
+  YUFS_MUTEX_LOCK(&endpoint->session_lock);
+  for (int i = 0; i < VTFS_MAX_SESSIONS; i++) {
+    struct vtfs_session *session = &endpoint->sessions[i];
+    if (strcmp(session->token, token) == 0) {
+      slot = session;
+      break;
+    }
+    if (session->sid == 0) {
+      slot = session;
+    }
+  }
+  strlcpy(slot->token, token, sizeof(slot->token));
+  slot->sid = sid;
+  YUFS_MUTEX_UNLOCK(&endpoint->session_lock);
+}
+
+// callee should call vtfs_http_release on prepared request.
+// A request with a body goes as POST, the body itself is sent from the
+// caller's buffer.
+static int fill_request(struct vtfs_http_req *req,
+                        const struct vtfs_endpoint *endpoint, const char *auth,
+                        const char *method, size_t arg_size, va_list args) {
+  const char *prefix = req->body_len > 0 ? "POST /api/" : "GET /api/";
+  static const char host_line[] = " HTTP/1.1\r\nHost:";
+  static const char end_line[] = "\r\n\r\n";
+  char length_line[40] = "";
+  va_list sizing;
+
+  if (req->body_len > 0) {
+    snprintf(length_line, sizeof(length_line), "\r\nContent-Length: %lu",
+             (unsigned long)req->body_len);
+  }
+
+  size_t length = strlen(prefix) + strlen(method) + 1 + strlen(auth) +
+                  strlen(host_line) + strlen(endpoint->host) +
+                  strlen(length_line) + strlen(end_line);
+
+  va_copy(sizing, args);
+  for (int i = 0; i < arg_size; i++) {
+    length += 2 + strlen(va_arg(sizing, char *));
+    length += strlen(va_arg(sizing, char *));
+  }
+  va_end(sizing);
+
+  char *request_buffer = kmalloc(length + 1, GFP_KERNEL);
   if (request_buffer == 0) {
     return -ENOMEM;
   }
 
-  strcpy(request_buffer, "GET /api/");
-  strcat(request_buffer, method);
+  char *cursor = request_buffer;
+#define VTFS_APPEND(str)                                                       \
+  do {                                                                         \
+    const char *append_ = (str);                                               \
+    size_t len = strlen(append_);                                              \
+    memcpy(cursor, append_, len);                                              \
+    cursor += len;                                                             \
+  } while (0)
 
-  strcat(request_buffer, "?token=");
-  strcat(request_buffer, token);
+  VTFS_APPEND(prefix);
+  VTFS_APPEND(method);
+  *cursor++ = '?';
+  req->auth_start = cursor - request_buffer;
+  req->auth_len = strlen(auth);
+  VTFS_APPEND(auth);
 
   for (int i = 0; i < arg_size; i++) {
-    strcat(request_buffer, "&");
-    strcat(request_buffer, va_arg(args, char *));
-    strcat(request_buffer, "=");
-    strcat(request_buffer, va_arg(args, char *));
+    *cursor++ = '&';
+    VTFS_APPEND(va_arg(args, char *));
+    *cursor++ = '=';
+    VTFS_APPEND(va_arg(args, char *));
   }
 
-  strcat(request_buffer, " HTTP/1.1\r\nHost:");
-  strcat(request_buffer, SERVER_IP);
-  strcat(request_buffer, "\r\nConnection: close\r\n\r\n");
+  VTFS_APPEND(host_line);
+  VTFS_APPEND(endpoint->host);
+  VTFS_APPEND(length_line);
+  VTFS_APPEND(end_line);
+#undef VTFS_APPEND
+  *cursor = '\0';
 
-  memset(vec, 0, sizeof(struct kvec));
-  vec->iov_base = request_buffer;
-  vec->iov_len = strlen(request_buffer);
+  memset(&req->request, 0, sizeof(struct kvec));
+  req->method = method_index(method);
+  req->request.iov_base = request_buffer;
+  req->request.iov_len = cursor - request_buffer;
 
   return 0;
 }
 
-int receive_all(struct socket *sock, char *buffer, size_t buffer_size) {
+static int prepare_with_auth(struct vtfs_http_req *req,
+                             struct vtfs_endpoint *endpoint, const char *auth,
+                             const char *method, char *response_buffer,
+                             size_t buffer_size, size_t arg_size, ...) {
+  va_list args;
+  memset(req, 0, sizeof(struct vtfs_http_req));
+  req->endpoint = endpoint;
+  req->prio = VTFS_PRIO_META;
+  req->stats = VTFS_STATS_UNKEYED;
+  req->response = response_buffer;
+  req->response_size = buffer_size;
+  va_start(args, arg_size);
+  int error = fill_request(req, endpoint, auth, method, arg_size, args);
+  va_end(args);
+  return error;
+}
+
+int vtfs_http_vprepare(struct vtfs_http_req *req, const char *token,
+                       const char *method, uint32_t route_id, int prio,
+                       char *response_buffer, size_t buffer_size,
+                       const char *body, size_t body_len, size_t arg_size,
+                       va_list args) {
+  char auth[VTFS_AUTH_MAX];
+
+  memset(req, 0, sizeof(struct vtfs_http_req));
+  req->endpoint = vtfs_route(token, route_id);
+  req->token = token;
+  req->prio = prio;
+  req->stats = stats_slot(token);
+  req->response = response_buffer;
+  req->response_size = buffer_size;
+  req->body = body;
+  req->body_len = body_len;
+  session_auth(req->endpoint, token, auth);
+  return fill_request(req, req->endpoint, auth, method, arg_size, args);
+}
+
+int vtfs_http_prepare(struct vtfs_http_req *req, const char *token,
+                      const char *method, uint32_t route_id, int prio,
+                      char *response_buffer, size_t buffer_size,
+                      const char *body, size_t body_len, size_t arg_size, ...) {
+  va_list args;
+  va_start(args, arg_size);
+  int error =
+      vtfs_http_vprepare(req, token, method, route_id, prio, response_buffer,
+                         buffer_size, body, body_len, arg_size, args);
+  va_end(args);
+  return error;
+}
+
+void vtfs_http_release(struct vtfs_http_req *req) {
+  kfree(req->request.iov_base);
+  req->request.iov_base = 0;
+}
+
+static int send_all(struct socket *sock, const char *data, size_t size) {
+  size_t sent = 0;
+  while (sent < size) {
+    struct msghdr msg;
+    struct kvec vec = {.iov_base = (char *)data + sent, .iov_len = size - sent};
+    memset(&msg, 0, sizeof(struct msghdr));
+    int ret = kernel_sendmsg(sock, &msg, &vec, 1, vec.iov_len);
+    if (ret <= 0) {
+      return -3;
+    }
+    sent += ret;
+  }
+  return 0;
+}
+
+static int receive_some(struct socket *sock, char *buffer, size_t size) {
   struct msghdr hdr;
-  struct kvec vec;
+  struct kvec vec = {.iov_base = buffer, .iov_len = size};
+  memset(&hdr, 0, sizeof(struct msghdr));
+  return kernel_recvmsg(sock, &hdr, &vec, 1, size, 0);
+}
 
-  int read = 0;
+// copies size bytes of the body to buffer, buffered bytes first, the rest is
+// received straight into buffer. buffer == 0 drops the bytes.
+static int receive_exact(struct vtfs_conn *conn, char *buffer, size_t size) {
+  size_t buffered = conn->buf_len < size ? conn->buf_len : size;
+  if (buffered > 0) {
+    if (buffer != 0) {
+      memcpy(buffer, conn->buf + conn->buf_start, buffered);
+      buffer += buffered;
+    }
+    conn->buf_start += buffered;
+    conn->buf_len -= buffered;
+    size -= buffered;
+  }
 
-  while (read < buffer_size) {
-    memset(&hdr, 0, sizeof(struct msghdr));
-    memset(&vec, 0, sizeof(struct kvec));
-    vec.iov_base = buffer + read;
-    vec.iov_len = buffer_size - read;
-    int ret = kernel_recvmsg(sock, &hdr, &vec, 1, vec.iov_len, 0);
-    if (ret == 0) {
-      break;
-    } else if (ret < 0) {
+  while (size > 0) {
+    char *target = buffer;
+    size_t chunk = size;
+    if (target == 0) {
+      target = conn->buf;
+      chunk = size < sizeof(conn->buf) ? size : sizeof(conn->buf);
+    }
+    int ret = receive_some(conn->sock, target, chunk);
+    if (ret <= 0) {
       return -4;
     }
-    read += ret;
+    if (buffer != 0) {
+      buffer += ret;
+    }
+    size -= ret;
   }
+  return 0;
+}
 
-  return read;
+static char *find_header_end(char *data, size_t size) {
+  for (size_t i = 3; i < size; i++) {
+    if (data[i - 3] == '\r' && data[i - 2] == '\n' && data[i - 1] == '\r' &&
+        data[i] == '\n') {
+      return data + i + 1;
+    }
+  }
+  return 0;
 }
 
-int64_t parse_http_response(char *raw_response, size_t raw_response_size,
-                            char *response, size_t response_size) {
-  char *buffer = raw_response;
+// moves the response header into conn->header, the body stays in conn->buf
+static int receive_header(struct vtfs_conn *conn) {
+  memmove(conn->buf, conn->buf + conn->buf_start, conn->buf_len);
+  conn->buf_start = 0;
 
+  char *end;
+  while ((end = find_header_end(conn->buf, conn->buf_len)) == 0) {
+    if (conn->buf_len == sizeof(conn->buf)) {
+      return -6;
+    }
+    int ret = receive_some(conn->sock, conn->buf + conn->buf_len,
+                           sizeof(conn->buf) - conn->buf_len);
+    if (ret == 0 && conn->buf_len == 0) {
+      return VTFS_CLOSED;
+    }
+    if (ret <= 0) {
+      return -4;
+    }
+    conn->buf_len += ret;
+  }
+
+  size_t header_len = end - conn->buf;
+  memcpy(conn->header, conn->buf, header_len);
+  conn->header[header_len] = '\0';
+  conn->buf_start = header_len;
+  conn->buf_len -= header_len;
+  return 0;
+}
+
+static int parse_http_header(char *buffer, int *length) {
   // Read Response Line
   {
     char *status_line = strsep(&buffer, "\r");
@@ -71,13 +891,12 @@ int64_t parse_http_response(char *raw_response, size_t raw_response_size,
       return -6;
     }
     char *status_code = strsep(&status_line, " ");
-    printk(KERN_INFO "Received response with status code %s\n", status_code);
     if (strcmp(status_code, "200") != 0) {
       return -5;
     }
   }
 
-  int length = -1;
+  *length = -1;
 
   while (true) {
     if (buffer == 0) {
@@ -91,111 +910,304 @@ int64_t parse_http_response(char *raw_response, size_t raw_response_size,
     }
 
     if (strncmp(header, "Content-Length: ", 16) == 0) {
-      int error = kstrtoint(header + 16, 0, &length);
+      int error = kstrtoint(header + 16, 0, length);
       if (error != 0) {
         return -6;
       }
-      printk(KERN_INFO "Received response with content length %d\n", length);
     }
   }
-  ++buffer; // skip last '\n'
 
-  if (length == -1) {
+  if (*length == -1) {
     return -6;
   }
+  return 0;
+}
 
-  if (buffer + length > raw_response + raw_response_size) {
-    return -6;
+// Returns the backend return value. *broken tells that the connection
+// can't carry the next response anymore.
+static int64_t receive_response(struct vtfs_conn *conn,
+                                struct vtfs_http_req *req, bool *broken) {
+  char *response = req->response;
+  size_t response_size = req->response_size;
+  int length;
+  int64_t return_value;
+  uint64_t start = YUFS_NOW_NS();
+
+  *broken = true;
+  int error = receive_header(conn);
+  if (error != 0) {
+    return error;
+  }
+  start = phase_done(req, VTFS_PHASE_TTFB, start);
+  size_t header_len = strlen(conn->header);
+  error = parse_http_header(conn->header, &length);
+  if (error != 0) {
+    return error;
   }
+  start = phase_done(req, VTFS_PHASE_PARSE, start);
+  count_bytes(req, 0, header_len + (length > 0 ? length : 0));
 
   if (length < sizeof(int64_t)) {
     return -7;
   }
-
+  if (receive_exact(conn, (char *)&return_value, sizeof(int64_t)) != 0) {
+    return -4;
+  }
   length -= sizeof(int64_t);
 
   if (length > response_size) {
+    // drain the body to keep the connection usable
+    if (receive_exact(conn, 0, length) != 0) {
+      return -4;
+    }
+    *broken = false;
     return -ENOSPC;
   }
 
-  int64_t return_value;
-  memcpy(&return_value, buffer, sizeof(int64_t));
-
-  buffer += sizeof(int64_t);
-  memcpy(response, buffer, length);
-
+  if (receive_exact(conn, response, length) != 0) {
+    return -4;
+  }
+  phase_done(req, VTFS_PHASE_RECV, start);
+  *broken = false;
   return return_value;
 }
 
-int64_t vtfs_http_call(const char *token, const char *method,
-                            char *response_buffer, size_t buffer_size,
-                            size_t arg_size, ...) {
-  struct socket *sock;
-  int64_t error;
+// Writes all requests to one connection, then reads the responses in order.
+// A reused connection may have been closed by the server while idle, in that
+// case nothing was processed and the whole batch is resent once.
+static void vtfs_http_pipeline(struct vtfs_endpoint *endpoint,
+                               struct vtfs_http_req **reqs, size_t count) {
+  for (int attempt = 0; attempt < 2; attempt++) {
+    struct vtfs_conn *conn = pool_acquire(endpoint, reqs[0]->prio);
+    bool reused = conn->sock != 0;
+    bool broken = false;
+    int64_t error = 0;
 
-  error = sock_create_kern(&init_net, AF_INET, SOCK_STREAM, IPPROTO_TCP, &sock);
-  if (error < 0) {
-    return -1;
+    uint64_t start = YUFS_NOW_NS();
+    if (!reused) {
+      error = conn_open(endpoint, conn);
+      start = phase_done(reqs[0], VTFS_PHASE_CONNECT, start);
+    }
+    for (size_t i = 0; error == 0 && i < count; i++) {
+      error = send_all(conn->sock, reqs[i]->request.iov_base,
+                       reqs[i]->request.iov_len);
+      if (error == 0 && reqs[i]->body_len > 0) {
+        error = send_all(conn->sock, reqs[i]->body, reqs[i]->body_len);
+      }
+      if (error == 0) {
+        start = phase_done(reqs[i], VTFS_PHASE_SEND, start);
+        count_bytes(reqs[i], reqs[i]->request.iov_len + reqs[i]->body_len, 0);
+      }
+    }
+    if (error != 0) {
+      pool_release(endpoint, conn, true);
+      if (reused) {
+        continue;
+      }
+      for (size_t i = 0; i < count; i++) {
+        reqs[i]->ret = error;
+      }
+      return;
+    }
+
+    size_t done = 0;
+    for (; done < count; done++) {
+      struct vtfs_http_req *req = reqs[done];
+      req->ret = receive_response(conn, req, &broken);
+      if (broken) {
+        break;
+      }
+    }
+    pool_release(endpoint, conn, broken);
+
+    if (!broken) {
+      return;
+    }
+    if (done == 0 && reused && reqs[0]->ret == VTFS_CLOSED) {
+      continue;
+    }
+    for (size_t i = done; i < count; i++) {
+      reqs[i]->ret = reqs[done]->ret == VTFS_CLOSED ? -4 : reqs[done]->ret;
+    }
+    return;
+  }
+  for (size_t i = 0; i < count; i++) {
+    reqs[i]->ret = -4;
   }
+}
 
-  struct sockaddr_in s_addr = {.sin_family = AF_INET,
-                               .sin_addr = {.s_addr = in_aton(SERVER_IP)},
-                               .sin_port = htons(SERVER_PORT)};
+// one pipeline per backend and priority class
+static void exec_groups(struct vtfs_http_req **reqs, size_t count) {
+  struct vtfs_http_req *group[VTFS_PIPELINE_MAX];
 
-  error = kernel_connect(sock, (struct sockaddr *)&s_addr,
-                         sizeof(struct sockaddr_in), 0);
-  if (error != 0) {
+  for (size_t i = 0; i < count; i++) {
+    reqs[i]->sent = false;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (reqs[i]->sent) {
+      continue;
+    }
+    size_t n = 0;
+    for (size_t j = i; j < count && n < VTFS_PIPELINE_MAX; j++) {
+      if (!reqs[j]->sent && reqs[j]->endpoint == reqs[i]->endpoint &&
+          reqs[j]->prio == reqs[i]->prio) {
+        reqs[j]->sent = true;
+        group[n++] = reqs[j];
+      }
+    }
 
-    sock_release(sock);
-    return -2;
+    uint64_t start = YUFS_NOW_NS();
+    vtfs_http_pipeline(reqs[i]->endpoint, group, n);
+    uint64_t latency = YUFS_NOW_NS() - start;
+    for (size_t j = 0; j < n; j++) {
+      account(group[j], latency);
+    }
   }
+}
 
-  struct kvec kvec;
-  va_list args;
-  va_start(args, arg_size);
-  error = fill_request(&kvec, token, method, arg_size, args);
-  va_end(args);
+// the session id is handed out by the backend, requests then carry only it
+static int64_t session_establish(struct vtfs_endpoint *endpoint,
+                                 const char *token) {
+  struct vtfs_http_req req;
+  struct vtfs_http_req *reqs[1] = {&req};
+  char auth[VTFS_AUTH_MAX];
+  char dummy[8];
 
+  snprintf(auth, VTFS_AUTH_MAX, "token=%s", token);
+  int error = prepare_with_auth(&req, endpoint, auth, "session", dummy,
+                                sizeof(dummy), 0);
   if (error != 0) {
-    kernel_sock_shutdown(sock, SHUT_RDWR);
-    sock_release(sock);
     return error;
   }
+  req.stats = stats_slot(token);
+  exec_groups(reqs, 1);
+  vtfs_http_release(&req);
 
-  struct msghdr msg;
-  memset(&msg, 0, sizeof(struct msghdr));
+  if (req.ret > 0) {
+    session_store(endpoint, token, req.ret);
+  }
+  return req.ret;
+}
 
-  error = kernel_sendmsg(sock, &msg, &kvec, 1, kvec.iov_len);
-  kfree(kvec.iov_base);
+static int req_set_auth(struct vtfs_http_req *req, const char *auth) {
+  size_t auth_len = strlen(auth);
+  size_t tail = req->request.iov_len - req->auth_start - req->auth_len;
+  char *old = req->request.iov_base;
 
-  if (error < 0) {
-    kernel_sock_shutdown(sock, SHUT_RDWR);
-    sock_release(sock);
-    return -3;
+  char *request_buffer =
+      kmalloc(req->request.iov_len - req->auth_len + auth_len + 1, GFP_KERNEL);
+  if (request_buffer == 0) {
+    return -ENOMEM;
   }
+  memcpy(request_buffer, old, req->auth_start);
+  memcpy(request_buffer + req->auth_start, auth, auth_len);
+  memcpy(request_buffer + req->auth_start + auth_len,
+         old + req->auth_start + req->auth_len, tail + 1);
+  kfree(old);
 
-  size_t raw_buffer_size = buffer_size + 1024; // add 1KB for HTTP headers
-  char *raw_response_buffer = kmalloc(raw_buffer_size, GFP_KERNEL);
-  if (raw_response_buffer == 0) {
-    kernel_sock_shutdown(sock, SHUT_RDWR);
-    sock_release(sock);
-    return -ENOMEM;
+  req->request.iov_base = request_buffer;
+  req->request.iov_len = req->auth_start + auth_len + tail;
+  req->auth_len = auth_len;
+  return 0;
+}
+
+// A backend that lost our session answers VTFS_SESSION_STALE. The request
+// is resent once under a new session, other requests of the same batch
+// pick the new session up without opening one more.
+static int session_renew(struct vtfs_http_req *req) {
+  char auth[VTFS_AUTH_MAX];
+  const char *used = (char *)req->request.iov_base + req->auth_start;
+
+  session_auth(req->endpoint, req->token, auth);
+  if (strlen(auth) == req->auth_len &&
+      strncmp(auth, used, req->auth_len) == 0) {
+    if (session_establish(req->endpoint, req->token) <= 0) {
+      return -1;
+    }
+    session_auth(req->endpoint, req->token, auth);
   }
-  int read_bytes = receive_all(sock, raw_response_buffer, raw_buffer_size);
+  return req_set_auth(req, auth);
+}
 
-  kernel_sock_shutdown(sock, SHUT_RDWR);
-  sock_release(sock);
+void vtfs_http_exec(struct vtfs_http_req **reqs, size_t count) {
+  exec_groups(reqs, count);
 
-  if (read_bytes < 0) {
-    kfree(raw_response_buffer);
-    return -4;
+  for (size_t i = 0; i < count; i++) {
+    if (reqs[i]->ret == VTFS_SESSION_STALE && reqs[i]->token != 0 &&
+        session_renew(reqs[i]) == 0) {
+      exec_groups(&reqs[i], 1);
+    }
   }
+}
 
-  error = parse_http_response(raw_response_buffer, read_bytes, response_buffer,
-                              buffer_size);
+static void sessions_close(const char *token) {
+  for (int i = 0; i < endpoint_count; i++) {
+    struct vtfs_endpoint *endpoint = &endpoints[i];
+    struct vtfs_http_req req;
+    struct vtfs_http_req *reqs[1] = {&req};
+    char auth[VTFS_AUTH_MAX];
+    char dummy[8];
 
-  kfree(raw_response_buffer);
-  return error;
+    session_auth(endpoint, token, auth);
+    if (strncmp(auth, "sid=", 4) != 0) {
+      continue;
+    }
+    session_store(endpoint, token, 0);
+    if (prepare_with_auth(&req, endpoint, auth, "session_close", dummy,
+                          sizeof(dummy), 0) == 0) {
+      req.stats = stats_slot(token);
+      exec_groups(reqs, 1);
+      vtfs_http_release(&req);
+    }
+  }
+}
+
+// an open session pins the backends until vtfs_http_session_close
+int vtfs_http_session_open(const char *token) {
+  YUFS_MUTEX_LOCK(&backends_lock);
+  sessions_open++;
+  YUFS_MUTEX_UNLOCK(&backends_lock);
+  stats_attach(token);
+
+  for (int i = 0; i < endpoint_count; i++) {
+    int64_t sid = session_establish(&endpoints[i], token);
+    if (sid <= 0) {
+      printk(KERN_ERR "YUFS: no session with backend %s: %lld\n",
+             endpoints[i].spec, (long long)sid);
+      vtfs_http_session_close(token);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void vtfs_http_session_close(const char *token) {
+  sessions_close(token);
+  stats_detach(token);
+  YUFS_MUTEX_LOCK(&backends_lock);
+  sessions_open--;
+  YUFS_MUTEX_UNLOCK(&backends_lock);
+}
+
+int64_t vtfs_http_call(const char *token, const char *method,
+                       uint32_t route_id, char *response_buffer,
+                       size_t buffer_size, size_t arg_size, ...) {
+  struct vtfs_http_req req;
+  struct vtfs_http_req *reqs[1] = {&req};
+  va_list args;
+
+  va_start(args, arg_size);
+  int error =
+      vtfs_http_vprepare(&req, token, method, route_id, VTFS_PRIO_META,
+                         response_buffer, buffer_size, 0, 0, arg_size, args);
+  va_end(args);
+  if (error != 0) {
+    return error;
+  }
+
+  vtfs_http_exec(reqs, 1);
+  vtfs_http_release(&req);
+  return req.ret;
 }
 
 void encode(const char *src, char *dst) {
@@ -1,11 +1,106 @@
 #ifndef VTFS_HTTP_H
 #define VTFS_HTTP_H
 
+#ifdef __KERNEL__
 #include <linux/inet.h>
+#include <linux/sort.h>
+#include <linux/un.h>
+#endif
 
+#include "yufs_platform.h"
+
+struct vtfs_endpoint;
+
+// metadata requests get reserved connections and go ahead of bulk data
+enum vtfs_prio {
+  VTFS_PRIO_META,
+  VTFS_PRIO_BULK,
+  VTFS_PRIO_COUNT,
+};
+
+// latency from exec to response, including the wait for a connection
+struct vtfs_class_stats {
+  uint64_t count;
+  uint64_t errors;
+  uint64_t total_ns;
+  uint64_t max_ns;
+};
+
+// where the time of one request goes, see vtfs_http_pipeline
+enum vtfs_phase {
+  VTFS_PHASE_CONNECT,
+  VTFS_PHASE_SEND,
+  VTFS_PHASE_TTFB,
+  VTFS_PHASE_RECV,
+  VTFS_PHASE_PARSE,
+  VTFS_PHASE_COUNT,
+};
+
+// bucket b counts latencies in [2^(b-1), 2^b) microseconds, bucket 0 is
+// below one microsecond, the last one is open ended
+#define VTFS_HIST_BUCKETS 20
+#define VTFS_METHOD_MAX 32
+
+struct vtfs_method_stats {
+  uint64_t hist[VTFS_PHASE_COUNT][VTFS_HIST_BUCKETS];
+  uint64_t total_ns[VTFS_PHASE_COUNT];
+  uint64_t bytes_sent;
+  uint64_t bytes_received;
+};
+
+// one prepared request, several of them can share a connection in
+// vtfs_http_exec
+struct vtfs_http_req {
+  struct vtfs_endpoint *endpoint;
+  const char *token;
+  struct kvec request;
+  // "sid=N" or "token=T" inside request, swapped when a session is renewed
+  size_t auth_start;
+  size_t auth_len;
+  int prio;
+  int method; // index into the method table, for the phase histograms
+  int stats;  // counter slot of the token
+  // POST body, sent from the caller's memory
+  const char *body;
+  size_t body_len;
+  char *response;
+  size_t response_size;
+  int64_t ret;
+  bool sent;
+};
+
+int vtfs_http_init(void);
+void vtfs_http_destroy(void);
+int vtfs_http_set_backends(const char *spec);
+// opens a session for token on every backend, requests then carry the
+// session id instead of the token. The backends can't change until every
+// opened session is closed again.
+int vtfs_http_session_open(const char *token);
+void vtfs_http_session_close(const char *token);
+
+int vtfs_http_prepare(struct vtfs_http_req *req, const char *token,
+                      const char *method, uint32_t route_id, int prio,
+                      char *response_buffer, size_t buffer_size,
+                      const char *body, size_t body_len, size_t arg_size, ...);
+void vtfs_http_release(struct vtfs_http_req *req);
+// fills ret of every request, requests for one backend are pipelined
+void vtfs_http_exec(struct vtfs_http_req **reqs, size_t count);
+// counters of one token, zero unless it has a session open
+void vtfs_http_class_stats(const char *token, int prio,
+                           struct vtfs_class_stats *out);
+// method == vtfs_http_method_count() - 1 collects unknown methods
+int vtfs_http_method_count(void);
+const char *vtfs_http_method_name(int method);
+// sums the per-cpu counters, they may move while this runs
+void vtfs_http_method_stats(const char *token, int method,
+                            struct vtfs_method_stats *out);
+void vtfs_http_reset_stats(const char *token);
+
+// route_id picks the backend: inode id for inode ops, parent id for
+// directory-scoped ops
 int64_t vtfs_http_call(const char *token, const char *method,
-                            char *response_buffer, size_t buffer_size,
-                            size_t arg_size, ...);
+                       uint32_t route_id, char *response_buffer,
+                       size_t buffer_size, size_t arg_size, ...);
 
 void encode(const char *, char *);
 
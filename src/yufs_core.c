@@ -12,10 +12,22 @@
 #endif
 #endif
 
+static void complete_op(struct YUFS_op* op) {
+    if (op->done) op->done(op);
+    else YUFS_COMPLETE(&op->completion);
+}
+
+int YUFSCore_wait(struct YUFS_op* op) {
+    YUFS_WAIT_COMPLETION(&op->completion);
+    return op->ret;
+}
+
 #ifdef __RAM_VERSION__
 
 #define MAX_FILES 1024
 #define ROOT_INO 1000
+// file contents may take this much unless max_bytes says otherwise
+#define MAX_BYTES_DEFAULT (1024ull * 1024 * 1024)
 
 struct YUFS_Inode {
     uint32_t id;
@@ -23,6 +35,8 @@ struct YUFS_Inode {
     int nlink;
     char* content;
     size_t size;
+    size_t capacity;    // allocated for content, fallocate may reserve past size
+    uint64_t version;
     struct YUFS_Dirent* main_dentry;
 };
 
@@ -39,6 +53,14 @@ struct YUFS_Dirent {
 
 static struct YUFS_Inode* inodeTable[MAX_FILES];
 
+// kept up to date by alloc/free/write/fallocate, so statfs doesn't walk the
+// table; bytes counts what is allocated, reserved space included
+static struct {
+    uint64_t inodes;
+    uint64_t bytes;
+    uint64_t max_bytes;
+} usage = {0, 0, MAX_BYTES_DEFAULT};
+
 static struct YUFS_Inode* allocInode(void) {
     for (size_t i = 1; i < MAX_FILES; i++) {
         if (inodeTable[i] == NULL) {
@@ -47,7 +69,9 @@ static struct YUFS_Inode* allocInode(void) {
             YUFS_MEMSET(node, 0, sizeof(struct YUFS_Inode));
             node->id = i;
             node->nlink = 1;
+            node->version = 1;
             inodeTable[i] = node;
+            usage.inodes++;
             YUFS_LOG_INFO("allocated node with id %d", node->id);
             return node;
         }
@@ -72,6 +96,8 @@ static struct YUFS_Dirent* allocDirent(const char* name, uint32_t inode_id) {
 static void freeInode(struct YUFS_Inode* node) {
     YUFS_LOG_INFO("freed node with id %d", node->id);
     if (node->content) YUFS_FREE(node->content);
+    usage.bytes -= node->capacity;
+    usage.inodes--;
     inodeTable[node->id] = NULL;
     YUFS_FREE(node);
 }
@@ -93,6 +119,9 @@ static void* yu_realloc(void* old, size_t oldSz, size_t newSz) {
 
 int YUFSCore_init(void) {
     YUFS_MEMSET(inodeTable, 0, sizeof(inodeTable));
+    usage.inodes = 0;
+    usage.bytes = 0;
+    usage.max_bytes = MAX_BYTES_DEFAULT;
     struct YUFS_Inode* rootInode = allocInode();
     if (!rootInode) return -1;
     rootInode->id = ROOT_INO;
@@ -116,6 +145,24 @@ void YUFSCore_destroy(void) {
     }
 }
 
+int YUFSCore_configure(const char* key, const char* value) {
+    if (YUFS_STRCMP(key, "max_bytes") == 0) {
+        unsigned long long max;
+        if (kstrtoull(value, 10, &max) != 0 || max == 0) return -1;
+        usage.max_bytes = max;
+        return 0;
+    }
+    return -1;
+}
+
+int YUFSCore_open_session(const char*) { return 0; }
+void YUFSCore_close_session(const char*) {}
+int YUFSCore_prefetch(const char*, uint32_t) { return 0; }
+int YUFSCore_sync(const char*, uint32_t) { return 0; }
+
+int YUFSCore_stats(const char*, char*, size_t) { return 0; }
+void YUFSCore_reset_stats(const char*) {}
+
 static struct YUFS_Dirent* find_child(struct YUFS_Dirent* parent, const char* name) {
     struct YUFS_Dirent* child = parent->first_child;
     while (child) {
@@ -140,12 +187,15 @@ int YUFSCore_lookup(const char*, uint32_t parent_id, const char* name, struct YU
     result->id = inode->id;
     result->mode = inode->mode;
     result->size = inode->size;
+    result->version = inode->version;
+    result->nlink = inode->nlink;
     YUFS_LOG_INFO("lookup for parent id %d and name %s succeed", parent_id, name);
     return 0;
 }
 
 static void attach_dentry(struct YUFS_Dirent* parent, struct YUFS_Dirent* child) {
     child->parent = parent;
+    child->prev_sibling = NULL;
     child->next_sibling = parent->first_child;
     if (parent->first_child) {
         parent->first_child->prev_sibling = child;
@@ -153,6 +203,12 @@ static void attach_dentry(struct YUFS_Dirent* parent, struct YUFS_Dirent* child)
     parent->first_child = child;
 }
 
+static void detach_dentry(struct YUFS_Dirent* child) {
+    if (child->prev_sibling) child->prev_sibling->next_sibling = child->next_sibling;
+    else child->parent->first_child = child->next_sibling;
+    if (child->next_sibling) child->next_sibling->prev_sibling = child->prev_sibling;
+}
+
 int YUFSCore_create(const char*, uint32_t parent_id, const char* name, umode_t mode, struct YUFS_stat* result) {
     if (parent_id >= MAX_FILES || !inodeTable[parent_id]) return -1;
     struct YUFS_Inode* parentInode = inodeTable[parent_id];
@@ -168,11 +224,14 @@ int YUFSCore_create(const char*, uint32_t parent_id, const char* name, umode_t m
     if (S_ISDIR(mode)) newInode->main_dentry = newDirent;
 
     attach_dentry(parentInode->main_dentry, newDirent);
+    parentInode->version++;
 
     if (result) {
         result->id = newInode->id;
         result->mode = newInode->mode;
         result->size = newInode->size;
+        result->version = newInode->version;
+        result->nlink = newInode->nlink;
     }
     YUFS_LOG_INFO("created new one in %d with name %s", parent_id, name);
     return 0;
@@ -193,6 +252,7 @@ int YUFSCore_link(const char*, uint32_t target_id, uint32_t parent_id, const cha
     if (!newDirent) return -1;
 
     attach_dentry(parentInode->main_dentry, newDirent);
+    parentInode->version++;
 
     targetInode->nlink++;
     YUFS_LOG_INFO("created new hardlink in %d with name %s on %d", parent_id, name, target_id);
@@ -210,12 +270,9 @@ int YUFSCore_unlink(const char*, uint32_t parent_id, const char* name) {
 
     if (S_ISDIR(targetInode->mode)) return -1;
 
-    if (targetDirent->prev_sibling) targetDirent->prev_sibling->next_sibling = targetDirent->next_sibling;
-    else targetDirent->parent->first_child = targetDirent->next_sibling;
-
-    if (targetDirent->next_sibling) targetDirent->next_sibling->prev_sibling = targetDirent->prev_sibling;
-
+    detach_dentry(targetDirent);
     YUFS_FREE(targetDirent);
+    parentInode->version++;
 
     targetInode->nlink--;
 
@@ -237,16 +294,75 @@ int YUFSCore_rmdir(const char*, uint32_t parent_id, const char* name) {
 
     if (targetInode->main_dentry->first_child != NULL) return -1;
 
-    if (targetDirent->prev_sibling) targetDirent->prev_sibling->next_sibling = targetDirent->next_sibling;
-    else targetDirent->parent->first_child = targetDirent->next_sibling;
-    if (targetDirent->next_sibling) targetDirent->next_sibling->prev_sibling = targetDirent->prev_sibling;
-
+    detach_dentry(targetDirent);
     YUFS_FREE(targetDirent);
     freeInode(targetInode);
+    parentInode->version++;
     YUFS_LOG_INFO("removed dir in %d with name %s", parent_id, name);
     return 0;
 }
 
+// is d the directory entry dir or one of its ancestors
+static bool is_ancestor(struct YUFS_Dirent* d, struct YUFS_Dirent* dir) {
+    while (true) {
+        if (dir == d) return true;
+        if (dir->parent == dir) return false;
+        dir = dir->parent;
+    }
+}
+
+// The dirent itself moves to the new parent under the new name, so a moved
+// directory keeps its main_dentry and children and no content is touched.
+int YUFSCore_rename(const char*, uint32_t parent_id, const char* name,
+                    uint32_t new_parent_id, const char* new_name, unsigned int flags) {
+    if (parent_id >= MAX_FILES || !inodeTable[parent_id]) return -ENOENT;
+    if (new_parent_id >= MAX_FILES || !inodeTable[new_parent_id]) return -ENOENT;
+    struct YUFS_Inode* parentInode = inodeTable[parent_id];
+    struct YUFS_Inode* newParentInode = inodeTable[new_parent_id];
+    if (!S_ISDIR(parentInode->mode) || !S_ISDIR(newParentInode->mode)) return -ENOTDIR;
+    if (YUFS_STRLEN(new_name) >= MAX_NAME_SIZE) return -ENAMETOOLONG;
+
+    struct YUFS_Dirent* source = find_child(parentInode->main_dentry, name);
+    if (!source) return -ENOENT;
+    struct YUFS_Dirent* target = find_child(newParentInode->main_dentry, new_name);
+    struct YUFS_Inode* sourceInode = inodeTable[source->inode_id];
+    struct YUFS_Inode* targetInode = target ? inodeTable[target->inode_id] : NULL;
+    if (target == source) return 0;
+
+    if (flags & YUFS_RENAME_EXCHANGE) {
+        if (!target) return -ENOENT;
+        if (S_ISDIR(sourceInode->mode) && is_ancestor(source, newParentInode->main_dentry)) return -EINVAL;
+        if (S_ISDIR(targetInode->mode) && is_ancestor(target, parentInode->main_dentry)) return -EINVAL;
+        detach_dentry(source);
+        detach_dentry(target);
+        YUFS_STRCPY(source->name, new_name);
+        YUFS_STRCPY(target->name, name);
+        attach_dentry(newParentInode->main_dentry, source);
+        attach_dentry(parentInode->main_dentry, target);
+    } else {
+        if (target && (flags & YUFS_RENAME_NOREPLACE)) return -EEXIST;
+        // two names of the same inode: nothing to do
+        if (target && target->inode_id == source->inode_id) return 0;
+        if (S_ISDIR(sourceInode->mode) && is_ancestor(source, newParentInode->main_dentry)) return -EINVAL;
+        if (targetInode) {
+            if (S_ISDIR(sourceInode->mode) != S_ISDIR(targetInode->mode)) {
+                return S_ISDIR(targetInode->mode) ? -EISDIR : -ENOTDIR;
+            }
+            if (S_ISDIR(targetInode->mode) && targetInode->main_dentry->first_child) return -ENOTEMPTY;
+            detach_dentry(target);
+            YUFS_FREE(target);
+            if (--targetInode->nlink <= 0 || S_ISDIR(targetInode->mode)) freeInode(targetInode);
+        }
+        detach_dentry(source);
+        YUFS_STRCPY(source->name, new_name);
+        attach_dentry(newParentInode->main_dentry, source);
+    }
+    parentInode->version++;
+    if (newParentInode != parentInode) newParentInode->version++;
+    YUFS_LOG_INFO("renamed %s in %d to %s in %d", name, parent_id, new_name, new_parent_id);
+    return 0;
+}
+
 int YUFSCore_read(const char*, uint32_t id, char *buf, size_t size, loff_t offset) {
     if (id >= MAX_FILES || !inodeTable[id]) return -1;
     struct YUFS_Inode* node = inodeTable[id];
@@ -260,24 +376,114 @@ int YUFSCore_read(const char*, uint32_t id, char *buf, size_t size, loff_t offse
     return (int)to_read;
 }
 
+// grows the content buffer to capacity bytes, the bytes past size are left
+// for whoever extends the file to zero
+static int reserve(struct YUFS_Inode* node, size_t capacity) {
+    if (usage.bytes + (capacity - node->capacity) > usage.max_bytes) return -1;
+    void* new_content = yu_realloc(node->content, node->size, capacity);
+    if (!new_content) return -1;
+    node->content = (char*)new_content;
+    usage.bytes += capacity - node->capacity;
+    node->capacity = capacity;
+    return 0;
+}
+
 int YUFSCore_write(const char*, uint32_t id, const char *buf, size_t size, loff_t offset) {
     if (id >= MAX_FILES || !inodeTable[id]) return -1;
     struct YUFS_Inode* node = inodeTable[id];
     if (S_ISDIR(node->mode)) return -1;
 
     size_t new_end = offset + size;
+    if (new_end > node->capacity && reserve(node, new_end) != 0) return -1;
     if (new_end > node->size) {
-        void* new_content = yu_realloc(node->content, node->size, new_end);
-        if (!new_content) return -1;
-        node->content = (char*)new_content;
         if (offset > node->size) YUFS_MEMSET(node->content + node->size, 0, offset - node->size);
         node->size = new_end;
     }
     YUFS_MEMMOVE(node->content + offset, buf, size);
+    node->version++;
     YUFS_LOG_INFO("write to %d", id);
     return (int)size;
 }
 
+int YUFSCore_write_v(const char* token, uint32_t id, const char *buf, size_t size, loff_t offset, uint64_t* version) {
+    int ret = YUFSCore_write(token, id, buf, size, offset);
+    *version = ret >= 0 ? inodeTable[id]->version : 0;
+    return ret;
+}
+
+// Allocation reserves the whole range up front, later writes into it never
+// reallocate. A punched hole is zeroed in place, the memory stays allocated.
+int YUFSCore_fallocate(const char*, uint32_t id, int mode, loff_t offset, loff_t len) {
+    if (id >= MAX_FILES || !inodeTable[id]) return -1;
+    struct YUFS_Inode* node = inodeTable[id];
+    if (S_ISDIR(node->mode) || offset < 0 || len <= 0) return -1;
+    if (mode & ~(YUFS_FALLOC_KEEP_SIZE | YUFS_FALLOC_PUNCH_HOLE)) return -1;
+
+    size_t end = offset + len;
+    if (mode & YUFS_FALLOC_PUNCH_HOLE) {
+        // the size never changes, the flag is required like for the syscall
+        if (!(mode & YUFS_FALLOC_KEEP_SIZE)) return -1;
+        if ((size_t)offset >= node->size) return 0;
+        if (end > node->size) end = node->size;
+        YUFS_MEMSET(node->content + offset, 0, end - offset);
+        node->version++;
+        return 0;
+    }
+    if (end > node->capacity && reserve(node, end) != 0) return -1;
+    if (!(mode & YUFS_FALLOC_KEEP_SIZE) && end > node->size) {
+        YUFS_MEMSET(node->content + node->size, 0, end - node->size);
+        node->size = end;
+        node->version++;
+    }
+    YUFS_LOG_INFO("fallocate %d: mode %d", id, mode);
+    return 0;
+}
+
+int YUFSCore_fallocate_v(const char* token, uint32_t id, int mode, loff_t offset, loff_t len, uint64_t* version) {
+    int ret = YUFSCore_fallocate(token, id, mode, offset, len);
+    *version = ret >= 0 ? inodeTable[id]->version : 0;
+    return ret;
+}
+
+int YUFSCore_copy_range(const char*, uint32_t src_id, loff_t src_offset,
+                        uint32_t dst_id, loff_t dst_offset, size_t len) {
+    if (src_id >= MAX_FILES || !inodeTable[src_id]) return -1;
+    if (dst_id >= MAX_FILES || !inodeTable[dst_id]) return -1;
+    struct YUFS_Inode* src = inodeTable[src_id];
+    struct YUFS_Inode* dst = inodeTable[dst_id];
+    if (S_ISDIR(src->mode) || S_ISDIR(dst->mode) || src_offset < 0 || dst_offset < 0) return -1;
+
+    if ((size_t)src_offset >= src->size) return 0;
+    if (len > src->size - src_offset) len = src->size - src_offset;
+    if (len > INT_MAX) len = INT_MAX;
+    // reserve may move src's content when src is dst, the offsets stay valid
+    size_t end = dst_offset + len;
+    if (end > dst->capacity && reserve(dst, end) != 0) return -1;
+    if (end > dst->size) {
+        if ((size_t)dst_offset > dst->size) YUFS_MEMSET(dst->content + dst->size, 0, dst_offset - dst->size);
+        dst->size = end;
+    }
+    YUFS_MEMMOVE(dst->content + dst_offset, src->content + src_offset, len);
+    dst->version++;
+    YUFS_LOG_INFO("copied %zu bytes from %d to %d", len, src_id, dst_id);
+    return (int)len;
+}
+
+int YUFSCore_copy_range_v(const char* token, uint32_t src_id, loff_t src_offset,
+                          uint32_t dst_id, loff_t dst_offset, size_t len, uint64_t* version) {
+    int ret = YUFSCore_copy_range(token, src_id, src_offset, dst_id, dst_offset, len);
+    *version = ret >= 0 ? inodeTable[dst_id]->version : 0;
+    return ret;
+}
+
+int YUFSCore_statfs(const char*, struct YUFS_statfs* result) {
+    result->total_bytes = usage.max_bytes;
+    result->used_bytes = usage.bytes;
+    result->total_inodes = MAX_FILES - 1;
+    result->used_inodes = usage.inodes;
+    return 0;
+}
+
 int YUFSCore_iterate(const char*, uint32_t id, yufs_filldir_y callback, void* ctx, loff_t offset) {
     if (id >= MAX_FILES || !inodeTable[id]) return -1;
     struct YUFS_Inode* inode = inodeTable[id];
@@ -314,6 +520,49 @@ int YUFSCore_getattr(const char*, uint32_t id, struct YUFS_stat* result) {
     result->id = node->id;
     result->size = node->size;
     result->mode = node->mode;
+    result->version = node->version;
+    result->nlink = node->nlink;
+    return 0;
+}
+
+int YUFSCore_getattr_fresh(const char* token, uint32_t id, struct YUFS_stat* result) {
+    return YUFSCore_getattr(token, id, result);
+}
+
+int YUFSCore_read_if(const char* token, uint32_t id, char *buf, size_t size, loff_t offset, uint64_t version) {
+    if (id < MAX_FILES && inodeTable[id] && version == inodeTable[id]->version) return YUFS_NOT_MODIFIED;
+    return YUFSCore_read(token, id, buf, size, offset);
+}
+
+static int run_op(const char* token, struct YUFS_op* op) {
+    switch (op->type) {
+    case YUFS_OP_LOOKUP: return YUFSCore_lookup(token, op->parent_id, op->name, &op->stat);
+    case YUFS_OP_CREATE: return YUFSCore_create(token, op->parent_id, op->name, op->mode, &op->stat);
+    case YUFS_OP_LINK: return YUFSCore_link(token, op->id, op->parent_id, op->name);
+    case YUFS_OP_UNLINK: return YUFSCore_unlink(token, op->parent_id, op->name);
+    case YUFS_OP_RMDIR: return YUFSCore_rmdir(token, op->parent_id, op->name);
+    case YUFS_OP_GETATTR: return YUFSCore_getattr(token, op->id, &op->stat);
+    case YUFS_OP_READ: return YUFSCore_read(token, op->id, op->buf, op->size, op->offset);
+    case YUFS_OP_WRITE: return YUFSCore_write(token, op->id, op->buf, op->size, op->offset);
+    case YUFS_OP_RENAME:
+        return YUFSCore_rename(token, op->parent_id, op->name, op->new_parent_id, op->new_name, op->flags);
+    case YUFS_OP_FALLOCATE: return YUFSCore_fallocate(token, op->id, op->flags, op->offset, op->size);
+    case YUFS_OP_COPY_RANGE:
+        return YUFSCore_copy_range(token, op->src_id, op->src_offset, op->id, op->offset, op->size);
+    }
+    return -1;
+}
+
+// nothing to overlap in memory, ops complete before submit returns
+int YUFSCore_submit(const char* token, struct YUFS_op* op) {
+    YUFS_COMPLETION_INIT(&op->completion);
+    op->ret = run_op(token, op);
+    complete_op(op);
+    return 0;
+}
+
+int YUFSCore_submit_batch(const char* token, struct YUFS_op* ops, size_t count) {
+    for (size_t i = 0; i < count; i++) YUFSCore_submit(token, &ops[i]);
     return 0;
 }
 
@@ -324,114 +573,1652 @@ int YUFSCore_getattr(const char*, uint32_t id, struct YUFS_stat* result) {
 #include "http.h"
 
 #define TO_STR(buf, val, fmt) char buf[24]; snprintf(buf, sizeof(buf), fmt, val)
+#define ASYNC_WORKERS 4
+// ops one worker takes at once, they are pipelined per backend
+#define ASYNC_BATCH 8
+// large reads and writes are split into stripes, up to fan-out of them are
+// in flight at once on different pooled connections
+#define STRIPE_SIZE_DEFAULT (64 * 1024)
+#define STRIPE_SIZE_MIN 4096
+#define STRIPE_SIZE_MAX (1024 * 1024)
+#define STRIPE_FANOUT_DEFAULT 4
+#define STRIPE_FANOUT_MAX 16
+
+// iterate record, name_len bytes of name follow without a terminator
 struct YUFS_packed_dirent {
     uint32_t id;
-    char name[256];
     uint32_t type;
+    uint16_t name_len;
 } __attribute__((packed));
 
-int YUFSCore_init(void) { return 0; }
-void YUFSCore_destroy(void) {}
+// prefetch record, name_len bytes of name follow without a terminator
+struct YUFS_packed_meta {
+    uint32_t parent_id;
+    uint32_t id;
+    uint32_t mode;
+    uint64_t size;
+    uint64_t version;
+    uint32_t nlink;
+    uint16_t name_len;
+} __attribute__((packed));
+
+#define META_CACHE_TOKENS 8
+#define META_CACHE_BUCKETS 8192
+#define META_CACHE_MAX (1024 * 1024)
+#define META_TTL_DEFAULT 30
+// one prefetch response, the backend pages the subtree to fit it
+#define PREFETCH_CHUNK (256 * 1024)
+// free space is polled constantly, one backend call answers for this long
+#define STATFS_TTL_NS 1000000000ull
+// listings kept per token, and the largest directory worth keeping
+#define DIR_CACHE_LISTINGS 64
+#define DIR_CACHE_ENTRIES 65536
+#define DIR_TTL_DEFAULT 5
+// one iterate response, the backend fits as many entries as it can
+#define ITERATE_CHUNK (64 * 1024)
+
+// one directory entry with the attributes of its inode, hashed both by
+// (parent_id, name) for lookup and by id for getattr
+struct YUFS_meta_entry {
+    struct YUFS_meta_entry* name_next;
+    struct YUFS_meta_entry* id_next;
+    uint32_t parent_id;
+    struct YUFS_stat stat;
+    uint64_t expires;
+    char name[];
+};
+
+struct YUFS_listing_entry {
+    uint32_t id;
+    umode_t type;
+    uint32_t name_off;
+    uint16_t name_len;
+};
+
+// a whole directory as iterate returns it, offset i is entries[i]
+struct YUFS_dir_listing {
+    struct YUFS_dir_listing* next;
+    uint32_t dir_id;
+    uint64_t version;       // of the directory when it was listed, 0 - unknown
+    uint64_t expires;
+    int refs;               // the cache's plus one per iterate reading it
+    // more than DIR_CACHE_ENTRIES, the rest comes from the backend; the
+    // cache keeps only an empty marker of such a directory
+    bool oversized;
+    size_t count;
+    size_t capacity;
+    struct YUFS_listing_entry* entries;
+    size_t names_used;
+    size_t names_size;
+    char* names;
+};
+
+struct YUFS_meta_cache {
+    char token[64];
+    struct YUFS_meta_entry** by_name;
+    struct YUFS_meta_entry** by_id;
+    struct YUFS_statfs statfs;
+    uint64_t statfs_expires;
+    // most recently filled first
+    struct YUFS_dir_listing* listings;
+    int listing_count;
+    uint64_t listing_gen;   // bumped by every local change to some directory
+    // counters shown by YUFSCore_stats
+    uint64_t coalesced;
+    uint64_t dir_hits;
+    uint64_t dir_misses;
+};
+
+static struct {
+    yufs_mutex_t lock;
+    uint64_t ttl_ns;
+    uint64_t dir_ttl_ns;
+    size_t entries;
+    struct YUFS_meta_cache* caches[META_CACHE_TOKENS];
+} meta;
+
+// request state of one op, lives from prepare_op till finish_op
+struct YUFS_web_op {
+    struct vtfs_http_req req;
+    char dummy[64];
+};
+
+static struct {
+    size_t size;
+    int fanout;
+} stripe = {STRIPE_SIZE_DEFAULT, STRIPE_FANOUT_DEFAULT};
+
+// Striping, leasing and the cache ttls are shared by every mount. While one
+// is mounted another may only repeat them, the last unmount restores the
+// defaults.
+static struct {
+    yufs_mutex_t lock;
+    int sessions;
+} mounts;
+
+// creates in flight before the creator waits for some to land
+#define CREATE_INFLIGHT_MAX 256
+#define LEASE_MAX 65536
+
+struct YUFS_lease {
+    char token[64];
+    uint32_t next;
+    uint32_t end;   // next == end - nothing left, lease a new range
+};
+
+// a create that completed locally with a leased id, kept until the backend
+// answered. A failed one then waits on creates.failed for YUFSCore_sync.
+struct YUFS_pending {
+    struct YUFS_pending* next;
+    struct YUFS_op op;
+    char token[64];
+    char name[MAX_NAME_SIZE];
+};
+
+static struct {
+    yufs_mutex_t lock;
+    yufs_waitq_t wait;
+    unsigned int lease_size;    // 0 - creates wait for the backend
+    struct YUFS_lease leases[META_CACHE_TOKENS];
+    struct YUFS_pending* pending;
+    struct YUFS_pending* failed;
+    int inflight;
+} creates;
+
+static struct {
+    yufs_mutex_t lock;
+    yufs_waitq_t wait;
+    struct YUFS_op* head;
+    struct YUFS_op* tail;
+    size_t queued;
+    bool stopping;
+    int workers;
+    yufs_completion_t exited[ASYNC_WORKERS];
+} async_queue;
+
+#define FLIGHT_BUCKETS 64
+
+// one backend request shared by identical concurrent callers
+struct YUFS_flight {
+    struct YUFS_flight* next;
+    const struct YUFS_op* op;   // the first caller's op, valid while hashed
+    const char* token;
+    uint32_t hash;
+    bool hashed;
+    int refs;                   // first caller plus the ones that joined
+    int ret;
+    struct YUFS_stat stat;
+    char* data;                 // read bytes copied out for the followers
+    bool orphaned;              // the copy failed, followers ask on their own
+    yufs_completion_t done;
+};
+
+static struct {
+    yufs_mutex_t lock;
+    struct YUFS_flight* buckets[FLIGHT_BUCKETS];
+} flights;
+
+#define META VTFS_PRIO_META
+#define BULK VTFS_PRIO_BULK
+
+static int prepare_op(const char* token, struct YUFS_op* op, struct YUFS_web_op* w) {
+    struct vtfs_http_req* req = &w->req;
+    TO_STR(id_str, op->id, "%u");
+    TO_STR(pid_str, op->parent_id, "%u");
+
+    switch (op->type) {
+    case YUFS_OP_LOOKUP:
+        return vtfs_http_prepare(req, token, "lookup", op->parent_id, META, (char*)&op->stat, sizeof(struct YUFS_stat),
+                                 NULL, 0, 2, "parent_id", pid_str, "name", op->name);
+    case YUFS_OP_CREATE: {
+        TO_STR(mode_str, op->mode, "%u");
+        if (op->id) {
+            // the id comes from a lease, see create_leased
+            return vtfs_http_prepare(req, token, "create", op->parent_id, META, (char*)&op->stat,
+                                     sizeof(struct YUFS_stat), NULL, 0, 4, "parent_id", pid_str, "name", op->name,
+                                     "mode", mode_str, "id", id_str);
+        }
+        return vtfs_http_prepare(req, token, "create", op->parent_id, META, (char*)&op->stat, sizeof(struct YUFS_stat),
+                                 NULL, 0, 3, "parent_id", pid_str, "name", op->name, "mode", mode_str);
+    }
+    case YUFS_OP_LINK:
+        return vtfs_http_prepare(req, token, "link", op->parent_id, META, w->dummy, sizeof(w->dummy),
+                                 NULL, 0, 3, "target_id", id_str, "parent_id", pid_str, "name", op->name);
+    case YUFS_OP_UNLINK:
+        return vtfs_http_prepare(req, token, "unlink", op->parent_id, META, w->dummy, sizeof(w->dummy),
+                                 NULL, 0, 2, "parent_id", pid_str, "name", op->name);
+    case YUFS_OP_RMDIR:
+        return vtfs_http_prepare(req, token, "rmdir", op->parent_id, META, w->dummy, sizeof(w->dummy),
+                                 NULL, 0, 2, "parent_id", pid_str, "name", op->name);
+    case YUFS_OP_RENAME: {
+        TO_STR(new_pid_str, op->new_parent_id, "%u");
+        TO_STR(flags_str, op->flags, "%u");
+        // a refusal carries its errno, see finish_op
+        memset(w->dummy, 0, sizeof(int32_t));
+        return vtfs_http_prepare(req, token, "rename", op->parent_id, META, w->dummy, sizeof(w->dummy),
+                                 NULL, 0, 5, "parent_id", pid_str, "name", op->name, "new_parent_id", new_pid_str,
+                                 "new_name", op->new_name, "flags", flags_str);
+    }
+    case YUFS_OP_GETATTR:
+        return vtfs_http_prepare(req, token, "getattr", op->id, META, (char*)&op->stat, sizeof(struct YUFS_stat),
+                                 NULL, 0, 1, "id", id_str);
+    case YUFS_OP_READ: {
+        TO_STR(sz_str, op->size, "%lu");
+        TO_STR(off_str, (long long)op->offset, "%lld");
+        if (op->version) {
+            TO_STR(ver_str, (unsigned long long)op->version, "%llu");
+            return vtfs_http_prepare(req, token, "read", op->id, BULK, op->buf, op->size,
+                                     NULL, 0, 4, "id", id_str, "size", sz_str, "offset", off_str,
+                                     "if_version", ver_str);
+        }
+        // the body is received straight into the caller's buffer
+        return vtfs_http_prepare(req, token, "read", op->id, BULK, op->buf, op->size,
+                                 NULL, 0, 3, "id", id_str, "size", sz_str, "offset", off_str);
+    }
+    case YUFS_OP_WRITE: {
+        TO_STR(off_str, (long long)op->offset, "%lld");
+        if (op->chain) {
+            TO_STR(chain_str, (unsigned long long)op->chain, "%llu");
+            TO_STR(seq_str, op->seq, "%u");
+            return vtfs_http_prepare(req, token, "write", op->id, BULK, (char*)&op->stat.version,
+                                     sizeof(op->stat.version), op->buf, op->size, 5, "id", id_str, "offset", off_str,
+                                     "chain", chain_str, "seq", seq_str,
+                                     "last", op->flags & YUFS_WRITE_CHAIN_LAST ? "1" : "0");
+        }
+        // raw POST body, no url encoding, the inode's new version comes back
+        return vtfs_http_prepare(req, token, "write", op->id, BULK, (char*)&op->stat.version,
+                                 sizeof(op->stat.version), op->buf, op->size, 2, "id", id_str, "offset", off_str);
+    }
+    case YUFS_OP_COPY_RANGE: {
+        TO_STR(src_str, op->src_id, "%u");
+        TO_STR(src_off_str, (long long)op->src_offset, "%lld");
+        TO_STR(off_str, (long long)op->offset, "%lld");
+        TO_STR(len_str, op->size, "%lu");
+        // the backend copies, only the count and dst's new version come back
+        return vtfs_http_prepare(req, token, "copy_range", op->id, META, (char*)&op->stat.version,
+                                 sizeof(op->stat.version), NULL, 0, 5, "src_id", src_str, "src_offset", src_off_str, "id", id_str,
+                                 "offset", off_str, "len", len_str);
+    }
+    case YUFS_OP_FALLOCATE: {
+        TO_STR(mode_str, op->flags, "%u");
+        TO_STR(off_str, (long long)op->offset, "%lld");
+        TO_STR(len_str, op->size, "%lu");
+        // no data moves, it goes with the metadata
+        return vtfs_http_prepare(req, token, "fallocate", op->id, META, (char*)&op->stat.version,
+                                 sizeof(op->stat.version), NULL, 0, 4, "id", id_str, "mode", mode_str,
+                                 "offset", off_str, "len", len_str);
+    }
+    }
+    return -EINVAL;
+}
+
+// A rename the backend refused comes back as -1 and the errno of the reason,
+// anything else that failed never got an answer.
+static int finish_op(struct YUFS_op* op, struct YUFS_web_op* w) {
+    vtfs_http_release(&w->req);
+    if (op->type == YUFS_OP_RENAME && w->req.ret != 0) {
+        int32_t err;
+        memcpy(&err, w->dummy, sizeof(err));
+        return w->req.ret == -1 && err > 0 && err < MAX_ERRNO ? -err : -EIO;
+    }
+    return (int)w->req.ret;
+}
+
+static int exec_op(const char* token, struct YUFS_op* op) {
+    struct YUFS_web_op w;
+    struct vtfs_http_req* req = &w.req;
+    int err = prepare_op(token, op, &w);
+    if (err) return err;
+    vtfs_http_exec(&req, 1);
+    return finish_op(op, &w);
+}
+
+static bool op_shareable(const struct YUFS_op* op) {
+    return op->type == YUFS_OP_LOOKUP || op->type == YUFS_OP_GETATTR || op->type == YUFS_OP_READ;
+}
+
+static uint32_t flight_step(uint32_t hash, const void* data, size_t len) {
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < len; i++) hash = (hash ^ p[i]) * 16777619u;
+    return hash;
+}
+
+// fields the sync calls leave zero don't need special casing
+static uint32_t flight_hash(const char* token, const struct YUFS_op* op) {
+    uint32_t hash = flight_step(2166136261u, token, strlen(token));
+    hash = flight_step(hash, &op->type, sizeof(op->type));
+    hash = flight_step(hash, &op->id, sizeof(op->id));
+    hash = flight_step(hash, &op->parent_id, sizeof(op->parent_id));
+    hash = flight_step(hash, &op->offset, sizeof(op->offset));
+    hash = flight_step(hash, &op->size, sizeof(op->size));
+    hash = flight_step(hash, &op->version, sizeof(op->version));
+    if (op->type == YUFS_OP_LOOKUP) hash = flight_step(hash, op->name, strlen(op->name));
+    return hash;
+}
+
+static bool flight_match(const struct YUFS_flight* f, uint32_t hash, const char* token, const struct YUFS_op* op) {
+    const struct YUFS_op* lead = f->op;
+    if (f->hash != hash || lead->type != op->type) return false;
+    if (lead->id != op->id || lead->parent_id != op->parent_id) return false;
+    if (lead->offset != op->offset || lead->size != op->size || lead->version != op->version) return false;
+    if (op->type == YUFS_OP_LOOKUP && strcmp(lead->name, op->name) != 0) return false;
+    return strcmp(f->token, token) == 0;
+}
+
+// would a flight started before op still be a valid answer after it
+static bool flight_conflicts(const struct YUFS_op* lead, const struct YUFS_op* op) {
+    if (op->type == YUFS_OP_WRITE || op->type == YUFS_OP_FALLOCATE || op->type == YUFS_OP_COPY_RANGE)
+        return lead->type != YUFS_OP_LOOKUP && lead->id == op->id;
+    // the target directory of a rename changes as well
+    if (op->type == YUFS_OP_RENAME && lead->type != YUFS_OP_READ &&
+        (lead->parent_id == op->new_parent_id || lead->id == op->new_parent_id))
+        return true;
+    if (lead->type == YUFS_OP_LOOKUP) return lead->parent_id == op->parent_id;
+    if (lead->type == YUFS_OP_GETATTR) return lead->id == op->parent_id || lead->id == op->id;
+    return false;
+}
+
+static void flight_unhash_locked(struct YUFS_flight* f) {
+    struct YUFS_flight** pp = &flights.buckets[f->hash % FLIGHT_BUCKETS];
+    while (*pp != f) pp = &(*pp)->next;
+    *pp = f->next;
+    f->hashed = false;
+}
+
+// callers arriving after a mutation started must not get the older answer,
+// done before the mutation is sent and again once it is answered
+static void flight_detach(const struct YUFS_op* op) {
+    YUFS_MUTEX_LOCK(&flights.lock);
+    for (int i = 0; i < FLIGHT_BUCKETS; i++) {
+        struct YUFS_flight** pp = &flights.buckets[i];
+        while (*pp) {
+            struct YUFS_flight* f = *pp;
+            if (flight_conflicts(f->op, op)) {
+                *pp = f->next;
+                f->hashed = false;
+            } else {
+                pp = &f->next;
+            }
+        }
+    }
+    YUFS_MUTEX_UNLOCK(&flights.lock);
+}
+
+static void flight_put(struct YUFS_flight* f) {
+    YUFS_MUTEX_LOCK(&flights.lock);
+    bool last = --f->refs == 0;
+    YUFS_MUTEX_UNLOCK(&flights.lock);
+    if (!last) return;
+    kfree(f->data);
+    kfree(f);
+}
+
+static int flight_follow(const char* token, struct YUFS_op* op, struct YUFS_flight* f) {
+    int ret;
+    YUFS_WAIT_COMPLETION(&f->done);
+    if (f->orphaned) {
+        ret = exec_op(token, op);
+    } else {
+        ret = f->ret;
+        op->stat = f->stat;
+        if (op->type == YUFS_OP_READ && ret > 0) memcpy(op->buf, f->data, ret);
+    }
+    flight_put(f);
+    return ret;
+}
+
+static uint32_t meta_name_bucket(uint32_t parent_id, const char* name, size_t len) {
+    uint32_t hash = flight_step(2166136261u, &parent_id, sizeof(parent_id));
+    return flight_step(hash, name, len) % META_CACHE_BUCKETS;
+}
+
+static uint32_t meta_id_bucket(uint32_t id) {
+    return (id * 2654435761u) % META_CACHE_BUCKETS;
+}
+
+// meta.lock held
+static struct YUFS_meta_cache* meta_cache(const char* token, bool create) {
+    int free_slot = -1;
+    for (int i = 0; i < META_CACHE_TOKENS; i++) {
+        if (!meta.caches[i]) {
+            if (free_slot < 0) free_slot = i;
+            continue;
+        }
+        if (strcmp(meta.caches[i]->token, token) == 0) return meta.caches[i];
+    }
+    if (!create || free_slot < 0) return NULL;
+
+    struct YUFS_meta_cache* cache = kzalloc(sizeof(struct YUFS_meta_cache), GFP_KERNEL);
+    if (!cache) return NULL;
+    cache->by_name = kvcalloc(META_CACHE_BUCKETS, sizeof(struct YUFS_meta_entry*), GFP_KERNEL);
+    cache->by_id = kvcalloc(META_CACHE_BUCKETS, sizeof(struct YUFS_meta_entry*), GFP_KERNEL);
+    if (!cache->by_name || !cache->by_id) {
+        kvfree(cache->by_name);
+        kvfree(cache->by_id);
+        kfree(cache);
+        return NULL;
+    }
+    strlcpy(cache->token, token, sizeof(cache->token));
+    meta.caches[free_slot] = cache;
+    return cache;
+}
+
+static void meta_count_coalesced(const char* token) {
+    YUFS_MUTEX_LOCK(&meta.lock);
+    struct YUFS_meta_cache* cache = meta_cache(token, true);
+    if (cache) cache->coalesced++;
+    YUFS_MUTEX_UNLOCK(&meta.lock);
+}
+
+static void meta_remove(struct YUFS_meta_cache* cache, struct YUFS_meta_entry* e) {
+    struct YUFS_meta_entry** pp = &cache->by_name[meta_name_bucket(e->parent_id, e->name, strlen(e->name))];
+    while (*pp != e) pp = &(*pp)->name_next;
+    *pp = e->name_next;
+    pp = &cache->by_id[meta_id_bucket(e->stat.id)];
+    while (*pp != e) pp = &(*pp)->id_next;
+    *pp = e->id_next;
+    meta.entries--;
+    kfree(e);
+}
+
+static struct YUFS_meta_entry* meta_find_name(struct YUFS_meta_cache* cache, uint32_t parent_id,
+                                              const char* name, size_t len) {
+    struct YUFS_meta_entry* e = cache->by_name[meta_name_bucket(parent_id, name, len)];
+    for (; e; e = e->name_next) {
+        if (e->parent_id == parent_id && strncmp(e->name, name, len) == 0 && e->name[len] == 0) return e;
+    }
+    return NULL;
+}
+
+static void meta_insert(struct YUFS_meta_cache* cache, uint32_t parent_id, const char* name, size_t len,
+                        const struct YUFS_stat* stat, uint64_t expires) {
+    struct YUFS_meta_entry* e = meta_find_name(cache, parent_id, name, len);
+    if (e) meta_remove(cache, e);
+    if (meta.entries >= META_CACHE_MAX) return;
+
+    e = kmalloc(sizeof(struct YUFS_meta_entry) + len + 1, GFP_KERNEL);
+    if (!e) return;
+    e->parent_id = parent_id;
+    e->stat = *stat;
+    e->expires = expires;
+    memcpy(e->name, name, len);
+    e->name[len] = 0;
+
+    uint32_t bucket = meta_name_bucket(parent_id, name, len);
+    e->name_next = cache->by_name[bucket];
+    cache->by_name[bucket] = e;
+    bucket = meta_id_bucket(stat->id);
+    e->id_next = cache->by_id[bucket];
+    cache->by_id[bucket] = e;
+    meta.entries++;
+}
+
+static void meta_forget_id(struct YUFS_meta_cache* cache, uint32_t id) {
+    struct YUFS_meta_entry* e = cache->by_id[meta_id_bucket(id)];
+    while (e) {
+        struct YUFS_meta_entry* next = e->id_next;
+        if (e->stat.id == id) meta_remove(cache, e);
+        e = next;
+    }
+}
+
+static void listing_free(struct YUFS_dir_listing* l) {
+    kvfree(l->entries);
+    kvfree(l->names);
+    kfree(l);
+}
+
+// meta.lock held
+static void listing_put(struct YUFS_dir_listing* l) {
+    if (--l->refs == 0) listing_free(l);
+}
+
+static void listing_unhash(struct YUFS_meta_cache* cache, struct YUFS_dir_listing** pp) {
+    struct YUFS_dir_listing* l = *pp;
+    *pp = l->next;
+    cache->listing_count--;
+    listing_put(l);
+}
+
+static void listing_drop(struct YUFS_meta_cache* cache, uint32_t dir_id) {
+    struct YUFS_dir_listing** pp = &cache->listings;
+    while (*pp) {
+        if ((*pp)->dir_id == dir_id) listing_unhash(cache, pp);
+        else pp = &(*pp)->next;
+    }
+}
+
+// a local change to dir_id, listings being filled right now miss it. An
+// oversized directory stays that way.
+static void listing_forget(struct YUFS_meta_cache* cache, uint32_t dir_id) {
+    struct YUFS_dir_listing** pp = &cache->listings;
+    while (*pp) {
+        if ((*pp)->dir_id == dir_id && !(*pp)->oversized) listing_unhash(cache, pp);
+        else pp = &(*pp)->next;
+    }
+    cache->listing_gen++;
+}
+
+static void meta_free_cache(struct YUFS_meta_cache* cache) {
+    while (cache->listings) listing_unhash(cache, &cache->listings);
+    for (int i = 0; i < META_CACHE_BUCKETS; i++) {
+        while (cache->by_name[i]) meta_remove(cache, cache->by_name[i]);
+    }
+    kvfree(cache->by_name);
+    kvfree(cache->by_id);
+    kfree(cache);
+}
+
+static bool meta_cached_lookup(const char* token, uint32_t parent_id, const char* name, struct YUFS_stat* result) {
+    bool hit = false;
+    YUFS_MUTEX_LOCK(&meta.lock);
+    struct YUFS_meta_cache* cache = meta_cache(token, false);
+    struct YUFS_meta_entry* e = cache ? meta_find_name(cache, parent_id, name, strlen(name)) : NULL;
+    if (e && e->expires < YUFS_NOW_NS()) {
+        meta_remove(cache, e);
+        e = NULL;
+    }
+    if (e) {
+        *result = e->stat;
+        hit = true;
+    }
+    YUFS_MUTEX_UNLOCK(&meta.lock);
+    return hit;
+}
+
+static bool meta_cached_getattr(const char* token, uint32_t id, struct YUFS_stat* result) {
+    bool hit = false;
+    YUFS_MUTEX_LOCK(&meta.lock);
+    struct YUFS_meta_cache* cache = meta_cache(token, false);
+    struct YUFS_meta_entry* e = cache ? cache->by_id[meta_id_bucket(id)] : NULL;
+    for (; e; e = e->id_next) {
+        if (e->stat.id != id) continue;
+        if (e->expires < YUFS_NOW_NS()) break;
+        *result = e->stat;
+        hit = true;
+        break;
+    }
+    YUFS_MUTEX_UNLOCK(&meta.lock);
+    return hit;
+}
+
+// meta.lock held
+static void meta_forget_children(struct YUFS_meta_cache* cache, uint32_t dir_id) {
+    for (int b = 0; b < META_CACHE_BUCKETS && meta.entries; b++) {
+        struct YUFS_meta_entry* e = cache->by_name[b];
+        while (e) {
+            struct YUFS_meta_entry* next = e->name_next;
+            if (e->parent_id == dir_id) meta_remove(cache, e);
+            e = next;
+        }
+    }
+}
+
+// The backend's answer for stat->id replaces what the cache holds. A
+// directory that moved on, or one the cache has no version of, loses the
+// names and the listing cached under it; its stat is kept under the empty
+// name so the next answer has a version to compare with.
+static void meta_refresh(const char* token, const struct YUFS_stat* stat) {
+    YUFS_MUTEX_LOCK(&meta.lock);
+    struct YUFS_meta_cache* cache = meta_cache(token, false);
+    if (cache && meta.ttl_ns) {
+        bool moved = true;
+        for (struct YUFS_meta_entry* e = cache->by_id[meta_id_bucket(stat->id)]; e; e = e->id_next) {
+            if (e->stat.id != stat->id) continue;
+            moved = e->stat.version != stat->version;
+            e->stat = *stat;
+        }
+        if (moved && S_ISDIR(stat->mode)) {
+            meta_forget_children(cache, stat->id);
+            listing_drop(cache, stat->id);
+            meta_insert(cache, stat->id, "", 0, stat, YUFS_NOW_NS() + meta.ttl_ns);
+        }
+    }
+    YUFS_MUTEX_UNLOCK(&meta.lock);
+}
+
+// drops what op is about to change, other clients are covered by the ttl
+static void meta_forget(const char* token, const struct YUFS_op* op) {
+    YUFS_MUTEX_LOCK(&meta.lock);
+    struct YUFS_meta_cache* cache = meta_cache(token, false);
+    if (cache) {
+        if (op->type == YUFS_OP_WRITE || op->type == YUFS_OP_FALLOCATE || op->type == YUFS_OP_COPY_RANGE) {
+            meta_forget_id(cache, op->id);
+        } else {
+            struct YUFS_meta_entry* e = meta_find_name(cache, op->parent_id, op->name, strlen(op->name));
+            // the other names of an unlinked file carry its old link count
+            if (e && op->type == YUFS_OP_UNLINK) meta_forget_id(cache, e->stat.id);
+            else if (e) meta_remove(cache, e);
+            meta_forget_id(cache, op->parent_id);
+            if (op->type == YUFS_OP_LINK) meta_forget_id(cache, op->id);
+            listing_forget(cache, op->parent_id);
+            if (op->type == YUFS_OP_RENAME) {
+                e = meta_find_name(cache, op->new_parent_id, op->new_name, strlen(op->new_name));
+                if (e) meta_remove(cache, e);
+                meta_forget_id(cache, op->new_parent_id);
+                listing_forget(cache, op->new_parent_id);
+            }
+        }
+    }
+    YUFS_MUTEX_UNLOCK(&meta.lock);
+}
+
+// does op touch the inode or the name a pending create is making
+static bool pending_blocks(const struct YUFS_pending* p, const char* token, const struct YUFS_op* op) {
+    if (op == &p->op || strcmp(p->token, token) != 0) return false;
+    if (op->id && p->op.id == op->id) return true;
+    if (op->src_id && p->op.id == op->src_id) return true;
+    if (op->parent_id && p->op.id == op->parent_id) return true;
+    if (op->new_parent_id && p->op.id == op->new_parent_id) return true;
+    if (op->new_name && p->op.parent_id == op->new_parent_id && strcmp(p->name, op->new_name) == 0) return true;
+    return op->name && p->op.parent_id == op->parent_id && strcmp(p->name, op->name) == 0;
+}
+
+static bool pending_busy(const char* token, const struct YUFS_op* op) {
+    bool busy = false;
+    YUFS_MUTEX_LOCK(&creates.lock);
+    for (struct YUFS_pending* p = creates.pending; p && !busy; p = p->next) {
+        busy = pending_blocks(p, token, op);
+    }
+    YUFS_MUTEX_UNLOCK(&creates.lock);
+    return busy;
+}
+
+// An op on a leased inode waits until its create reached the backend. A
+// failed create is retired right away, the op then gets the backend's answer.
+static void pending_wait(const char* token, const struct YUFS_op* op) {
+    if (!creates.pending) return;
+    YUFS_WAIT_EVENT(&creates.wait, !pending_busy(token, op));
+}
+
+static void pending_done(struct YUFS_op* op) {
+    struct YUFS_pending* p = (struct YUFS_pending*)op->priv;
+    bool failed = op->ret != 0;
+
+    YUFS_MUTEX_LOCK(&creates.lock);
+    creates.inflight--;
+    struct YUFS_pending** pp = &creates.pending;
+    while (*pp != p) pp = &(*pp)->next;
+    *pp = p->next;
+    if (failed) {
+        // YUFSCore_sync may free it as soon as the lock is dropped
+        YUFS_LOG_ERR("create of %s in %u failed: %d", p->name, p->op.parent_id, op->ret);
+        p->next = creates.failed;
+        creates.failed = p;
+    }
+    YUFS_MUTEX_UNLOCK(&creates.lock);
+    if (!failed) kfree(p);
+    YUFS_WAKE_UP(&creates.wait);
+}
+
+// creates.lock held, NULL when every slot has another token
+static struct YUFS_lease* lease_slot(const char* token) {
+    for (int i = 0; i < META_CACHE_TOKENS; i++) {
+        if (strcmp(creates.leases[i].token, token) == 0) return &creates.leases[i];
+    }
+    for (int i = 0; i < META_CACHE_TOKENS; i++) {
+        struct YUFS_lease* lease = &creates.leases[i];
+        if (lease->token[0] == 0) {
+            strlcpy(lease->token, token, sizeof(lease->token));
+            lease->next = lease->end = 0;
+            return lease;
+        }
+    }
+    return NULL;
+}
+
+// 0 when the backend didn't hand out a range. The round trip for a new range
+// runs unlocked, of two racing refills one range is simply dropped.
+static uint32_t lease_take(const char* token) {
+    uint32_t id = 0;
+    YUFS_MUTEX_LOCK(&creates.lock);
+    struct YUFS_lease* lease = lease_slot(token);
+    if (lease && lease->next != lease->end) id = lease->next++;
+    YUFS_MUTEX_UNLOCK(&creates.lock);
+    if (id || !lease) return id;
+
+    TO_STR(count_str, creates.lease_size, "%u");
+    char dummy[8];
+    int64_t first = vtfs_http_call(token, "lease", 0, dummy, sizeof(dummy), 1, "count", count_str);
+    if (first <= 0) return 0;
+
+    YUFS_MUTEX_LOCK(&creates.lock);
+    lease = lease_slot(token);
+    if (lease && lease->next == lease->end) {
+        lease->next = (uint32_t)first;
+        lease->end = lease->next + creates.lease_size;
+    }
+    if (lease && lease->next != lease->end) id = lease->next++;
+    YUFS_MUTEX_UNLOCK(&creates.lock);
+    return id;
+}
+
+static bool dir_settled(const char* token, uint32_t dir_id) {
+    bool settled = true;
+    YUFS_MUTEX_LOCK(&creates.lock);
+    for (struct YUFS_pending* p = creates.pending; p && settled; p = p->next) {
+        settled = p->op.parent_id != dir_id || strcmp(p->token, token) != 0;
+    }
+    YUFS_MUTEX_UNLOCK(&creates.lock);
+    return settled;
+}
+
+static bool create_can_start(void) {
+    return creates.inflight < CREATE_INFLIGHT_MAX;
+}
+
+// With leasing on, a create takes its id locally and the backend learns about
+// it from the async workers. Whatever goes wrong there is reported by
+// YUFSCore_sync, the usual callers being fsync and flush.
+static int create_leased(const char* token, uint32_t parent_id, const char* name, umode_t mode,
+                         struct YUFS_stat* result) {
+    struct YUFS_op lookup = {.type = YUFS_OP_LOOKUP, .parent_id = parent_id, .name = name};
+    struct YUFS_pending* p;
+    pending_wait(token, &lookup);
+
+    p = kzalloc(sizeof(struct YUFS_pending), GFP_KERNEL);
+    if (!p) return -ENOMEM;
+    strlcpy(p->token, token, sizeof(p->token));
+    strlcpy(p->name, name, sizeof(p->name));
+
+    YUFS_WAIT_EVENT(&creates.wait, create_can_start());
+    uint32_t id = lease_take(token);
+    if (id == 0) {
+        kfree(p);
+        return 1;
+    }
+    YUFS_MUTEX_LOCK(&creates.lock);
+    p->op.type = YUFS_OP_CREATE;
+    p->op.id = id;
+    p->op.parent_id = parent_id;
+    p->op.name = p->name;
+    p->op.mode = mode;
+    p->op.done = pending_done;
+    p->op.priv = p;
+    p->next = creates.pending;
+    creates.pending = p;
+    creates.inflight++;
+    YUFS_MUTEX_UNLOCK(&creates.lock);
+
+    if (result) {
+        result->id = id;
+        result->mode = mode;
+        result->size = 0;
+        result->version = 1;
+        result->nlink = 1;
+    }
+    YUFSCore_submit(p->token, &p->op);
+    return 0;
+}
+
+// Identical lookup/getattr/read calls in flight at the same time share one
+// backend request, the first caller issues it and the rest copy its result.
+static int run_shared(const char* token, struct YUFS_op* op) {
+    uint32_t hash = flight_hash(token, op);
+    struct YUFS_flight* f;
+    int ret;
+    int followers;
+
+    YUFS_MUTEX_LOCK(&flights.lock);
+    for (f = flights.buckets[hash % FLIGHT_BUCKETS]; f; f = f->next) {
+        if (!flight_match(f, hash, token, op)) continue;
+        f->refs++;
+        YUFS_MUTEX_UNLOCK(&flights.lock);
+        meta_count_coalesced(token);
+        return flight_follow(token, op, f);
+    }
+    f = kzalloc(sizeof(struct YUFS_flight), GFP_KERNEL);
+    if (!f) {
+        YUFS_MUTEX_UNLOCK(&flights.lock);
+        return exec_op(token, op);
+    }
+    f->op = op;
+    f->token = token;
+    f->hash = hash;
+    f->refs = 1;
+    f->hashed = true;
+    YUFS_COMPLETION_INIT(&f->done);
+    f->next = flights.buckets[hash % FLIGHT_BUCKETS];
+    flights.buckets[hash % FLIGHT_BUCKETS] = f;
+    YUFS_MUTEX_UNLOCK(&flights.lock);
+
+    ret = exec_op(token, op);
+
+    YUFS_MUTEX_LOCK(&flights.lock);
+    if (f->hashed) flight_unhash_locked(f);
+    followers = f->refs - 1;
+    YUFS_MUTEX_UNLOCK(&flights.lock);
+
+    f->ret = ret;
+    f->stat = op->stat;
+    if (followers && op->type == YUFS_OP_READ && ret > 0) {
+        f->data = kmalloc(ret, GFP_KERNEL);
+        if (f->data) memcpy(f->data, op->buf, ret);
+        else f->orphaned = true;
+    }
+    YUFS_COMPLETE(&f->done);
+    flight_put(f);
+    return ret;
+}
+
+static int run_op(const char* token, struct YUFS_op* op) {
+    pending_wait(token, op);
+    if (op_shareable(op)) return run_shared(token, op);
+    flight_detach(op);
+    meta_forget(token, op);
+    int ret = exec_op(token, op);
+    // flights started while op ran may have read the state before it
+    flight_detach(op);
+    return ret;
+}
+
+static bool async_has_work(void) {
+    return async_queue.head || async_queue.stopping;
+}
+
+static int async_worker(void* arg) {
+    yufs_completion_t* exited = (yufs_completion_t*)arg;
+
+    while (true) {
+        struct YUFS_op* batch[ASYNC_BATCH];
+        struct vtfs_http_req* reqs[ASYNC_BATCH];
+        size_t n = 0;
+
+        YUFS_WAIT_EVENT(&async_queue.wait, async_has_work());
+
+        YUFS_MUTEX_LOCK(&async_queue.lock);
+        // leave work for the other workers unless the queue is deep
+        size_t take = async_queue.queued / ASYNC_WORKERS;
+        if (take == 0) take = 1;
+        while (async_queue.head && n < take && n < ASYNC_BATCH) {
+            batch[n] = async_queue.head;
+            async_queue.head = batch[n]->next;
+            async_queue.queued--;
+            n++;
+        }
+        if (!async_queue.head) async_queue.tail = NULL;
+        bool stop = n == 0 && async_queue.stopping;
+        YUFS_MUTEX_UNLOCK(&async_queue.lock);
+
+        if (stop) break;
+        if (n == 0) continue;
+
+        for (size_t i = 0; i < n; i++) reqs[i] = &((struct YUFS_web_op*)batch[i]->engine_data)->req;
+        vtfs_http_exec(reqs, n);
+
+        for (size_t i = 0; i < n; i++) {
+            struct YUFS_web_op* w = (struct YUFS_web_op*)batch[i]->engine_data;
+            batch[i]->ret = finish_op(batch[i], w);
+            batch[i]->engine_data = NULL;
+            kfree(w);
+            if (!op_shareable(batch[i])) flight_detach(batch[i]);
+            complete_op(batch[i]);
+        }
+    }
+    YUFS_THREAD_EXIT(exited);
+}
+
+static void tunables_reset(void) {
+    stripe.size = STRIPE_SIZE_DEFAULT;
+    stripe.fanout = STRIPE_FANOUT_DEFAULT;
+    creates.lease_size = 0;
+    meta.ttl_ns = META_TTL_DEFAULT * 1000000000ull;
+    meta.dir_ttl_ns = DIR_TTL_DEFAULT * 1000000000ull;
+}
+
+// a mount is using current, another value would change it under that mount
+static int tunable_check(uint64_t current, uint64_t value) {
+    bool busy;
+    YUFS_MUTEX_LOCK(&mounts.lock);
+    busy = mounts.sessions > 0 && current != value;
+    YUFS_MUTEX_UNLOCK(&mounts.lock);
+    return busy ? -EBUSY : 0;
+}
+
+int YUFSCore_init(void) {
+    int err = vtfs_http_init();
+    if (err) return err;
+
+    YUFS_MUTEX_INIT(&flights.lock);
+    memset(flights.buckets, 0, sizeof(flights.buckets));
+
+    YUFS_MUTEX_INIT(&creates.lock);
+    YUFS_WAITQ_INIT(&creates.wait);
+    memset(creates.leases, 0, sizeof(creates.leases));
+    creates.pending = NULL;
+    creates.failed = NULL;
+    creates.inflight = 0;
+
+    YUFS_MUTEX_INIT(&meta.lock);
+    memset(meta.caches, 0, sizeof(meta.caches));
+    meta.entries = 0;
+
+    YUFS_MUTEX_INIT(&mounts.lock);
+    mounts.sessions = 0;
+    tunables_reset();
+
+    YUFS_MUTEX_INIT(&async_queue.lock);
+    YUFS_WAITQ_INIT(&async_queue.wait);
+    async_queue.head = async_queue.tail = NULL;
+    async_queue.queued = 0;
+    async_queue.stopping = false;
+    async_queue.workers = 0;
+    for (int i = 0; i < ASYNC_WORKERS; i++) {
+        YUFS_COMPLETION_INIT(&async_queue.exited[i]);
+        if (YUFS_THREAD_RUN(async_worker, &async_queue.exited[i], "yufs-async") != 0) break;
+        async_queue.workers++;
+    }
+    if (async_queue.workers == 0) {
+        vtfs_http_destroy();
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+void YUFSCore_destroy(void) {
+    // workers drain the queue before they exit
+    YUFS_MUTEX_LOCK(&async_queue.lock);
+    async_queue.stopping = true;
+    YUFS_MUTEX_UNLOCK(&async_queue.lock);
+    YUFS_WAKE_UP(&async_queue.wait);
+    for (int i = 0; i < async_queue.workers; i++) YUFS_WAIT_COMPLETION(&async_queue.exited[i]);
+    async_queue.workers = 0;
+
+    for (int i = 0; i < META_CACHE_TOKENS; i++) {
+        if (meta.caches[i]) meta_free_cache(meta.caches[i]);
+        meta.caches[i] = NULL;
+    }
+    // the workers are gone, whatever is left failed and was never reported
+    while (creates.pending) {
+        struct YUFS_pending* p = creates.pending;
+        creates.pending = p->next;
+        kfree(p);
+    }
+    while (creates.failed) {
+        struct YUFS_pending* p = creates.failed;
+        creates.failed = p->next;
+        kfree(p);
+    }
+
+    vtfs_http_destroy();
+}
+
+int YUFSCore_configure(const char* key, const char* value) {
+    if (strcmp(key, "backends") == 0) return vtfs_http_set_backends(value);
+    if (strcmp(key, "uds") == 0) {
+        // shorthand for a single local backend: uds=/run/yufs.sock
+        char spec[128];
+        if (snprintf(spec, sizeof(spec), "unix:%s", value) >= sizeof(spec)) return -EINVAL;
+        return vtfs_http_set_backends(spec);
+    }
+    if (strcmp(key, "stripe_size") == 0) {
+        unsigned int size;
+        if (kstrtouint(value, 10, &size) != 0) return -EINVAL;
+        if (size < STRIPE_SIZE_MIN || size > STRIPE_SIZE_MAX) return -EINVAL;
+        if (tunable_check(stripe.size, size)) return -EBUSY;
+        stripe.size = size;
+        return 0;
+    }
+    if (strcmp(key, "stripe_fanout") == 0) {
+        unsigned int fanout;
+        if (kstrtouint(value, 10, &fanout) != 0) return -EINVAL;
+        if (fanout < 1 || fanout > STRIPE_FANOUT_MAX) return -EINVAL;
+        if (tunable_check(stripe.fanout, fanout)) return -EBUSY;
+        stripe.fanout = fanout;
+        return 0;
+    }
+    if (strcmp(key, "create_lease") == 0) {
+        // inode ids leased per backend round trip, 0 keeps creates synchronous
+        unsigned int size;
+        if (kstrtouint(value, 10, &size) != 0 || size > LEASE_MAX) return -EINVAL;
+        if (tunable_check(creates.lease_size, size)) return -EBUSY;
+        creates.lease_size = size;
+        return 0;
+    }
+    if (strcmp(key, "meta_ttl") == 0) {
+        // seconds a prefetched entry is trusted, 0 turns the cache off
+        unsigned int ttl;
+        if (kstrtouint(value, 10, &ttl) != 0) return -EINVAL;
+        if (tunable_check(meta.ttl_ns, ttl * 1000000000ull)) return -EBUSY;
+        meta.ttl_ns = ttl * 1000000000ull;
+        return 0;
+    }
+    if (strcmp(key, "dir_ttl") == 0) {
+        // seconds a directory listing is reused, 0 lists from the backend every time
+        unsigned int ttl;
+        if (kstrtouint(value, 10, &ttl) != 0) return -EINVAL;
+        if (tunable_check(meta.dir_ttl_ns, ttl * 1000000000ull)) return -EBUSY;
+        meta.dir_ttl_ns = ttl * 1000000000ull;
+        return 0;
+    }
+    return -1;
+}
+
+int YUFSCore_open_session(const char* token) {
+    int err = vtfs_http_session_open(token);
+    if (err) return err;
+    YUFS_MUTEX_LOCK(&mounts.lock);
+    mounts.sessions++;
+    YUFS_MUTEX_UNLOCK(&mounts.lock);
+    return 0;
+}
+
+int YUFSCore_stats(const char* token, char* buf, size_t size) {
+    static const char* names[VTFS_PRIO_COUNT] = {"meta", "bulk"};
+    int len = 0;
+
+    for (int prio = 0; prio < VTFS_PRIO_COUNT && len < size; prio++) {
+        struct vtfs_class_stats stats;
+        vtfs_http_class_stats(token, prio, &stats);
+        len += scnprintf(buf + len, size - len, "%s: count=%llu errors=%llu avg_us=%llu max_us=%llu\n",
+                         names[prio], (unsigned long long)stats.count, (unsigned long long)stats.errors,
+                         (unsigned long long)(stats.count ? stats.total_ns / stats.count / 1000 : 0),
+                         (unsigned long long)(stats.max_ns / 1000));
+    }
+    if (len < size) {
+        YUFS_MUTEX_LOCK(&meta.lock);
+        struct YUFS_meta_cache* cache = meta_cache(token, false);
+        len += scnprintf(buf + len, size - len, "coalesced: %llu\nlistings: hits=%llu misses=%llu\n",
+                         (unsigned long long)(cache ? cache->coalesced : 0),
+                         (unsigned long long)(cache ? cache->dir_hits : 0),
+                         (unsigned long long)(cache ? cache->dir_misses : 0));
+        YUFS_MUTEX_UNLOCK(&meta.lock);
+    }
+    for (int method = 0; method < vtfs_http_method_count() && len < size; method++) {
+        static const char* phases[VTFS_PHASE_COUNT] = {"connect", "send", "ttfb", "recv", "parse"};
+        struct vtfs_method_stats stats;
+        vtfs_http_method_stats(token, method, &stats);
+        if (stats.bytes_sent == 0) continue;
+
+        len += scnprintf(buf + len, size - len, "%s: sent=%llu received=%llu\n", vtfs_http_method_name(method),
+                         (unsigned long long)stats.bytes_sent, (unsigned long long)stats.bytes_received);
+        for (int phase = 0; phase < VTFS_PHASE_COUNT; phase++) {
+            uint64_t count = 0;
+            for (int b = 0; b < VTFS_HIST_BUCKETS; b++) count += stats.hist[phase][b];
+            if (count == 0) continue;
+            len += scnprintf(buf + len, size - len, "  %s: count=%llu avg_us=%llu", phases[phase],
+                             (unsigned long long)count, (unsigned long long)(stats.total_ns[phase] / count / 1000));
+            // "<N:" is the count below N microseconds
+            for (int b = 0; b < VTFS_HIST_BUCKETS; b++) {
+                if (stats.hist[phase][b] == 0) continue;
+                len += scnprintf(buf + len, size - len, b == VTFS_HIST_BUCKETS - 1 ? " >=%lu:%llu" : " <%lu:%llu",
+                                 b == VTFS_HIST_BUCKETS - 1 ? 1ul << (b - 1) : 1ul << b,
+                                 (unsigned long long)stats.hist[phase][b]);
+            }
+            len += scnprintf(buf + len, size - len, "\n");
+        }
+    }
+    return len;
+}
+
+void YUFSCore_reset_stats(const char* token) {
+    vtfs_http_reset_stats(token);
+    YUFS_MUTEX_LOCK(&meta.lock);
+    struct YUFS_meta_cache* cache = meta_cache(token, false);
+    if (cache) cache->coalesced = cache->dir_hits = cache->dir_misses = 0;
+    YUFS_MUTEX_UNLOCK(&meta.lock);
+}
+
+static bool sync_ready(const char* token, uint32_t id) {
+    bool ready = true;
+    YUFS_MUTEX_LOCK(&creates.lock);
+    for (struct YUFS_pending* p = creates.pending; p && ready; p = p->next) {
+        if (strcmp(p->token, token) == 0 && (id == 0 || p->op.id == id)) ready = false;
+    }
+    YUFS_MUTEX_UNLOCK(&creates.lock);
+    return ready;
+}
+
+int YUFSCore_sync(const char* token, uint32_t id) {
+    struct YUFS_pending* failed = NULL;
+    int ret = 0;
+
+    YUFS_WAIT_EVENT(&creates.wait, sync_ready(token, id));
+
+    YUFS_MUTEX_LOCK(&creates.lock);
+    struct YUFS_pending** pp = &creates.failed;
+    while (*pp) {
+        struct YUFS_pending* p = *pp;
+        if (strcmp(p->token, token) == 0 && (id == 0 || p->op.id == id)) {
+            *pp = p->next;
+            if (ret == 0) ret = p->op.ret;
+            p->next = failed;
+            failed = p;
+        } else {
+            pp = &p->next;
+        }
+    }
+    YUFS_MUTEX_UNLOCK(&creates.lock);
+
+    while (failed) {
+        struct YUFS_pending* p = failed;
+        failed = p->next;
+        kfree(p);
+    }
+    return ret;
+}
+
+void YUFSCore_close_session(const char* token) {
+    YUFSCore_sync(token, 0);
+    YUFS_MUTEX_LOCK(&creates.lock);
+    for (int i = 0; i < META_CACHE_TOKENS; i++) {
+        if (strcmp(creates.leases[i].token, token) == 0) creates.leases[i].token[0] = 0;
+    }
+    YUFS_MUTEX_UNLOCK(&creates.lock);
+
+    YUFS_MUTEX_LOCK(&meta.lock);
+    for (int i = 0; i < META_CACHE_TOKENS; i++) {
+        if (meta.caches[i] && strcmp(meta.caches[i]->token, token) == 0) {
+            meta_free_cache(meta.caches[i]);
+            meta.caches[i] = NULL;
+        }
+    }
+    YUFS_MUTEX_UNLOCK(&meta.lock);
+    vtfs_http_session_close(token);
+
+    YUFS_MUTEX_LOCK(&mounts.lock);
+    if (--mounts.sessions == 0) tunables_reset();
+    YUFS_MUTEX_UNLOCK(&mounts.lock);
+}
+
+// The backend streams the subtree as packed records in pages of
+// PREFETCH_CHUNK, the 8 bytes in front of every page are the cursor of the
+// next one.
+int YUFSCore_prefetch(const char* token, uint32_t root_id) {
+    TO_STR(root_str, root_id, "%u");
+    TO_STR(size_str, PREFETCH_CHUNK, "%d");
+    int64_t cursor = 0;
+    int cached = 0;
+
+    if (meta.ttl_ns == 0) return 0;
+    char* page = kvmalloc(PREFETCH_CHUNK, GFP_KERNEL);
+    if (!page) return -ENOMEM;
+
+    while (true) {
+        TO_STR(after_str, (long long)cursor, "%lld");
+        int64_t count = vtfs_http_call(token, "prefetch", root_id, page, PREFETCH_CHUNK,
+                                       3, "root", root_str, "after", after_str, "size", size_str);
+        if (count <= 0) {
+            if (count < 0 && cached == 0) cached = (int)count;
+            break;
+        }
+        uint64_t expires = YUFS_NOW_NS() + meta.ttl_ns;
+        size_t pos = sizeof(int64_t);
+        memcpy(&cursor, page, sizeof(int64_t));
+
+        YUFS_MUTEX_LOCK(&meta.lock);
+        struct YUFS_meta_cache* cache = meta_cache(token, true);
+        for (int64_t i = 0; cache && i < count && pos + sizeof(struct YUFS_packed_meta) <= PREFETCH_CHUNK; i++) {
+            struct YUFS_packed_meta rec;
+            memcpy(&rec, page + pos, sizeof(rec));
+            pos += sizeof(rec);
+            if (pos + rec.name_len > PREFETCH_CHUNK || rec.name_len >= MAX_NAME_SIZE) break;
+
+            struct YUFS_stat stat = {.id = rec.id, .mode = rec.mode, .size = rec.size, .version = rec.version,
+                                     .nlink = rec.nlink};
+            meta_insert(cache, rec.parent_id, page + pos, rec.name_len, &stat, expires);
+            pos += rec.name_len;
+            cached++;
+        }
+        YUFS_MUTEX_UNLOCK(&meta.lock);
+        if (!cache) break;
+    }
+    kvfree(page);
+    return cached;
+}
+
+int YUFSCore_submit_batch(const char* token, struct YUFS_op* ops, size_t count) {
+    struct YUFS_op* head = NULL;
+    struct YUFS_op* tail = NULL;
+    size_t queued = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        struct YUFS_op* op = &ops[i];
+        YUFS_COMPLETION_INIT(&op->completion);
+        op->next = NULL;
+        // queued ops may run on any worker, none may overtake a leased create
+        pending_wait(token, op);
+        if (!op_shareable(op)) {
+            flight_detach(op);
+            meta_forget(token, op);
+        }
+
+        struct YUFS_web_op* w = kmalloc(sizeof(struct YUFS_web_op), GFP_KERNEL);
+        int err = w ? prepare_op(token, op, w) : -ENOMEM;
+        if (err) {
+            kfree(w);
+            op->ret = err;
+            complete_op(op);
+            continue;
+        }
+        op->engine_data = w;
+        if (tail) tail->next = op;
+        else head = op;
+        tail = op;
+        queued++;
+    }
+    if (!head) return 0;
+
+    YUFS_MUTEX_LOCK(&async_queue.lock);
+    if (async_queue.tail) async_queue.tail->next = head;
+    else async_queue.head = head;
+    async_queue.tail = tail;
+    async_queue.queued += queued;
+    YUFS_MUTEX_UNLOCK(&async_queue.lock);
+    YUFS_WAKE_UP(&async_queue.wait);
+    return 0;
+}
+
+int YUFSCore_submit(const char* token, struct YUFS_op* op) {
+    return YUFSCore_submit_batch(token, op, 1);
+}
 
 int YUFSCore_lookup(const char* token, uint32_t parent_id, const char* name, struct YUFS_stat* result) {
-    TO_STR(pid_str, parent_id, "%u");
-    return (int)vtfs_http_call(token, "lookup", (char*)result, sizeof(struct YUFS_stat),
-                                 2, "parent_id", pid_str, "name", name);
+    struct YUFS_op op = {.type = YUFS_OP_LOOKUP, .parent_id = parent_id, .name = name};
+    if (meta_cached_lookup(token, parent_id, name, result)) return 0;
+    int ret = run_op(token, &op);
+    if (ret == 0) *result = op.stat;
+    return ret;
 }
 
 int YUFSCore_create(const char* token, uint32_t parent_id, const char* name, umode_t mode, struct YUFS_stat* result) {
-    TO_STR(pid_str, parent_id, "%u");
-    TO_STR(mode_str, mode, "%u");
-    struct YUFS_stat temp_stat;
-    int64_t ret = vtfs_http_call(token, "create", (char*)&temp_stat, sizeof(struct YUFS_stat),
-                                 3, "parent_id", pid_str, "name", name, "mode", mode_str);
-    if (ret == 0 && result) *result = temp_stat;
-    return (int)ret;
+    struct YUFS_op op = {.type = YUFS_OP_CREATE, .parent_id = parent_id, .name = name, .mode = mode};
+    if (creates.lease_size) {
+        // 1 - no lease to take an id from, fall back to the backend's id
+        int ret = create_leased(token, parent_id, name, mode, result);
+        if (ret <= 0) return ret;
+    }
+    int ret = run_op(token, &op);
+    if (ret == 0 && result) *result = op.stat;
+    return ret;
 }
 
 int YUFSCore_link(const char* token, uint32_t target_id, uint32_t parent_id, const char* name) {
-    TO_STR(tid_str, target_id, "%u");
-    TO_STR(pid_str, parent_id, "%u");
-    char dummy[64];
-    return (int)vtfs_http_call(token, "link", dummy, sizeof(dummy), 3, "target_id", tid_str, "parent_id", pid_str, "name", name);
+    struct YUFS_op op = {.type = YUFS_OP_LINK, .id = target_id, .parent_id = parent_id, .name = name};
+    return run_op(token, &op);
 }
 
 int YUFSCore_unlink(const char* token, uint32_t parent_id, const char* name) {
-    TO_STR(pid_str, parent_id, "%u");
-    char dummy[64];
-    return (int)vtfs_http_call(token, "unlink", dummy, sizeof(dummy), 2, "parent_id", pid_str, "name", name);
+    struct YUFS_op op = {.type = YUFS_OP_UNLINK, .parent_id = parent_id, .name = name};
+    return run_op(token, &op);
 }
 
 int YUFSCore_rmdir(const char* token, uint32_t parent_id, const char* name) {
-    TO_STR(pid_str, parent_id, "%u");
-    char dummy[64];
-    return (int)vtfs_http_call(token, "rmdir", dummy, sizeof(dummy), 2, "parent_id", pid_str, "name", name);
+    struct YUFS_op op = {.type = YUFS_OP_RMDIR, .parent_id = parent_id, .name = name};
+    return run_op(token, &op);
+}
+
+int YUFSCore_rename(const char* token, uint32_t parent_id, const char* name,
+                    uint32_t new_parent_id, const char* new_name, unsigned int flags) {
+    struct YUFS_op op = {.type = YUFS_OP_RENAME, .parent_id = parent_id, .name = name,
+                         .new_parent_id = new_parent_id, .new_name = new_name, .flags = flags};
+    return run_op(token, &op);
 }
 
 int YUFSCore_getattr(const char* token, uint32_t id, struct YUFS_stat* result) {
-    TO_STR(id_str, id, "%u");
-    return (int)vtfs_http_call(token, "getattr", (char*)result, sizeof(struct YUFS_stat), 1, "id", id_str);
+    struct YUFS_op op = {.type = YUFS_OP_GETATTR, .id = id};
+    if (meta_cached_getattr(token, id, result)) return 0;
+    int ret = run_op(token, &op);
+    if (ret == 0) *result = op.stat;
+    return ret;
 }
 
-int YUFSCore_read(const char* token, uint32_t id, char *buf, size_t size, loff_t offset) {
-    TO_STR(id_str, id, "%u");
-    TO_STR(sz_str, size, "%lu");
-    TO_STR(off_str, offset, "%lld");
+int YUFSCore_getattr_fresh(const char* token, uint32_t id, struct YUFS_stat* result) {
+    struct YUFS_op op = {.type = YUFS_OP_GETATTR, .id = id};
+    int ret = run_op(token, &op);
+    if (ret != 0) return ret;
+    meta_refresh(token, &op.stat);
+    *result = op.stat;
+    return 0;
+}
 
-    char *kbuf = kmalloc(size, GFP_KERNEL);
-    if (!kbuf) return -ENOMEM;
+// Bulk data moves in stripes handed to the async workers, so a round of
+// fan-out stripes runs on as many connections at once. Every round waits for
+// all of its stripes, then the result is the contiguous prefix: a short or
+// failed stripe ends the transfer even if later stripes of the round came
+// back full. Read bytes past the returned count are not meaningful; write
+// stripes of a round form a chain the backend applies in order and stops
+// after a failure, so nothing lands past the returned count. The version is
+// the newest one the written prefix reported.
+static int run_bulk(const char* token, enum YUFS_op_type type, uint32_t id, char *buf, size_t size, loff_t offset,
+                    uint64_t* version) {
+    size_t stripe_size = stripe.size;
+    int fanout = stripe.fanout;
+    struct YUFS_op* ops;
+    size_t done = 0;
+    int error = 0;
+    bool stop = false;
+
+    if (size <= stripe_size) {
+        struct YUFS_op op = {.type = type, .id = id, .buf = buf, .size = size, .offset = offset};
+        int ret = run_op(token, &op);
+        if (version) *version = ret >= 0 ? op.stat.version : 0;
+        return ret;
+    }
+    if (version) *version = 0;
+    ops = kcalloc(fanout, sizeof(struct YUFS_op), GFP_KERNEL);
+    if (!ops) return -ENOMEM;
+    // once for the whole transfer, the stripes all name the same inode
+    ops[0].id = id;
+    pending_wait(token, &ops[0]);
+
+    while (done < size && !stop) {
+        uint64_t chain = type == YUFS_OP_WRITE ? get_random_u64() | 1 : 0;
+        size_t issued = done;
+        int n = 0;
+        for (; n < fanout && issued < size; n++) {
+            size_t chunk = size - issued < stripe_size ? size - issued : stripe_size;
+            memset(&ops[n], 0, sizeof(struct YUFS_op));
+            ops[n].type = type;
+            ops[n].id = id;
+            ops[n].buf = buf + issued;
+            ops[n].size = chunk;
+            ops[n].offset = offset + issued;
+            ops[n].chain = chain;
+            ops[n].seq = n;
+            issued += chunk;
+        }
+        if (chain) ops[n - 1].flags = YUFS_WRITE_CHAIN_LAST;
+        YUFSCore_submit_batch(token, ops, n);
+        for (int i = 0; i < n; i++) YUFSCore_wait(&ops[i]);
+
+        for (int i = 0; i < n && !stop; i++) {
+            if (ops[i].ret < 0) error = ops[i].ret;
+            else done += ops[i].ret;
+            if (version && ops[i].ret >= 0 && ops[i].stat.version > *version) *version = ops[i].stat.version;
+            stop = ops[i].ret < 0 || ops[i].ret < ops[i].size;
+        }
+    }
+    kfree(ops);
+    return done == 0 && error ? error : (int)done;
+}
 
-    int64_t ret = vtfs_http_call(token, "read", kbuf, size,
-                                 3, "id", id_str, "size", sz_str, "offset", off_str);
-    if (ret > 0) memcpy(buf, kbuf, ret);
-    kfree(kbuf);
-    return (int)ret;
+int YUFSCore_read(const char* token, uint32_t id, char *buf, size_t size, loff_t offset) {
+    return run_bulk(token, YUFS_OP_READ, id, buf, size, offset, NULL);
 }
 
 int YUFSCore_write(const char* token, uint32_t id, const char *buf, size_t size, loff_t offset) {
-    TO_STR(id_str, id, "%u");
-    TO_STR(off_str, offset, "%lld");
+    return run_bulk(token, YUFS_OP_WRITE, id, (char*)buf, size, offset, NULL);
+}
 
-    char *encoded_buf = kmalloc(size * 3 + 1, GFP_KERNEL);
-    if (!encoded_buf) return -ENOMEM;
+int YUFSCore_write_v(const char* token, uint32_t id, const char *buf, size_t size, loff_t offset, uint64_t* version) {
+    return run_bulk(token, YUFS_OP_WRITE, id, (char*)buf, size, offset, version);
+}
 
-    const char *hex = "0123456789ABCDEF";
-    char *dst = encoded_buf;
-    for (size_t i = 0; i < size; i++) {
-        unsigned char c = (unsigned char)buf[i];
-        if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
-            *dst++ = c;
-        } else {
-            *dst++ = '%';
-            *dst++ = hex[c >> 4];
-            *dst++ = hex[c & 0x0F];
+// only the first stripe is conditional, the rest follows it like a plain read
+int YUFSCore_read_if(const char* token, uint32_t id, char *buf, size_t size, loff_t offset, uint64_t version) {
+    size_t first = size < stripe.size ? size : stripe.size;
+    struct YUFS_op op = {.type = YUFS_OP_READ, .id = id, .buf = buf, .size = first, .offset = offset,
+                         .version = version};
+    int ret = run_op(token, &op);
+    if (ret < (int)first || first == size) return ret;
+
+    int rest = run_bulk(token, YUFS_OP_READ, id, buf + first, size - first, offset + first, NULL);
+    return rest < 0 ? ret : ret + rest;
+}
+
+int YUFSCore_fallocate(const char* token, uint32_t id, int mode, loff_t offset, loff_t len) {
+    uint64_t version;
+    return YUFSCore_fallocate_v(token, id, mode, offset, len, &version);
+}
+
+int YUFSCore_fallocate_v(const char* token, uint32_t id, int mode, loff_t offset, loff_t len, uint64_t* version) {
+    struct YUFS_op op = {.type = YUFS_OP_FALLOCATE, .id = id, .flags = mode, .offset = offset, .size = len};
+    *version = 0;
+    if (offset < 0 || len <= 0) return -EINVAL;
+    int ret = run_op(token, &op);
+    if (ret >= 0) *version = op.stat.version;
+    return ret;
+}
+
+int YUFSCore_copy_range(const char* token, uint32_t src_id, loff_t src_offset,
+                        uint32_t dst_id, loff_t dst_offset, size_t len) {
+    uint64_t version;
+    return YUFSCore_copy_range_v(token, src_id, src_offset, dst_id, dst_offset, len, &version);
+}
+
+int YUFSCore_copy_range_v(const char* token, uint32_t src_id, loff_t src_offset,
+                          uint32_t dst_id, loff_t dst_offset, size_t len, uint64_t* version) {
+    struct YUFS_op op = {.type = YUFS_OP_COPY_RANGE, .id = dst_id, .offset = dst_offset,
+                         .src_id = src_id, .src_offset = src_offset, .size = len};
+    *version = 0;
+    if (src_offset < 0 || dst_offset < 0) return -EINVAL;
+    if (len > INT_MAX) op.size = INT_MAX;
+    int ret = run_op(token, &op);
+    if (ret >= 0) *version = op.stat.version;
+    return ret;
+}
+
+int YUFSCore_statfs(const char* token, struct YUFS_statfs* result) {
+    YUFS_MUTEX_LOCK(&meta.lock);
+    struct YUFS_meta_cache* cache = meta_cache(token, false);
+    bool hit = cache && cache->statfs_expires > YUFS_NOW_NS();
+    if (hit) *result = cache->statfs;
+    YUFS_MUTEX_UNLOCK(&meta.lock);
+    if (hit) return 0;
+
+    struct YUFS_statfs fresh;
+    int64_t ret = vtfs_http_call(token, "statfs", 0, (char*)&fresh, sizeof(fresh), 0);
+    if (ret != 0) return ret < 0 ? (int)ret : -1;
+
+    YUFS_MUTEX_LOCK(&meta.lock);
+    cache = meta_cache(token, true);
+    if (cache) {
+        cache->statfs = fresh;
+        cache->statfs_expires = YUFS_NOW_NS() + STATFS_TTL_NS;
+    }
+    YUFS_MUTEX_UNLOCK(&meta.lock);
+    *result = fresh;
+    return 0;
+}
+
+// the directory's version as far as the meta cache knows it, 0 - it doesn't
+static uint64_t listing_version(struct YUFS_meta_cache* cache, uint32_t id) {
+    struct YUFS_meta_entry* e = cache->by_id[meta_id_bucket(id)];
+    for (; e; e = e->id_next) {
+        if (e->stat.id == id) return e->expires < YUFS_NOW_NS() ? 0 : e->stat.version;
+    }
+    return 0;
+}
+
+// takes a reference on the cached listing of id, dropping it if it expired
+// or the directory moved on to another version
+static struct YUFS_dir_listing* listing_get(const char* token, uint32_t id) {
+    struct YUFS_dir_listing* found = NULL;
+    YUFS_MUTEX_LOCK(&meta.lock);
+    struct YUFS_meta_cache* cache = meta_cache(token, false);
+    for (struct YUFS_dir_listing** pp = cache ? &cache->listings : NULL; pp && *pp; pp = &(*pp)->next) {
+        struct YUFS_dir_listing* l = *pp;
+        if (l->dir_id != id) continue;
+        uint64_t version = listing_version(cache, id);
+        bool moved = !l->oversized && version && l->version && version != l->version;
+        if (l->expires < YUFS_NOW_NS() || moved) {
+            listing_unhash(cache, pp);
+            break;
         }
+        l->refs++;
+        found = l;
+        break;
     }
-    *dst = '\0';
+    cache = meta_cache(token, true);
+    if (cache && found) cache->dir_hits++;
+    else if (cache) cache->dir_misses++;
+    YUFS_MUTEX_UNLOCK(&meta.lock);
+    return found;
+}
 
-    char dummy[64];
-    int64_t ret = vtfs_http_call(token, "write", dummy, sizeof(dummy),
-                                 3, "id", id_str, "offset", off_str, "buf", encoded_buf);
+static bool listing_add(struct YUFS_dir_listing* l, const struct YUFS_packed_dirent* dentry, const char* name) {
+    size_t name_len = dentry->name_len;
+    if (l->count == l->capacity) {
+        size_t capacity = l->capacity ? l->capacity * 2 : 64;
+        struct YUFS_listing_entry* entries;
+        if (capacity > DIR_CACHE_ENTRIES) return false;
+        entries = kvmalloc(capacity * sizeof(struct YUFS_listing_entry), GFP_KERNEL);
+        if (!entries) return false;
+        if (l->count) memcpy(entries, l->entries, l->count * sizeof(struct YUFS_listing_entry));
+        kvfree(l->entries);
+        l->entries = entries;
+        l->capacity = capacity;
+    }
+    if (l->names_used + name_len > l->names_size) {
+        size_t names_size = l->names_size * 2 + name_len + 1024;
+        char* names = kvmalloc(names_size, GFP_KERNEL);
+        if (!names) return false;
+        if (l->names_used) memcpy(names, l->names, l->names_used);
+        kvfree(l->names);
+        l->names = names;
+        l->names_size = names_size;
+    }
+    struct YUFS_listing_entry* e = &l->entries[l->count++];
+    e->id = dentry->id;
+    e->type = dentry->type;
+    e->name_off = l->names_used;
+    e->name_len = name_len;
+    memcpy(l->names + l->names_used, name, name_len);
+    l->names_used += name_len;
+    return true;
+}
+
+// Entries of id from offset on, packed records into page of ITERATE_CHUNK
+// bytes. The count of records, 0 past the last entry.
+static int64_t iterate_page(const char* token, uint32_t id, uint64_t offset, char* page) {
+    TO_STR(id_str, id, "%u");
+    TO_STR(off_str, (unsigned long long)offset, "%llu");
+    TO_STR(size_str, ITERATE_CHUNK, "%d");
+    return vtfs_http_call(token, "iterate", id, page, ITERATE_CHUNK,
+                          3, "id", id_str, "offset", off_str, "size", size_str);
+}
+
+// Next record of a page at *pos, NULL when the page ends early.
+static const char* iterate_record(const char* page, size_t* pos, struct YUFS_packed_dirent* dentry) {
+    if (*pos + sizeof(*dentry) > ITERATE_CHUNK) return NULL;
+    memcpy(dentry, page + *pos, sizeof(*dentry));
+    *pos += sizeof(*dentry);
+    if (*pos + dentry->name_len > ITERATE_CHUNK || dentry->name_len >= MAX_NAME_SIZE) return NULL;
+    *pos += dentry->name_len;
+    return page + *pos - dentry->name_len;
+}
+
+// Lists the whole directory and caches it, unless a local change to some
+// directory raced with the listing. Past DIR_CACHE_ENTRIES it stops, the
+// caller gets the entries so far and the cache an oversized marker. NULL
+// when it could not be listed, the caller then lists uncached.
+static struct YUFS_dir_listing* listing_fill(const char* token, uint32_t id) {
+    struct YUFS_packed_dirent dentry;
+    struct YUFS_dir_listing* l;
+    struct YUFS_dir_listing* keep;
+    bool cached = false;
+    bool failed = false;
+    uint64_t gen = 0;
+    char* page;
+
+    YUFS_MUTEX_LOCK(&meta.lock);
+    struct YUFS_meta_cache* cache = meta_cache(token, true);
+    if (cache) gen = cache->listing_gen;
+    YUFS_MUTEX_UNLOCK(&meta.lock);
+    if (!cache) return NULL;
+
+    l = kzalloc(sizeof(struct YUFS_dir_listing), GFP_KERNEL);
+    if (!l) return NULL;
+    l->dir_id = id;
+    l->refs = 1;
+    page = kvmalloc(ITERATE_CHUNK, GFP_KERNEL);
+    failed = !page;
+    while (!failed && !l->oversized) {
+        int64_t count = iterate_page(token, id, l->count, page);
+        size_t pos = 0;
+        if (count == 0) break;
+        failed = count < 0;
+        for (int64_t i = 0; i < count && !failed; i++) {
+            // the rest of the page is left for the caller to fetch
+            l->oversized = l->count == DIR_CACHE_ENTRIES;
+            if (l->oversized) break;
+            const char* name = iterate_record(page, &pos, &dentry);
+            failed = !name || !listing_add(l, &dentry, name);
+        }
+    }
+    kvfree(page);
+    if (failed) {
+        listing_free(l);
+        return NULL;
+    }
+    keep = l;
+    if (l->oversized) {
+        keep = kzalloc(sizeof(struct YUFS_dir_listing), GFP_KERNEL);
+        if (keep) {
+            keep->dir_id = id;
+            keep->oversized = true;
+        }
+    }
 
-    kfree(encoded_buf);
-    return (int)ret;
+    YUFS_MUTEX_LOCK(&meta.lock);
+    cache = meta_cache(token, false);
+    if (keep && cache && cache->listing_gen == gen) {
+        keep->version = listing_version(cache, id);
+        keep->expires = YUFS_NOW_NS() + meta.dir_ttl_ns;
+        listing_drop(cache, id);
+        if (cache->listing_count == DIR_CACHE_LISTINGS) {
+            struct YUFS_dir_listing** oldest = &cache->listings;
+            while ((*oldest)->next) oldest = &(*oldest)->next;
+            listing_unhash(cache, oldest);
+        }
+        keep->next = cache->listings;
+        cache->listings = keep;
+        cache->listing_count++;
+        keep->refs++;
+        cached = true;
+    }
+    YUFS_MUTEX_UNLOCK(&meta.lock);
+    if (keep != l && !cached) kfree(keep);
+    return l;
 }
 
 int YUFSCore_iterate(const char* token, uint32_t id, yufs_filldir_y callback, void* ctx, loff_t offset) {
-    TO_STR(id_str, id, "%u");
     struct YUFS_packed_dirent dentry;
     int current_offset = offset;
+    char* page;
+
+    // a listing shows the creates made with leased ids so far
+    if (creates.pending) YUFS_WAIT_EVENT(&creates.wait, dir_settled(token, id));
+
+    // getdents comes back for every buffer full, and shells list the same
+    // directories over and over: serve them from one listing. What an
+    // oversized one lacks comes from the backend below.
+    if (meta.dir_ttl_ns) {
+        struct YUFS_dir_listing* l = listing_get(token, id);
+        if (!l) l = listing_fill(token, id);
+        if (l) {
+            bool more = l->oversized;
+            for (size_t i = offset; i < l->count; i++) {
+                struct YUFS_listing_entry* e = &l->entries[i];
+                if (!callback(ctx, l->names + e->name_off, e->name_len, e->id, e->type)) {
+                    more = false;
+                    break;
+                }
+            }
+            if (current_offset < (int)l->count) current_offset = l->count;
+            YUFS_MUTEX_LOCK(&meta.lock);
+            listing_put(l);
+            YUFS_MUTEX_UNLOCK(&meta.lock);
+            if (!more) return 0;
+        }
+    }
 
-    while (1) {
-        TO_STR(off_str, current_offset, "%d");
-        int64_t ret = vtfs_http_call(token, "iterate", (char*)&dentry, sizeof(dentry),
-                                     2, "id", id_str, "offset", off_str);
-        if (ret != 0) break;
-        size_t name_len = strnlen(dentry.name, sizeof(dentry.name));
-        if (!callback(ctx, dentry.name, name_len, dentry.id, dentry.type)) return 0;
-        current_offset++;
+    page = kvmalloc(ITERATE_CHUNK, GFP_KERNEL);
+    if (!page) return -ENOMEM;
+    bool more = true;
+    while (more) {
+        int64_t count = iterate_page(token, id, current_offset, page);
+        size_t pos = 0;
+        more = count > 0;
+        for (int64_t i = 0; more && i < count; i++) {
+            const char* name = iterate_record(page, &pos, &dentry);
+            more = name && callback(ctx, name, dentry.name_len, dentry.id, dentry.type);
+            if (more) current_offset++;
+        }
     }
+    kvfree(page);
     return 0;
 }
 
-#endif
\ No newline at end of file
+#endif
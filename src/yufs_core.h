@@ -4,12 +4,24 @@
 #include "yufs_platform.h"
 
 #define MAX_NAME_SIZE 256
+// YUFSCore_read_if: the inode still has the version the caller knows
+#define YUFS_NOT_MODIFIED (-304)
+// YUFSCore_rename flags, the values of the kernel's RENAME_*
+#define YUFS_RENAME_NOREPLACE (1 << 0)
+#define YUFS_RENAME_EXCHANGE (1 << 1)
+// YUFSCore_fallocate modes, the values of the kernel's FALLOC_FL_*
+#define YUFS_FALLOC_KEEP_SIZE 0x01
+#define YUFS_FALLOC_PUNCH_HOLE 0x02
+// flags of a chained write stripe, the last one of its chain
+#define YUFS_WRITE_CHAIN_LAST (1 << 0)
 
 struct YUFS_stat
 {
     uint32_t id;
     umode_t mode;
     uint64_t size;
+    uint64_t version;   // bumped on every write and, for a directory, on every change of its entries; never 0
+    uint32_t nlink;     // names of a file, the backend does not count them for a directory
 };
 
 struct YUFS_dirent
@@ -18,19 +30,135 @@ struct YUFS_dirent
     char name[MAX_NAME_SIZE];
     umode_t type;
 };
+
+struct YUFS_statfs
+{
+    uint64_t total_bytes;
+    uint64_t used_bytes;
+    uint64_t total_inodes;
+    uint64_t used_inodes;
+};
+
 typedef bool (*yufs_filldir_y)(void* ctx, const char* name, int name_len, uint32_t id, umode_t type);
 
+enum YUFS_op_type
+{
+    YUFS_OP_LOOKUP,
+    YUFS_OP_CREATE,
+    YUFS_OP_LINK,
+    YUFS_OP_UNLINK,
+    YUFS_OP_RMDIR,
+    YUFS_OP_GETATTR,
+    YUFS_OP_READ,
+    YUFS_OP_WRITE,
+    YUFS_OP_RENAME,
+    YUFS_OP_FALLOCATE,
+    YUFS_OP_COPY_RANGE,
+};
+
+struct YUFS_op;
+typedef void (*yufs_op_done_y)(struct YUFS_op* op);
+
+// One submitted operation. Arguments follow the matching YUFSCore_* call:
+// id is the inode (or link target), parent_id/name the dirent, and for a
+// rename new_parent_id/new_name/flags where it goes. A fallocate passes its
+// mode in flags and the range as offset/size, a copy_range writes id at offset
+// with size bytes read from src_id at src_offset. Writes sharing a chain are
+// applied in seq order and none after one that failed.
+// Completion is either done(op) when set, or YUFSCore_wait(op) otherwise;
+// the op must stay alive until then.
+struct YUFS_op
+{
+    enum YUFS_op_type type;
+    uint32_t id;
+    uint32_t parent_id;
+    const char* name;
+    uint32_t new_parent_id;
+    const char* new_name;
+    unsigned int flags;
+    uint32_t src_id;
+    loff_t src_offset;
+    umode_t mode;
+    char* buf;
+    size_t size;
+    loff_t offset;
+    uint64_t version;       // read: only if the inode's version differs, 0 - always
+    uint64_t chain;         // write: 0 - applied on its own
+    uint32_t seq;
+
+    struct YUFS_stat stat;  // lookup/create/getattr result, the version after a write, fallocate or copy
+    int ret;                // what the sync call would have returned
+
+    yufs_op_done_y done;
+    void* priv;
+
+    // engine private
+    yufs_completion_t completion;
+    struct YUFS_op* next;
+    void* engine_data;
+};
+
 
 int     YUFSCore_init(void);
 void    YUFSCore_destroy(void);
+// engine specific mount option, e.g. "backends" for the web engine
+int     YUFSCore_configure(const char* key, const char* value);
+// per mount session with the engine, token is resolved once here
+int     YUFSCore_open_session(const char* token);
+void    YUFSCore_close_session(const char* token);
+// warms the engine's lookup/attribute caches with the subtree under root_id,
+// returns the number of entries cached
+int     YUFSCore_prefetch(const char* token, uint32_t root_id);
+// waits for creates still on their way to the engine, id 0 means all of the
+// token's, and returns (once) the error of one that failed
+int     YUFSCore_sync(const char* token, uint32_t id);
+// engine counters of the token as text, returns the length written
+int     YUFSCore_stats(const char* token, char* buf, size_t size);
+void    YUFSCore_reset_stats(const char* token);
 int     YUFSCore_lookup(const char* token, uint32_t parent_id, const char* name, struct YUFS_stat* result);
 int     YUFSCore_create(const char* token, uint32_t parent_id, const char* name, umode_t mode, struct YUFS_stat* result);
 int     YUFSCore_link(const char* token, uint32_t target_id, uint32_t parent_id, const char* name);
 int     YUFSCore_unlink(const char* token, uint32_t parent_id, const char* name);
 int     YUFSCore_rmdir(const char* token, uint32_t parent_id, const char* name);
+// moves the dirent, replacing an existing new_name (an empty directory in place
+// of a directory) unless YUFS_RENAME_NOREPLACE, or swapping the two with
+// YUFS_RENAME_EXCHANGE; no data is copied. 0 or a negative errno: why the
+// engine refused, -EIO when it could not be asked
+int     YUFSCore_rename(const char* token, uint32_t parent_id, const char* name,
+                        uint32_t new_parent_id, const char* new_name, unsigned int flags);
 int     YUFSCore_getattr(const char* token, uint32_t id, struct YUFS_stat* result);
+// YUFSCore_getattr from the engine itself, never from the prefetch cache,
+// which it then brings up to date
+int     YUFSCore_getattr_fresh(const char* token, uint32_t id, struct YUFS_stat* result);
 int     YUFSCore_read(const char* token, uint32_t id, char *buf, size_t size, loff_t offset);
 int     YUFSCore_write(const char* token, uint32_t id, const char *buf, size_t size, loff_t offset);
+// YUFSCore_write, *version is where the write left the inode, 0 if the engine doesn't tell
+int     YUFSCore_write_v(const char* token, uint32_t id, const char *buf, size_t size, loff_t offset,
+                         uint64_t* version);
+// YUFSCore_read, or YUFS_NOT_MODIFIED without data when the inode is still at version
+int     YUFSCore_read_if(const char* token, uint32_t id, char *buf, size_t size, loff_t offset, uint64_t version);
+// reserves [offset, offset + len) so writes into it don't allocate, extending
+// the size unless YUFS_FALLOC_KEEP_SIZE; with YUFS_FALLOC_PUNCH_HOLE (and
+// KEEP_SIZE) the range reads back as zeroes instead
+int     YUFSCore_fallocate(const char* token, uint32_t id, int mode, loff_t offset, loff_t len);
+// YUFSCore_fallocate, *version as for YUFSCore_write_v
+int     YUFSCore_fallocate_v(const char* token, uint32_t id, int mode, loff_t offset, loff_t len,
+                             uint64_t* version);
+// copies up to len bytes from src_id at src_offset into dst_id at dst_offset
+// inside the engine, the data never passes the caller; returns the number of
+// bytes copied, short at the end of src
+int     YUFSCore_copy_range(const char* token, uint32_t src_id, loff_t src_offset,
+                            uint32_t dst_id, loff_t dst_offset, size_t len);
+// YUFSCore_copy_range, *version is where the copy left dst_id
+int     YUFSCore_copy_range_v(const char* token, uint32_t src_id, loff_t src_offset,
+                              uint32_t dst_id, loff_t dst_offset, size_t len, uint64_t* version);
 int     YUFSCore_iterate(const char* token, uint32_t id, yufs_filldir_y callback, void* ctx, loff_t offset);
+// space and inodes of the token's tree, cheap enough to poll
+int     YUFSCore_statfs(const char* token, struct YUFS_statfs* result);
+
+// async api: web engine completes ops from its workers, ram engine inline
+int     YUFSCore_submit(const char* token, struct YUFS_op* op);
+int     YUFSCore_submit_batch(const char* token, struct YUFS_op* ops, size_t count);
+int     YUFSCore_wait(struct YUFS_op* op);
 
 #endif //YUFS_YUFSCore_H
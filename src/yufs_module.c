@@ -4,35 +4,153 @@
 #include <linux/fs.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/writeback.h>
+#include <linux/backing-dev.h>
+#include <linux/sched/mm.h>
+#include <linux/workqueue.h>
+#include <linux/falloc.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include "yufs_core.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Yura");
 
 #define YUFS_MAGIC 0x13131313
+// per method histograms don't fit a page
+#define YUFS_STATS_SIZE (64 * 1024)
+// readahead window, large enough for the core to stripe it
+#define YUFS_READAHEAD_BYTES (1024 * 1024)
+// contiguous dirty pages written back with one core call
+#define YUFS_WB_PAGES 256
+// percent of the system's dirty page limit one mount may hold, writers past
+// it are throttled until writeback catches up
+#define YUFS_MAX_DIRTY_RATIO 20
+// O_DIRECT bounce buffer, one round of the default stripe_size * stripe_fanout
+#define YUFS_DIO_CHUNK (256 * 1024)
+// bytes one copy_range call asks the core for, the backend holds the range in
+// memory while it copies; the largest stripe_size
+#define YUFS_COPY_CHUNK (1024 * 1024)
+// seconds a dentry is trusted before its directory's version is checked
+#define YUFS_ENTRY_TTL_DEFAULT 1
+#define YUFS_NEGATIVE_TTL_DEFAULT 1
+// seconds stat() answers from the inode before asking the backend
+#define YUFS_ATTR_TTL_DEFAULT 1
 
 
 struct yufs_sb_info {
     char token[64]; 
+    bool prefetch;
+    // in jiffies, for positive and negative dentries
+    unsigned long entry_ttl;
+    unsigned long negative_ttl;
+    unsigned long attr_ttl;
+    // background writeback, started once a file has a full run dirty
+    struct workqueue_struct *wb_wq;
+    struct dentry *debug_dir;
+    // the core session is open, it pins the backends until put_super
+    bool session;
 };
 
+static struct dentry *yufs_debug_root;
+static struct kmem_cache *yufs_inode_cachep;
+
+struct yufs_inode_info {
+    struct inode vfs_inode;
+    // backend content version the cached pages belong to
+    uint64_t version;
+    // jiffies when the attributes last came from the backend
+    unsigned long attr_time;
+    // pages dirtied by write() since the worker was last kicked
+    unsigned int dirtied;
+    struct work_struct wb_work;
+};
+
+static inline struct yufs_inode_info *YUFS_I(struct inode *inode) {
+    return container_of(inode, struct yufs_inode_info, vfs_inode);
+}
+
 static const char* yufs_token(struct super_block *sb) {
     struct yufs_sb_info *sbi = sb->s_fs_info;
     return sbi ? sbi->token : "";
 }
 
 static const struct inode_operations yufs_dir_inode_ops;
+static const struct inode_operations yufs_file_inode_ops;
 static const struct file_operations yufs_dir_operations;
 static const struct file_operations yufs_file_operations;
+static const struct address_space_operations yufs_aops;
+
+// Dirty pages go out first, including those the writeback worker is sending
+// right now, then a create made with a leased id reports here whether the
+// backend took it. Background writeback errors are reported here too.
+static int yufs_fsync(struct file *file, loff_t start, loff_t end, int datasync) {
+    struct inode *inode = file_inode(file);
+    int err = file_write_and_wait_range(file, start, end);
+    if (err) return err;
+    return YUFSCore_sync(yufs_token(inode->i_sb), inode->i_ino) ? -EIO : 0;
+}
+
+// close-to-open: what was written is on the backend once close returns.
+// Writeback already recorded the versions of our own writes, so the next
+// open keeps the pages.
+static int yufs_flush(struct file *file, fl_owner_t id) {
+    struct inode *inode = file_inode(file);
+    int err;
 
-static int yufs_fsync(struct file *file, loff_t start, loff_t end, int datasync) { return 0; }
+    if (!(file->f_mode & FMODE_WRITE)) return 0;
+    err = filemap_write_and_wait(file->f_mapping);
+    if (err) return err;
+    return YUFSCore_sync(yufs_token(inode->i_sb), inode->i_ino) ? -EIO : 0;
+}
 
+// Backend attributes of a cached inode. Pages cached under an older
+// version are dropped, unless our own pages are the newer state: dirty,
+// under writeback, or being written by someone holding the inode lock.
+// Versions only grow, an older one was read before our own write landed.
+static void yufs_refresh_inode(struct inode *inode, const struct YUFS_stat *stat) {
+    YUFS_I(inode)->attr_time = jiffies;
+    // the type of an id never changes, its permissions may
+    inode->i_mode = (inode->i_mode & S_IFMT) | (stat->mode & ~S_IFMT);
+    // links don't bump the version, other mounts may have added or removed one
+    if (S_ISREG(inode->i_mode)) set_nlink(inode, stat->nlink);
+    if (stat->version <= YUFS_I(inode)->version) return;
+    if (!S_ISREG(inode->i_mode)) {
+        YUFS_I(inode)->version = stat->version;
+        return;
+    }
+    // the next stat or open tries again
+    if (!inode_trylock(inode)) return;
+    if (!mapping_tagged(inode->i_mapping, PAGECACHE_TAG_DIRTY) &&
+        !mapping_tagged(inode->i_mapping, PAGECACHE_TAG_WRITEBACK)) {
+        invalidate_mapping_pages(inode->i_mapping, 0, -1);
+        truncate_setsize(inode, stat->size);
+        YUFS_I(inode)->version = stat->version;
+    }
+    inode_unlock(inode);
+}
+
+// version is what our own write left the backend at, the cached pages are
+// that state and must survive the next refresh
+static void yufs_wrote(struct inode *inode, uint64_t version) {
+    if (version > YUFS_I(inode)->version) YUFS_I(inode)->version = version;
+}
+
+// One VFS inode per YUFS id: every path and hard link to a file shares its
+// page cache and size, and the inode outlives its dentries.
 static struct inode *yufs_get_inode(struct super_block *sb, const struct YUFS_stat *stat, struct inode *dir) {
-    struct inode *inode = new_inode(sb);
+    struct inode *inode = iget_locked(sb, stat->id);
     if (!inode) return NULL;
-    inode->i_ino = stat->id;
-    inode->i_sb = sb;
+    if (!(inode->i_state & I_NEW)) {
+        yufs_refresh_inode(inode, stat);
+        return inode;
+    }
     inode->i_mode = stat->mode;
+    YUFS_I(inode)->version = stat->version;
+    YUFS_I(inode)->attr_time = jiffies;
     inode_init_owner(sb->s_user_ns, inode, dir, stat->mode);
     inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
 
@@ -41,48 +159,517 @@ static struct inode *yufs_get_inode(struct super_block *sb, const struct YUFS_st
         inode->i_fop = &yufs_dir_operations;
         set_nlink(inode, 2);
     } else if (S_ISREG(inode->i_mode)) {
+        inode->i_op = &yufs_file_inode_ops;
         inode->i_fop = &yufs_file_operations;
-        set_nlink(inode, 1);
+        inode->i_mapping->a_ops = &yufs_aops;
+        set_nlink(inode, stat->nlink);
         inode->i_size = stat->size;
     }
+    unlock_new_inode(inode);
     return inode;
 }
 
-static ssize_t yufs_read(struct file *filp, char __user *buf, size_t len, loff_t *ppos) {
-    struct inode *inode = file_inode(filp);
-    
-    const char* token = yufs_token(inode->i_sb);
-    
-    if (len == 0) return 0;
-    void *kbuf = kzalloc(len, GFP_KERNEL);
-    if (!kbuf) return -ENOMEM;
+// A getattr of -1 is the backend saying the inode is gone, anything else is
+// a failed request that tells nothing about it.
+static int yufs_getattr_error(int ret) {
+    return ret == -1 ? -ESTALE : -EIO;
+}
 
-    
-    int bytes_read = YUFSCore_read(token, inode->i_ino, kbuf, len, *ppos);
+// stat() is served from the inode while the attributes are younger than
+// attr_ttl, so listing a hot directory stays local
+static int yufs_getattr(struct user_namespace *mnt_userns, const struct path *path, struct kstat *kstat,
+                        u32 request_mask, unsigned int query_flags) {
+    struct inode *inode = d_inode(path->dentry);
+    struct yufs_sb_info *sbi = inode->i_sb->s_fs_info;
+    bool stale = time_after_eq(jiffies, YUFS_I(inode)->attr_time + sbi->attr_ttl);
+    struct YUFS_stat stat;
+    int ret;
 
-    if (bytes_read < 0) { kfree(kbuf); return -EIO; }
-    if (copy_to_user(buf, kbuf, bytes_read)) { kfree(kbuf); return -EFAULT; }
-    kfree(kbuf);
-    *ppos += bytes_read;
-    return bytes_read;
+    if ((query_flags & AT_STATX_FORCE_SYNC) || (stale && !(query_flags & AT_STATX_DONT_SYNC))) {
+        ret = YUFSCore_getattr_fresh(yufs_token(inode->i_sb), inode->i_ino, &stat);
+        if (ret != 0) return yufs_getattr_error(ret);
+        yufs_refresh_inode(inode, &stat);
+    }
+    generic_fillattr(mnt_userns, inode, kstat);
+    return 0;
 }
 
-static ssize_t yufs_write(struct file *filp, const char __user *buf, size_t len, loff_t *ppos) {
-    struct inode *inode = file_inode(filp);
-    const char* token = yufs_token(inode->i_sb);
+// Data cached under an older version is dropped, an unchanged file keeps
+// its pages across opens.
+static int yufs_open(struct inode *inode, struct file *filp) {
+    struct YUFS_stat stat;
+    int ret = YUFSCore_getattr_fresh(yufs_token(inode->i_sb), inode->i_ino, &stat);
+
+    if (ret != 0) return yufs_getattr_error(ret);
+    yufs_refresh_inode(inode, &stat);
+    return generic_file_open(inode, filp);
+}
+
+static int yufs_fill_folio(struct inode *inode, struct folio *folio) {
+    size_t len = folio_size(folio);
+    char *kaddr = kmap_local_folio(folio, 0);
+    int ret = YUFSCore_read(yufs_token(inode->i_sb), inode->i_ino, kaddr, len, folio_pos(folio));
+
+    if (ret >= 0) memset(kaddr + ret, 0, len - ret);
+    kunmap_local(kaddr);
+    if (ret < 0) return -EIO;
+    flush_dcache_folio(folio);
+    folio_mark_uptodate(folio);
+    return 0;
+}
+
+static int yufs_read_folio(struct file *file, struct folio *folio) {
+    int err = yufs_fill_folio(folio->mapping->host, folio);
+    folio_unlock(folio);
+    return err;
+}
+
+// The whole window is one core read, so it is striped like any large read.
+// Folios left without data stay !uptodate and go through read_folio later.
+static void yufs_readahead(struct readahead_control *rac) {
+    struct inode *inode = rac->mapping->host;
+    loff_t pos = readahead_pos(rac);
+    size_t len = readahead_length(rac);
+    char *buf = kvmalloc(len, GFP_KERNEL);
+    int ret = buf ? YUFSCore_read(yufs_token(inode->i_sb), inode->i_ino, buf, len, pos) : -ENOMEM;
+    struct folio *folio;
+
+    while ((folio = readahead_folio(rac)) != NULL) {
+        size_t off = folio_pos(folio) - pos;
+        size_t size = folio_size(folio);
+
+        if (ret >= 0) {
+            size_t have = (size_t)ret > off ? min_t(size_t, ret - off, size) : 0;
+            char *kaddr = kmap_local_folio(folio, 0);
+            memcpy(kaddr, buf + off, have);
+            memset(kaddr + have, 0, size - have);
+            kunmap_local(kaddr);
+            flush_dcache_folio(folio);
+            folio_mark_uptodate(folio);
+        }
+        folio_unlock(folio);
+    }
+    kvfree(buf);
+}
+
+static int yufs_write_begin(struct file *file, struct address_space *mapping, loff_t pos, unsigned len,
+                            struct page **pagep, void **fsdata) {
+    struct inode *inode = mapping->host;
+    unsigned from = pos & (PAGE_SIZE - 1);
+    struct page *page = grab_cache_page_write_begin(mapping, pos >> PAGE_SHIFT);
+    int err;
+
+    if (!page) return -ENOMEM;
+    *pagep = page;
+    if (PageUptodate(page) || len == PAGE_SIZE) return 0;
+    // nothing to read past the end of the file, write_end marks it uptodate
+    if (page_offset(page) >= i_size_read(inode)) {
+        zero_user_segments(page, 0, from, from + len, PAGE_SIZE);
+        return 0;
+    }
+    err = yufs_fill_folio(inode, page_folio(page));
+    if (err) {
+        unlock_page(page);
+        put_page(page);
+    }
+    return err;
+}
+
+// A writer that dirtied a full run hands it to the worker and goes on at
+// memory speed, instead of the run waiting for the flusher's next pass.
+static void yufs_wb_work(struct work_struct *work) {
+    struct inode *inode = &container_of(work, struct yufs_inode_info, wb_work)->vfs_inode;
+    filemap_flush(inode->i_mapping);
+    iput(inode);
+}
+
+// inode locked
+static void yufs_wb_kick(struct inode *inode) {
+    struct yufs_sb_info *sbi = inode->i_sb->s_fs_info;
+    YUFS_I(inode)->dirtied = 0;
+    // the queued work holds the inode until it ran
+    ihold(inode);
+    if (!queue_work(sbi->wb_wq, &YUFS_I(inode)->wb_work)) iput(inode);
+}
+
+static int yufs_write_end(struct file *file, struct address_space *mapping, loff_t pos, unsigned len,
+                          unsigned copied, struct page *page, void *fsdata) {
+    struct inode *inode = mapping->host;
+
+    // a short copy into a page that wasn't read: the caller retries, the
+    // rest of the page holds nothing valid
+    if (!PageUptodate(page)) {
+        if (copied < len) {
+            copied = 0;
+            goto out;
+        }
+        SetPageUptodate(page);
+    }
+    if (pos + copied > inode->i_size) i_size_write(inode, pos + copied);
+    if (set_page_dirty(page) && ++YUFS_I(inode)->dirtied >= YUFS_WB_PAGES) yufs_wb_kick(inode);
+out:
+    unlock_page(page);
+    put_page(page);
+    return copied;
+}
+
+// dirty pages of one contiguous range, sent with a single core write
+struct yufs_wb_run {
+    struct inode *inode;
+    char *buf;
+    loff_t pos;
+    size_t len;
+    int nr;
+    struct page *pages[YUFS_WB_PAGES];
+};
+
+static int yufs_wb_flush(struct yufs_wb_run *run) {
+    struct inode *inode = run->inode;
+    uint64_t version;
+    int ret, err = 0;
+
+    if (run->nr == 0) return 0;
+    ret = YUFSCore_write_v(yufs_token(inode->i_sb), inode->i_ino, run->buf, run->len, run->pos, &version);
+    if (ret < 0 || (size_t)ret != run->len) {
+        err = -EIO;
+        mapping_set_error(inode->i_mapping, err);
+    } else {
+        yufs_wrote(inode, version);
+    }
+    for (int i = 0; i < run->nr; i++) end_page_writeback(run->pages[i]);
+    run->nr = 0;
+    run->len = 0;
+    return err;
+}
+
+static int yufs_wb_page(struct page *page, struct writeback_control *wbc, void *data) {
+    struct yufs_wb_run *run = data;
+    loff_t size = i_size_read(run->inode);
+    loff_t pos = page_offset(page);
+    size_t len;
+    int err = 0;
+
+    // truncated while it waited for writeback
+    if (pos >= size) {
+        unlock_page(page);
+        return 0;
+    }
+    len = min_t(loff_t, PAGE_SIZE, size - pos);
+    if (run->nr > 0 && (run->pos + run->len != pos || run->nr == YUFS_WB_PAGES)) err = yufs_wb_flush(run);
+    if (run->nr == 0) run->pos = pos;
+
+    set_page_writeback(page);
+    memcpy_from_page(run->buf + run->len, page, 0, len);
+    run->pages[run->nr++] = page;
+    run->len += len;
+    unlock_page(page);
+    return err;
+}
+
+static int yufs_writepages(struct address_space *mapping, struct writeback_control *wbc) {
+    struct yufs_wb_run *run = kmalloc(sizeof(*run), GFP_NOFS);
+    int err, flush_err;
+
+    if (!run) return -ENOMEM;
+    run->buf = kvmalloc(YUFS_WB_PAGES * PAGE_SIZE, GFP_NOFS);
+    if (!run->buf) {
+        kfree(run);
+        return -ENOMEM;
+    }
+    run->inode = mapping->host;
+    run->nr = 0;
+    run->len = 0;
+
+    err = write_cache_pages(mapping, wbc, yufs_wb_page, run);
+    flush_err = yufs_wb_flush(run);
+    kvfree(run->buf);
+    kfree(run);
+    return err ? err : flush_err;
+}
+
+// Reclaim hands over single dirty pages, mostly of shared mappings. The core
+// allocates while sending, so it must not recurse into fs reclaim.
+static int yufs_writepage(struct page *page, struct writeback_control *wbc) {
+    struct inode *inode = page->mapping->host;
+    loff_t size = i_size_read(inode);
+    loff_t pos = page_offset(page);
+    uint64_t version;
+    unsigned int nofs;
+    size_t len;
+    char *kaddr;
+    int ret;
+
+    if (pos >= size) {
+        unlock_page(page);
+        return 0;
+    }
+    len = min_t(loff_t, PAGE_SIZE, size - pos);
+    set_page_writeback(page);
+    unlock_page(page);
+
+    nofs = memalloc_nofs_save();
+    kaddr = kmap_local_page(page);
+    ret = YUFSCore_write_v(yufs_token(inode->i_sb), inode->i_ino, kaddr, len, pos, &version);
+    kunmap_local(kaddr);
+    memalloc_nofs_restore(nofs);
+
+    if (ret < 0 || (size_t)ret != len) mapping_set_error(page->mapping, -EIO);
+    else yufs_wrote(inode, version);
+    end_page_writeback(page);
+    return 0;
+}
+
+// O_DIRECT is done by read_iter/write_iter below, direct_IO only lets open
+// accept the flag
+static const struct address_space_operations yufs_aops = {
+    .read_folio = yufs_read_folio,
+    .readahead = yufs_readahead,
+    .write_begin = yufs_write_begin,
+    .write_end = yufs_write_end,
+    .writepage = yufs_writepage,
+    .writepages = yufs_writepages,
+    .dirty_folio = filemap_dirty_folio,
+    .direct_IO = noop_direct_IO,
+};
+
+// Direct I/O goes through one bounded bounce buffer chunk by chunk, however
+// large the request is. Dirty pages of the range are written back first so
+// the backend has them.
+static ssize_t yufs_direct_read(struct kiocb *iocb, struct iov_iter *to) {
+    struct inode *inode = file_inode(iocb->ki_filp);
+    size_t count = iov_iter_count(to);
+    loff_t pos = iocb->ki_pos;
+    ssize_t done = 0;
+    char *buf;
+    int err;
+
+    if (count == 0) return 0;
+    err = filemap_write_and_wait_range(inode->i_mapping, pos, pos + count - 1);
+    if (err) return err;
+    buf = kvmalloc(min_t(size_t, count, YUFS_DIO_CHUNK), GFP_KERNEL);
+    if (!buf) return -ENOMEM;
+
+    while (iov_iter_count(to) > 0) {
+        size_t chunk = min_t(size_t, iov_iter_count(to), YUFS_DIO_CHUNK);
+        int ret = YUFSCore_read(yufs_token(inode->i_sb), inode->i_ino, buf, chunk, pos);
+        size_t copied;
+
+        if (ret < 0) {
+            err = -EIO;
+            break;
+        }
+        copied = copy_to_iter(buf, ret, to);
+        pos += copied;
+        done += copied;
+        if (copied < (size_t)ret) {
+            err = -EFAULT;
+            break;
+        }
+        // end of file
+        if ((size_t)ret < chunk) break;
+    }
+    kvfree(buf);
+    iocb->ki_pos = pos;
+    return done ? done : err;
+}
+
+static ssize_t yufs_direct_write(struct kiocb *iocb, struct iov_iter *from) {
+    struct file *file = iocb->ki_filp;
+    struct inode *inode = file_inode(file);
+    loff_t start = iocb->ki_pos;
+    ssize_t done = 0;
+    char *buf = NULL;
+    ssize_t err;
 
+    inode_lock(inode);
+    err = generic_write_checks(iocb, from);
+    if (err <= 0) goto out;
+    err = file_modified(file);
+    if (err) goto out;
+    err = filemap_write_and_wait_range(inode->i_mapping, start, start + iov_iter_count(from) - 1);
+    if (err) goto out;
+    buf = kvmalloc(min_t(size_t, iov_iter_count(from), YUFS_DIO_CHUNK), GFP_KERNEL);
+    err = -ENOMEM;
+    if (!buf) goto out;
+
+    err = 0;
+    while (iov_iter_count(from) > 0) {
+        size_t chunk = min_t(size_t, iov_iter_count(from), YUFS_DIO_CHUNK);
+        uint64_t version;
+        int ret;
+
+        if (copy_from_iter(buf, chunk, from) != chunk) {
+            err = -EFAULT;
+            break;
+        }
+        ret = YUFSCore_write_v(yufs_token(inode->i_sb), inode->i_ino, buf, chunk, iocb->ki_pos, &version);
+        if (ret < 0) {
+            err = -EIO;
+            break;
+        }
+        yufs_wrote(inode, version);
+        iocb->ki_pos += ret;
+        done += ret;
+        if ((size_t)ret < chunk) break;
+    }
+    // cached pages of the range are older than what was just written
+    if (done > 0) {
+        invalidate_inode_pages2_range(inode->i_mapping, start >> PAGE_SHIFT, (iocb->ki_pos - 1) >> PAGE_SHIFT);
+        if (iocb->ki_pos > i_size_read(inode)) i_size_write(inode, iocb->ki_pos);
+    }
+out:
+    inode_unlock(inode);
+    kvfree(buf);
+    if (done > 0) return generic_write_sync(iocb, done);
+    return err;
+}
+
+// The core reserves or zeroes the range on its side. Dirty pages of a punched
+// range are written back first so they can't land on the hole afterwards,
+// then the cached ones are dropped.
+static long yufs_fallocate(struct file *file, int mode, loff_t offset, loff_t len) {
+    struct inode *inode = file_inode(file);
+    loff_t end = offset + len;
+    uint64_t version;
+    int err = 0;
+
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) return -EOPNOTSUPP;
+    inode_lock(inode);
+    err = file_modified(file);
+    if (err) goto out;
+    if (mode & FALLOC_FL_PUNCH_HOLE) {
+        err = filemap_write_and_wait_range(inode->i_mapping, offset, end - 1);
+        if (err) goto out;
+        truncate_pagecache_range(inode, offset, end - 1);
+    }
+    if (YUFSCore_fallocate_v(yufs_token(inode->i_sb), inode->i_ino, mode, offset, len, &version) != 0) {
+        err = (mode & FALLOC_FL_PUNCH_HOLE) ? -EIO : -ENOSPC;
+        goto out;
+    }
+    yufs_wrote(inode, version);
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode)) i_size_write(inode, end);
+out:
+    inode_unlock(inode);
+    return err;
+}
+
+// Both inodes locked, the ranges written back and dst's times updated. The
+// engine copies, the pages cached for the destination range are stale
+// afterwards, the rest of them stays current.
+static loff_t yufs_copy_locked(struct inode *src, loff_t pos_in, struct inode *dst, loff_t pos_out, loff_t len) {
+    loff_t done = 0;
+
+    while (done < len) {
+        size_t chunk = min_t(loff_t, len - done, YUFS_COPY_CHUNK);
+        uint64_t version;
+        int ret = YUFSCore_copy_range_v(yufs_token(src->i_sb), src->i_ino, pos_in + done, dst->i_ino,
+                                        pos_out + done, chunk, &version);
+        if (ret < 0) {
+            if (done == 0) return -EIO;
+            break;
+        }
+        yufs_wrote(dst, version);
+        done += ret;
+        if ((size_t)ret < chunk) break;
+    }
+    if (done > 0) {
+        truncate_pagecache_range(dst, pos_out, pos_out + done - 1);
+        if (pos_out + done > i_size_read(dst)) i_size_write(dst, pos_out + done);
+    }
+    return done;
+}
+
+// copy_file_range(2) within a mount, the data never comes to the client. Other
+// mounts get -EXDEV and the VFS falls back to splicing through the page cache.
+static ssize_t yufs_copy_file_range(struct file *file_in, loff_t pos_in, struct file *file_out, loff_t pos_out,
+                                    size_t len, unsigned int flags) {
+    struct inode *src = file_inode(file_in);
+    struct inode *dst = file_inode(file_out);
+    ssize_t ret;
+
+    if (src->i_sb != dst->i_sb) return -EXDEV;
     if (len == 0) return 0;
-    void *kbuf = kzalloc(len, GFP_KERNEL);
-    if (!kbuf) return -ENOMEM;
-    if (copy_from_user(kbuf, buf, len)) { kfree(kbuf); return -EFAULT; }
+    lock_two_nondirectories(src, dst);
+    ret = file_modified(file_out);
+    if (!ret) ret = filemap_write_and_wait_range(src->i_mapping, pos_in, pos_in + len - 1);
+    if (!ret) ret = filemap_write_and_wait_range(dst->i_mapping, pos_out, pos_out + len - 1);
+    if (!ret) ret = yufs_copy_locked(src, pos_in, dst, pos_out, len);
+    unlock_two_nondirectories(src, dst);
+    return ret;
+}
+
+// FICLONE/FICLONERANGE and cp --reflink: the same engine copy, the prep checks
+// the ranges, writes both back and updates dst's times. Dedup would have to
+// compare the contents and is not offered.
+static loff_t yufs_remap_file_range(struct file *file_in, loff_t pos_in, struct file *file_out, loff_t pos_out,
+                                    loff_t len, unsigned int remap_flags) {
+    struct inode *src = file_inode(file_in);
+    struct inode *dst = file_inode(file_out);
+    loff_t ret;
+
+    if (remap_flags & ~(REMAP_FILE_CAN_SHORTEN | REMAP_FILE_ADVISORY)) return -EOPNOTSUPP;
+    lock_two_nondirectories(src, dst);
+    ret = generic_remap_file_range_prep(file_in, pos_in, file_out, pos_out, &len, remap_flags);
+    if (ret == 0 && len > 0) ret = yufs_copy_locked(src, pos_in, dst, pos_out, len);
+    unlock_two_nondirectories(src, dst);
+    return ret;
+}
+
+static ssize_t yufs_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    if (iocb->ki_flags & IOCB_DIRECT) return yufs_direct_read(iocb, to);
+    return generic_file_read_iter(iocb, to);
+}
 
-    int bytes_written = YUFSCore_write(token, inode->i_ino, kbuf, len, *ppos);
-    kfree(kbuf);
-    if (bytes_written < 0) return -ENOSPC;
+static ssize_t yufs_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    if (iocb->ki_flags & IOCB_DIRECT) return yufs_direct_write(iocb, from);
+    return generic_file_write_iter(iocb, from);
+}
+
+// A dentry remembers the version its directory had when the name was
+// resolved. Every entry change bumps the directory's version on the backend,
+// so once the ttl runs out one getattr of the parent tells whether the name
+// still resolves the same way, positive or negative.
+static void yufs_dentry_settle(struct dentry *dentry, struct inode *dir) {
+    dentry->d_fsdata = (void *)(unsigned long)YUFS_I(dir)->version;
+    dentry->d_time = jiffies;
+}
+
+static int yufs_d_revalidate(struct dentry *dentry, unsigned int flags) {
+    struct yufs_sb_info *sbi = dentry->d_sb->s_fs_info;
+    unsigned long ttl = d_really_is_negative(dentry) ? sbi->negative_ttl : sbi->entry_ttl;
+    struct YUFS_stat stat;
+    struct dentry *parent;
+    struct inode *dir;
+    int valid, ret;
+
+    if (time_before(jiffies, dentry->d_time + ttl)) return 1;
+    if (flags & LOOKUP_RCU) return -ECHILD;
 
-    *ppos += bytes_written;
-    if (*ppos > inode->i_size) inode->i_size = *ppos;
-    return bytes_written;
+    parent = dget_parent(dentry);
+    dir = d_inode(parent);
+    ret = YUFSCore_getattr_fresh(yufs_token(dir->i_sb), dir->i_ino, &stat);
+    if (ret == 0) {
+        valid = (unsigned long)stat.version == (unsigned long)dentry->d_fsdata;
+        if (valid) dentry->d_time = jiffies;
+        // the lookup that follows tags its dentry with the new version
+        else YUFS_I(dir)->version = stat.version;
+    } else {
+        // -1 is the backend saying the directory is gone, anything else is
+        // a failed request that tells nothing about the entry
+        valid = ret == -1 ? 0 : -EIO;
+    }
+    dput(parent);
+    return valid;
+}
+
+static const struct dentry_operations yufs_dentry_ops = {
+    .d_revalidate = yufs_d_revalidate,
+};
+
+// our own entry change in dir, the backend bumped its version by one
+static void yufs_dir_changed(struct inode *dir, struct dentry *dentry) {
+    YUFS_I(dir)->version++;
+    yufs_dentry_settle(dentry, dir);
 }
 
 struct yufs_dir_ctx_adapter { struct dir_context *ctx; };
@@ -114,8 +701,9 @@ static struct dentry *yufs_lookup(struct inode *parent_inode, struct dentry *chi
         inode = yufs_get_inode(parent_inode->i_sb, &stat, parent_inode);
         if (!inode) return ERR_PTR(-ENOMEM);
     }
-    d_add(child_dentry, inode);
-    return NULL;
+    yufs_dentry_settle(child_dentry, parent_inode);
+    // a directory inode found again under another dentry keeps one alias
+    return d_splice_alias(inode, child_dentry);
 }
 
 static int yufs_create(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl) {
@@ -126,6 +714,7 @@ static int yufs_create(struct user_namespace *mnt_userns, struct inode *dir, str
     struct inode *inode = yufs_get_inode(dir->i_sb, &stat, dir);
     if (!inode) return -ENOMEM;
     d_instantiate(dentry, inode);
+    yufs_dir_changed(dir, dentry);
     return 0;
 }
 
@@ -137,6 +726,7 @@ static int yufs_link(struct dentry *old_dentry, struct inode *dir, struct dentry
     inc_nlink(inode);
     ihold(inode);
     d_instantiate(dentry, inode);
+    yufs_dir_changed(dir, dentry);
     return 0;
 }
 
@@ -149,23 +739,78 @@ static int yufs_mkdir(struct user_namespace *mnt_userns, struct inode *dir, stru
     if (!inode) return -ENOMEM;
     inc_nlink(dir);
     d_instantiate(dentry, inode);
+    yufs_dir_changed(dir, dentry);
     return 0;
 }
 
 static int yufs_unlink(struct inode *dir, struct dentry *dentry) {
     const char* token = yufs_token(dir->i_sb);
-    return (YUFSCore_unlink(token, dir->i_ino, dentry->d_name.name) == 0) ? 0 : -ENOENT;
+    if (YUFSCore_unlink(token, dir->i_ino, dentry->d_name.name) != 0) return -ENOENT;
+    // the last name gone, the cached inode is dropped with its last reference
+    drop_nlink(d_inode(dentry));
+    yufs_dir_changed(dir, dentry);
+    return 0;
 }
 
 static int yufs_rmdir(struct inode *dir, struct dentry *dentry) {
     const char* token = yufs_token(dir->i_sb);
     if (YUFSCore_rmdir(token, dir->i_ino, dentry->d_name.name) == 0) {
+        clear_nlink(d_inode(dentry));
         drop_nlink(dir);
+        yufs_dir_changed(dir, dentry);
         return 0;
     }
     return -ENOTEMPTY;
 }
 
+// Only the dirent moves on the backend, the inode keeps its id and its pages.
+// The VFS checked NOREPLACE and EXCHANGE against the dcache already, the core
+// decides again against the backend's state and tells why it refused.
+static int yufs_rename(struct user_namespace *mnt_userns, struct inode *old_dir, struct dentry *old_dentry,
+                       struct inode *new_dir, struct dentry *new_dentry, unsigned int flags) {
+    struct inode *old_inode = d_inode(old_dentry);
+    struct inode *new_inode = d_inode(new_dentry);
+    const char* token = yufs_token(old_dir->i_sb);
+    int err;
+
+    if (flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE)) return -EINVAL;
+    err = YUFSCore_rename(token, old_dir->i_ino, old_dentry->d_name.name, new_dir->i_ino,
+                          new_dentry->d_name.name, flags);
+    if (err) return err;
+
+    if (flags & RENAME_EXCHANGE) {
+        // a directory trading places across parents takes its ".." link along
+        if (old_dir != new_dir && S_ISDIR(old_inode->i_mode) != S_ISDIR(new_inode->i_mode)) {
+            if (S_ISDIR(old_inode->i_mode)) {
+                drop_nlink(old_dir);
+                inc_nlink(new_dir);
+            } else {
+                drop_nlink(new_dir);
+                inc_nlink(old_dir);
+            }
+        }
+    } else {
+        if (new_inode) {
+            if (S_ISDIR(new_inode->i_mode)) {
+                clear_nlink(new_inode);
+                drop_nlink(new_dir);
+            } else {
+                drop_nlink(new_inode);
+            }
+        }
+        if (S_ISDIR(old_inode->i_mode) && old_dir != new_dir) {
+            drop_nlink(old_dir);
+            inc_nlink(new_dir);
+        }
+    }
+    // d_move follows: old_dentry ends up in new_dir, new_dentry in old_dir
+    // when exchanged
+    if (old_dir != new_dir) YUFS_I(old_dir)->version++;
+    yufs_dir_changed(new_dir, old_dentry);
+    if (flags & RENAME_EXCHANGE) yufs_dentry_settle(new_dentry, old_dir);
+    return 0;
+}
+
 static const struct file_operations yufs_dir_operations = {
     .iterate_shared = yufs_iterate,
     .read = generic_read_dir,
@@ -173,33 +818,180 @@ static const struct file_operations yufs_dir_operations = {
 };
 
 static const struct file_operations yufs_file_operations = {
-    .read = yufs_read,
-    .write = yufs_write,
+    .read_iter = yufs_read_iter,
+    .write_iter = yufs_write_iter,
+    .splice_read = generic_file_splice_read,
+    .splice_write = iter_file_splice_write,
+    // page faults are served from the page cache, pages dirtied through a
+    // shared mapping are written back by writepages like any other
+    .mmap = generic_file_mmap,
+    .open = yufs_open,
     .llseek = generic_file_llseek,
     .fsync = yufs_fsync,
+    .flush = yufs_flush,
+    .fallocate = yufs_fallocate,
+    .copy_file_range = yufs_copy_file_range,
+    .remap_file_range = yufs_remap_file_range,
 };
 
 static const struct inode_operations yufs_dir_inode_ops = {
     .lookup = yufs_lookup, .create = yufs_create, .mkdir = yufs_mkdir,
     .unlink = yufs_unlink, .rmdir = yufs_rmdir, .link = yufs_link,
+    .rename = yufs_rename,
+    .getattr = yufs_getattr,
+};
+
+static const struct inode_operations yufs_file_inode_ops = {
+    .getattr = yufs_getattr,
 };
 
+// /sys/kernel/debug/yufs/<major:minor>/stats - request class counters and
+// per method phase histograms of this mount's token, writing anything to
+// "reset" zeroes them
+static int yufs_stats_show(struct seq_file *m, void *v) {
+    char *buf = kvmalloc(YUFS_STATS_SIZE, GFP_KERNEL);
+    if (!buf) return -ENOMEM;
+    YUFSCore_stats(yufs_token(m->private), buf, YUFS_STATS_SIZE);
+    seq_puts(m, buf);
+    kvfree(buf);
+    return 0;
+}
+
+static int yufs_stats_open(struct inode *inode, struct file *file) {
+    return single_open(file, yufs_stats_show, inode->i_private);
+}
+
+static const struct file_operations yufs_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = yufs_stats_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static ssize_t yufs_reset_write(struct file *file, const char __user *buf, size_t len, loff_t *ppos) {
+    YUFSCore_reset_stats(yufs_token(file_inode(file)->i_private));
+    return len;
+}
+
+static const struct file_operations yufs_reset_fops = {
+    .owner = THIS_MODULE,
+    .write = yufs_reset_write,
+};
+
+static void yufs_debugfs_init(struct super_block *sb, struct yufs_sb_info *sbi) {
+    char name[32];
+    snprintf(name, sizeof(name), "%u:%u", MAJOR(sb->s_dev), MINOR(sb->s_dev));
+    sbi->debug_dir = debugfs_create_dir(name, yufs_debug_root);
+    debugfs_create_file("stats", 0444, sbi->debug_dir, sb, &yufs_stats_fops);
+    debugfs_create_file("reset", 0200, sbi->debug_dir, sb, &yufs_reset_fops);
+}
+
+static int yufs_statfs(struct dentry *dentry, struct kstatfs *buf) {
+    struct YUFS_statfs st;
+
+    if (YUFSCore_statfs(yufs_token(dentry->d_sb), &st) != 0) return -EIO;
+    buf->f_type = YUFS_MAGIC;
+    buf->f_bsize = PAGE_SIZE;
+    buf->f_frsize = PAGE_SIZE;
+    buf->f_namelen = MAX_NAME_SIZE - 1;
+    buf->f_blocks = st.total_bytes >> PAGE_SHIFT;
+    buf->f_bfree = st.total_bytes > st.used_bytes ? (st.total_bytes - st.used_bytes) >> PAGE_SHIFT : 0;
+    buf->f_bavail = buf->f_bfree;
+    buf->f_files = st.total_inodes;
+    buf->f_ffree = st.total_inodes > st.used_inodes ? st.total_inodes - st.used_inodes : 0;
+    return 0;
+}
+
 static void yufs_put_super(struct super_block *sb) {
-    
+    struct yufs_sb_info *sbi = sb->s_fs_info;
+
+    if (sbi) debugfs_remove_recursive(sbi->debug_dir);
+    if (sbi && sbi->wb_wq) destroy_workqueue(sbi->wb_wq);
+    if (sbi && sbi->session) YUFSCore_close_session(sbi->token);
     kfree(sb->s_fs_info);
     sb->s_fs_info = NULL;
 }
 
+static struct inode *yufs_alloc_inode(struct super_block *sb) {
+    struct yufs_inode_info *ii = alloc_inode_sb(sb, yufs_inode_cachep, GFP_KERNEL);
+    if (!ii) return NULL;
+    ii->version = 0;
+    ii->attr_time = 0;
+    ii->dirtied = 0;
+    return &ii->vfs_inode;
+}
+
+static void yufs_free_inode(struct inode *inode) {
+    kmem_cache_free(yufs_inode_cachep, YUFS_I(inode));
+}
+
+static void yufs_inode_init_once(void *obj) {
+    struct yufs_inode_info *ii = obj;
+    inode_init_once(&ii->vfs_inode);
+    INIT_WORK(&ii->wb_work, yufs_wb_work);
+}
+
 static const struct super_operations yufs_super_ops = {
+    .alloc_inode = yufs_alloc_inode,
+    .free_inode = yufs_free_inode,
     .put_super = yufs_put_super,
-    .statfs = simple_statfs,
-    .drop_inode = generic_delete_inode,
+    .statfs = yufs_statfs,
+    // unused inodes stay cached while they have names
+    .drop_inode = generic_drop_inode,
 };
 
+// options are "key=value" pairs separated by ','. A bare word or "token=" sets
+// the token, "prefetch=" and the "entry_ttl=", "negative_ttl=", "attr_ttl="
+// timeouts are ours, every other key is handed to the core engine.
+static int yufs_parse_options(struct yufs_sb_info *sbi, char *options) {
+    char *opt;
+    int err;
+    while ((opt = strsep(&options, ",")) != NULL) {
+        char *value;
+        if (*opt == 0) continue;
+        value = strchr(opt, '=');
+        if (!value) {
+            strlcpy(sbi->token, opt, sizeof(sbi->token));
+            continue;
+        }
+        *value++ = 0;
+        if (strcmp(opt, "token") == 0) {
+            strlcpy(sbi->token, value, sizeof(sbi->token));
+            continue;
+        }
+        if (strcmp(opt, "entry_ttl") == 0 || strcmp(opt, "negative_ttl") == 0 || strcmp(opt, "attr_ttl") == 0) {
+            // seconds, 0 checks with the backend on every use
+            unsigned int ttl;
+            if (kstrtouint(value, 10, &ttl) != 0) return -EINVAL;
+            if (opt[0] == 'e') sbi->entry_ttl = ttl * HZ;
+            else if (opt[0] == 'n') sbi->negative_ttl = ttl * HZ;
+            else sbi->attr_ttl = ttl * HZ;
+            continue;
+        }
+        if (strcmp(opt, "prefetch") == 0) {
+            // prefetch=1 loads the whole tree's metadata while mounting
+            if (kstrtobool(value, &sbi->prefetch) != 0) return -EINVAL;
+            continue;
+        }
+        err = YUFSCore_configure(opt, value);
+        if (err == -EBUSY) {
+            printk(KERN_ERR "YUFS: %s=%s differs from the one of another mount\n", opt, value);
+            return err;
+        }
+        if (err) {
+            printk(KERN_ERR "YUFS: bad mount option %s=%s\n", opt, value);
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
 static int yufs_fill_super(struct super_block *sb, void *data, int silent) {
     struct inode *root_inode;
     struct YUFS_stat root_stat;
     struct yufs_sb_info *sbi;
+    int err;
 
     
     sbi = kzalloc(sizeof(struct yufs_sb_info), GFP_KERNEL);
@@ -208,21 +1000,43 @@ static int yufs_fill_super(struct super_block *sb, void *data, int silent) {
 
     
     
+    strlcpy(sbi->token, "default", sizeof(sbi->token));
+    sbi->entry_ttl = YUFS_ENTRY_TTL_DEFAULT * HZ;
+    sbi->negative_ttl = YUFS_NEGATIVE_TTL_DEFAULT * HZ;
+    sbi->attr_ttl = YUFS_ATTR_TTL_DEFAULT * HZ;
+
     if (data) {
-        strlcpy(sbi->token, (char*)data, sizeof(sbi->token));
-    } else {
-        strlcpy(sbi->token, "default", sizeof(sbi->token));
+        err = yufs_parse_options(sbi, (char*)data);
+        if (err) return err;
     }
     printk(KERN_INFO "YUFS: Mounting with token: %s\n", sbi->token);
 
-    if (YUFSCore_init() != 0) return -ENOMEM;
+    if (YUFSCore_open_session(sbi->token) != 0) return -EIO;
+    sbi->session = true;
+    yufs_debugfs_init(sb, sbi);
 
     sb->s_magic = YUFS_MAGIC;
     sb->s_op = &yufs_super_ops;
+    sb->s_d_op = &yufs_dentry_ops;
+
+    // nodev mounts share the noop bdi, which never writes dirty pages back
+    err = super_setup_bdi(sb);
+    if (err) return err;
+    sb->s_bdi->ra_pages = YUFS_READAHEAD_BYTES / PAGE_SIZE;
+    sb->s_bdi->io_pages = sb->s_bdi->ra_pages;
+    bdi_set_max_ratio(sb->s_bdi, YUFS_MAX_DIRTY_RATIO);
+    sbi->wb_wq = alloc_workqueue("yufs-wb-%s", WQ_UNBOUND | WQ_MEM_RECLAIM, 0, sb->s_id);
+    if (!sbi->wb_wq) return -ENOMEM;
 
     
     if (YUFSCore_getattr(sbi->token, 1000, &root_stat) != 0) return -EINVAL;
 
+    if (sbi->prefetch) {
+        // a failed prefetch only costs the warm cache, not the mount
+        int cached = YUFSCore_prefetch(sbi->token, 1000);
+        printk(KERN_INFO "YUFS: prefetched %d entries\n", cached);
+    }
+
     root_inode = yufs_get_inode(sb, &root_stat, NULL);
     if (!root_inode) return -ENOMEM;
 
@@ -233,15 +1047,34 @@ static int yufs_fill_super(struct super_block *sb, void *data, int silent) {
 }
 
 static struct dentry *yufs_mount(struct file_system_type *fs_type, int flags, const char *dev_name, void *data) {
+    struct dentry *root;
+    char *options;
+
     if (!data || ((char*)data)[0] == 0) {
         data = (void*)dev_name;
     }
-    return mount_nodev(fs_type, flags, data, yufs_fill_super);
+    // dev_name stays the token when only engine options are given,
+    // e.g. mount -t yufs -o backends=127.0.0.1:8080+127.0.0.1:8081 TOKEN /mnt
+    if (data != dev_name && dev_name && dev_name[0]) {
+        options = kasprintf(GFP_KERNEL, "token=%s,%s", dev_name, (char*)data);
+    } else {
+        options = kstrdup(data ? (char*)data : "", GFP_KERNEL);
+    }
+    if (!options) return ERR_PTR(-ENOMEM);
+
+    root = mount_nodev(fs_type, flags, options, yufs_fill_super);
+    kfree(options);
+    return root;
 }
 
 static void yufs_kill_sb(struct super_block *sb) {
+    struct yufs_sb_info *sbi = sb->s_fs_info;
+    // queued work holds inodes, they must be put before the sb evicts them
+    if (sbi && sbi->wb_wq) flush_workqueue(sbi->wb_wq);
     kill_anon_super(sb);
-    YUFSCore_destroy();
+    // put_super only runs for a mounted root, a failed fill_super still holds
+    // its session and sbi here
+    if (sb->s_fs_info) yufs_put_super(sb);
 }
 
 static struct file_system_type yufs_fs_type = {
@@ -253,11 +1086,33 @@ static struct file_system_type yufs_fs_type = {
 };
 
 static int __init yufs_module_init(void) {
-    return register_filesystem(&yufs_fs_type);
+    int err;
+    yufs_inode_cachep = kmem_cache_create("yufs_inode_cache", sizeof(struct yufs_inode_info), 0,
+                                          SLAB_RECLAIM_ACCOUNT | SLAB_ACCOUNT, yufs_inode_init_once);
+    if (!yufs_inode_cachep) return -ENOMEM;
+    // the engine state is shared by every mount, sessions are per mount
+    err = YUFSCore_init();
+    if (err) {
+        kmem_cache_destroy(yufs_inode_cachep);
+        return err;
+    }
+    yufs_debug_root = debugfs_create_dir("yufs", NULL);
+    err = register_filesystem(&yufs_fs_type);
+    if (err) {
+        debugfs_remove_recursive(yufs_debug_root);
+        YUFSCore_destroy();
+        kmem_cache_destroy(yufs_inode_cachep);
+    }
+    return err;
 }
 
 static void __exit yufs_module_exit(void) {
     unregister_filesystem(&yufs_fs_type);
+    debugfs_remove_recursive(yufs_debug_root);
+    YUFSCore_destroy();
+    // inodes are freed after an rcu grace period
+    rcu_barrier();
+    kmem_cache_destroy(yufs_inode_cachep);
 }
 
 module_init(yufs_module_init);
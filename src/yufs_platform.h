@@ -3,11 +3,20 @@
 
 #ifdef __KERNEL__
 
+#include <linux/err.h>
 #include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/printk.h>
 #include <linux/types.h>
+#include <linux/limits.h>
 #include <linux/stat.h>
+#include <linux/mutex.h>
+#include <linux/completion.h>
+#include <linux/wait.h>
+#include <linux/kthread.h>
+#include <linux/timekeeping.h>
+#include <linux/percpu.h>
+#include <linux/random.h>
 
 #define YUFS_MALLOC(sz) kmalloc(sz, GFP_KERNEL)
 #define YUFS_FREE(ptr) kfree(ptr)
@@ -19,16 +28,61 @@
 #define YUFS_LOG_INFO_IMPL(fmt, ...) printk(KERN_INFO "YUFS: " fmt, ##__VA_ARGS__)
 #define YUFS_LOG_ERR_IMPL(fmt, ...) printk(KERN_ERR "YUFS: " fmt, ##__VA_ARGS__)
 
+typedef struct mutex yufs_mutex_t;
+#define YUFS_MUTEX_INIT(m) mutex_init(m)
+#define YUFS_MUTEX_LOCK(m) mutex_lock(m)
+#define YUFS_MUTEX_UNLOCK(m) mutex_unlock(m)
+
+// condition is re-checked after every wake up, wakers change state before YUFS_WAKE_UP
+typedef wait_queue_head_t yufs_waitq_t;
+#define YUFS_WAITQ_INIT(wq) init_waitqueue_head(wq)
+#define YUFS_WAIT_EVENT(wq, condition) wait_event_idle(*(wq), condition)
+#define YUFS_WAKE_UP(wq) wake_up_all(wq)
+
+typedef struct completion yufs_completion_t;
+#define YUFS_COMPLETION_INIT(c) init_completion(c)
+#define YUFS_COMPLETE(c) complete_all(c)
+#define YUFS_WAIT_COMPLETION(c) wait_for_completion(c)
+
+// fn is int (*)(void*), it has to finish with YUFS_THREAD_EXIT
+#define YUFS_THREAD_RUN(fn, arg, name) (IS_ERR(kthread_run(fn, arg, name)) ? -1 : 0)
+#define YUFS_THREAD_EXIT(c) kthread_complete_and_exit(c, 0)
+
+#define YUFS_NOW_NS() ktime_get_ns()
+
+// counters updated between GET and PUT belong to the current cpu only
+#define YUFS_PERCPU_ALLOC(type) alloc_percpu(type)
+#define YUFS_PERCPU_FREE(p) free_percpu(p)
+#define YUFS_PERCPU_GET(p) get_cpu_ptr(p)
+#define YUFS_PERCPU_PUT(p) put_cpu_ptr(p)
+#define YUFS_PERCPU_PTR(p, cpu) per_cpu_ptr(p, cpu)
+#define YUFS_FOR_EACH_CPU(cpu) for_each_possible_cpu(cpu)
+#define YUFS_STAT_ADD(ptr, val) (*(ptr) += (val))
+
 #else // NOT_KERNEL :D
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <limits.h>
 #include <malloc.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <time.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/random.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 typedef uint32_t umode_t;
+typedef __loff_t loff_t; // same type glibc gives it under _GNU_SOURCE
 
 #define YUFS_MALLOC(sz) malloc(sz)
 #define YUFS_FREE(ptr) free(ptr)
@@ -40,6 +94,253 @@ typedef uint32_t umode_t;
 #define YUFS_LOG_INFO_IMPL(fmt, ...) printf("[INFO] YUFS: " fmt "\n", ##__VA_ARGS__)
 #define YUFS_LOG_ERR_IMPL(fmt, ...) printf("[ERR] YUFS: " fmt "\n", ##__VA_ARGS__)
 
+typedef pthread_mutex_t yufs_mutex_t;
+#define YUFS_MUTEX_INIT(m) pthread_mutex_init(m, NULL)
+#define YUFS_MUTEX_LOCK(m) pthread_mutex_lock(m)
+#define YUFS_MUTEX_UNLOCK(m) pthread_mutex_unlock(m)
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} yufs_waitq_t;
+
+static inline void yufs_waitq_init(yufs_waitq_t* wq) {
+    pthread_mutex_init(&wq->lock, NULL);
+    pthread_cond_init(&wq->cond, NULL);
+}
+
+#define YUFS_WAITQ_INIT(wq) yufs_waitq_init(wq)
+#define YUFS_WAIT_EVENT(wq, condition) do { \
+        pthread_mutex_lock(&(wq)->lock); \
+        while (!(condition)) pthread_cond_wait(&(wq)->cond, &(wq)->lock); \
+        pthread_mutex_unlock(&(wq)->lock); \
+    } while (0)
+#define YUFS_WAKE_UP(wq) do { \
+        pthread_mutex_lock(&(wq)->lock); \
+        pthread_cond_broadcast(&(wq)->cond); \
+        pthread_mutex_unlock(&(wq)->lock); \
+    } while (0)
+
+typedef struct {
+    yufs_waitq_t wq;
+    volatile int done;
+} yufs_completion_t;
+
+#define YUFS_COMPLETION_INIT(c) do { yufs_waitq_init(&(c)->wq); (c)->done = 0; } while (0)
+#define YUFS_COMPLETE(c) do { \
+        pthread_mutex_lock(&(c)->wq.lock); \
+        (c)->done = 1; \
+        pthread_cond_broadcast(&(c)->wq.cond); \
+        pthread_mutex_unlock(&(c)->wq.lock); \
+    } while (0)
+#define YUFS_WAIT_COMPLETION(c) YUFS_WAIT_EVENT(&(c)->wq, (c)->done)
+
+struct yufs_thread_start {
+    int (*fn)(void*);
+    void* arg;
+};
+
+static inline void* yufs_thread_trampoline(void* p) {
+    struct yufs_thread_start start = *(struct yufs_thread_start*)p;
+    free(p);
+    start.fn(start.arg);
+    return NULL;
+}
+
+static inline int yufs_thread_run(int (*fn)(void*), void* arg) {
+    pthread_t thread;
+    struct yufs_thread_start* start = (struct yufs_thread_start*)malloc(sizeof(*start));
+    if (!start) return -1;
+    start->fn = fn;
+    start->arg = arg;
+    if (pthread_create(&thread, NULL, yufs_thread_trampoline, start) != 0) {
+        free(start);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+#define YUFS_THREAD_RUN(fn, arg, name) yufs_thread_run(fn, arg)
+#define YUFS_THREAD_EXIT(c) do { YUFS_COMPLETE(c); return 0; } while (0)
+
+static inline uint64_t yufs_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+#define YUFS_NOW_NS() yufs_now_ns()
+
+// a single shared copy, updates are atomic instead
+#define YUFS_PERCPU_ALLOC(type) ((type*)calloc(1, sizeof(type)))
+#define YUFS_PERCPU_FREE(p) free(p)
+#define YUFS_PERCPU_GET(p) (p)
+#define YUFS_PERCPU_PUT(p) (void)0
+#define YUFS_PERCPU_PTR(p, cpu) (p)
+#define YUFS_FOR_EACH_CPU(cpu) for ((cpu) = 0; (cpu) < 1; (cpu)++)
+#define YUFS_STAT_ADD(ptr, val) __atomic_fetch_add(ptr, val, __ATOMIC_RELAXED)
+
+// Kernel API used by the web engine (http.c and the __WEB_VERSION__ half of
+// yufs_core.c), mapped onto libc and POSIX sockets so both build into a
+// userspace library. Errors come back as -errno like in the kernel.
+
+typedef uint8_t u8;
+
+#define GFP_KERNEL 0
+#define kmalloc(size, flags) malloc(size)
+#define kzalloc(size, flags) calloc(1, size)
+#define kcalloc(n, size, flags) calloc(n, size)
+#define kvmalloc(size, flags) malloc(size)
+#define kvcalloc(n, size, flags) calloc(n, size)
+#define kstrdup(str, flags) strdup(str)
+#define kfree(ptr) free(ptr)
+#define kvfree(ptr) free(ptr)
+
+#define MAX_ERRNO 4095
+
+static inline uint64_t get_random_u64(void) {
+    uint64_t value;
+    if (getrandom(&value, sizeof(value), 0) != sizeof(value)) value = yufs_now_ns();
+    return value;
+}
+
+static inline int yufs_kstrtoll(const char* str, unsigned int base, long long* res) {
+    char* end;
+    errno = 0;
+    long long value = strtoll(str, &end, base);
+    if (end == str) return -EINVAL;
+    if (*end == '\n') end++;
+    if (*end != 0) return -EINVAL;
+    if (errno) return -ERANGE;
+    *res = value;
+    return 0;
+}
+
+static inline int kstrtoint(const char* str, unsigned int base, int* res) {
+    long long value;
+    int err = yufs_kstrtoll(str, base, &value);
+    if (err) return err;
+    if (value < INT32_MIN || value > INT32_MAX) return -ERANGE;
+    *res = (int)value;
+    return 0;
+}
+
+static inline int kstrtouint(const char* str, unsigned int base, unsigned int* res) {
+    long long value;
+    int err = yufs_kstrtoll(str, base, &value);
+    if (err) return err;
+    if (value < 0 || value > UINT32_MAX) return -ERANGE;
+    *res = (unsigned int)value;
+    return 0;
+}
+
+static inline int kstrtoull(const char* str, unsigned int base, unsigned long long* res) {
+    char* end;
+    if (*str == '-') return -EINVAL;
+    errno = 0;
+    unsigned long long value = strtoull(str, &end, base);
+    if (end == str) return -EINVAL;
+    if (*end == '\n') end++;
+    if (*end != 0) return -EINVAL;
+    if (errno) return -ERANGE;
+    *res = value;
+    return 0;
+}
+
+static inline size_t yufs_strlcpy(char* dst, const char* src, size_t size) {
+    size_t len = strlen(src);
+    if (size > 0) {
+        size_t copy = len < size - 1 ? len : size - 1;
+        memcpy(dst, src, copy);
+        dst[copy] = 0;
+    }
+    return len;
+}
+#define strlcpy yufs_strlcpy
+
+__attribute__((format(printf, 3, 4)))
+static inline int scnprintf(char* buf, size_t size, const char* fmt, ...) {
+    va_list args;
+    if (size == 0) return 0;
+    va_start(args, fmt);
+    int len = vsnprintf(buf, size, fmt, args);
+    va_end(args);
+    if (len < 0) return 0;
+    return (size_t)len < size ? len : (int)size - 1;
+}
+
+// tests and benches would drown in info messages, only errors and warnings show
+#define KERN_ERR "<3>"
+#define KERN_WARNING "<4>"
+#define KERN_INFO "<6>"
+
+__attribute__((format(printf, 1, 2)))
+static inline int printk(const char* fmt, ...) {
+    va_list args;
+    if (fmt[0] == '<' && fmt[1] > '4') return 0;
+    va_start(args, fmt);
+    int len = vfprintf(stderr, fmt[0] == '<' ? fmt + 3 : fmt, args);
+    va_end(args);
+    return len;
+}
+
+#define sort(base, num, size, cmp, swap) qsort(base, num, size, cmp)
+
+static inline int in4_pton(const char* src, int srclen, u8* dst, int delim, const char** end) {
+    return inet_pton(AF_INET, src, dst) == 1 ? 1 : 0;
+}
+
+struct kvec {
+    void* iov_base;
+    size_t iov_len;
+};
+
+struct socket {
+    int fd;
+};
+
+static inline int yufs_sock_create(int family, int type, int protocol, struct socket** res) {
+    struct socket* sock = (struct socket*)malloc(sizeof(struct socket));
+    if (!sock) return -ENOMEM;
+    sock->fd = socket(family, type | SOCK_CLOEXEC, protocol);
+    if (sock->fd < 0) {
+        int err = -errno;
+        free(sock);
+        return err;
+    }
+    *res = sock;
+    return 0;
+}
+#define sock_create_kern(net, family, type, protocol, res) yufs_sock_create(family, type, protocol, res)
+
+static inline int kernel_connect(struct socket* sock, struct sockaddr* addr, int addrlen, int flags) {
+    return connect(sock->fd, addr, addrlen) == 0 ? 0 : -errno;
+}
+
+static inline int kernel_sendmsg(struct socket* sock, struct msghdr* msg, struct kvec* vec, size_t num, size_t len) {
+    msg->msg_iov = (struct iovec*)vec;
+    msg->msg_iovlen = num;
+    ssize_t ret = sendmsg(sock->fd, msg, MSG_NOSIGNAL);
+    return ret < 0 ? -errno : (int)ret;
+}
+
+static inline int kernel_recvmsg(struct socket* sock, struct msghdr* msg, struct kvec* vec, size_t num, size_t len,
+                                 int flags) {
+    msg->msg_iov = (struct iovec*)vec;
+    msg->msg_iovlen = num;
+    ssize_t ret = recvmsg(sock->fd, msg, flags);
+    return ret < 0 ? -errno : (int)ret;
+}
+
+static inline int kernel_sock_shutdown(struct socket* sock, int how) {
+    return shutdown(sock->fd, how) == 0 ? 0 : -errno;
+}
+
+static inline void sock_release(struct socket* sock) {
+    close(sock->fd);
+    free(sock);
+}
+
 #ifndef S_IFMT
 #define S_IFMT  00170000
 #endif
@@ -8,6 +8,7 @@ extern "C" {
 }
 
 const uint32_t ROOT_ID = 1000;
+const char *TOKEN = "test";
 
 class YufsTest : public ::testing::Test {
 protected:
@@ -23,7 +24,7 @@ protected:
 TEST_F(YufsTest, RootExists) {
     struct YUFS_stat stat;
 
-    int res = YUFSCore_getattr(ROOT_ID, &stat);
+    int res = YUFSCore_getattr(TOKEN, ROOT_ID, &stat);
     ASSERT_EQ(res, 0);
     EXPECT_EQ(stat.id, ROOT_ID);
     EXPECT_TRUE((stat.mode & S_IFMT) == S_IFDIR);
@@ -32,52 +33,52 @@ TEST_F(YufsTest, CreateAndLookupFile) {
     struct YUFS_stat stat;
 
 
-    int res = YUFSCore_create(ROOT_ID, "hello.txt", 0644 | S_IFREG, &stat);
+    int res = YUFSCore_create(TOKEN, ROOT_ID, "hello.txt", 0644 | S_IFREG, &stat);
     ASSERT_EQ(res, 0);
     uint32_t file_id = stat.id;
     EXPECT_NE(file_id, 0);
 
 
     struct YUFS_stat lookup_stat;
-    res = YUFSCore_lookup(ROOT_ID, "hello.txt", &lookup_stat);
+    res = YUFSCore_lookup(TOKEN, ROOT_ID, "hello.txt", &lookup_stat);
     ASSERT_EQ(res, 0);
     EXPECT_EQ(lookup_stat.id, file_id);
 
 
-    res = YUFSCore_lookup(ROOT_ID, "missing.txt", &lookup_stat);
+    res = YUFSCore_lookup(TOKEN, ROOT_ID, "missing.txt", &lookup_stat);
     EXPECT_NE(res, 0);
 }
 
 
 TEST_F(YufsTest, ReadWriteFile) {
     struct YUFS_stat stat;
-    YUFSCore_create(ROOT_ID, "data.bin", 0644 | S_IFREG, &stat);
+    YUFSCore_create(TOKEN, ROOT_ID, "data.bin", 0644 | S_IFREG, &stat);
     uint32_t fid = stat.id;
 
     const char *text = "Hello, World!";
     size_t len = strlen(text);
 
 
-    int written = YUFSCore_write(fid, text, len, 0);
+    int written = YUFSCore_write(TOKEN, fid, text, len, 0);
     EXPECT_EQ(written, len);
 
 
-    YUFSCore_getattr(fid, &stat);
+    YUFSCore_getattr(TOKEN, fid, &stat);
     EXPECT_EQ(stat.size, len);
 
 
     char buf[100];
     memset(buf, 0, sizeof(buf));
-    int read = YUFSCore_read(fid, buf, len, 0);
+    int read = YUFSCore_read(TOKEN, fid, buf, len, 0);
     EXPECT_EQ(read, len);
     EXPECT_STREQ(buf, text);
 
 
     const char *append = " YUFS";
-    YUFSCore_write(fid, append, strlen(append), len);
+    YUFSCore_write(TOKEN, fid, append, strlen(append), len);
 
     memset(buf, 0, sizeof(buf));
-    YUFSCore_read(fid, buf, 100, 0);
+    YUFSCore_read(TOKEN, fid, buf, 100, 0);
     EXPECT_STREQ(buf, "Hello, World! YUFS");
 }
 
@@ -93,13 +94,13 @@ TEST_F(YufsTest, DirectoryHierarchyAndIteration) {
     struct YUFS_stat s_folder, s_file, s_nested;
 
 
-    ASSERT_EQ(YUFSCore_create(ROOT_ID, "folder1", 0755 | S_IFDIR, &s_folder), 0);
-    ASSERT_EQ(YUFSCore_create(ROOT_ID, "file_in_root.txt", 0644 | S_IFREG, &s_file), 0);
-    ASSERT_EQ(YUFSCore_create(s_folder.id, "nested.txt", 0644 | S_IFREG, &s_nested), 0);
+    ASSERT_EQ(YUFSCore_create(TOKEN, ROOT_ID, "folder1", 0755 | S_IFDIR, &s_folder), 0);
+    ASSERT_EQ(YUFSCore_create(TOKEN, ROOT_ID, "file_in_root.txt", 0644 | S_IFREG, &s_file), 0);
+    ASSERT_EQ(YUFSCore_create(TOKEN, s_folder.id, "nested.txt", 0644 | S_IFREG, &s_nested), 0);
 
 
     std::vector<std::string> root_content;
-    YUFSCore_iterate(ROOT_ID, test_filldir_callback, &root_content, 0);
+    YUFSCore_iterate(TOKEN, ROOT_ID, test_filldir_callback, &root_content, 0);
 
 
     EXPECT_GE(root_content.size(), 4);
@@ -108,7 +109,7 @@ TEST_F(YufsTest, DirectoryHierarchyAndIteration) {
 
 
     std::vector<std::string> folder_content;
-    YUFSCore_iterate(s_folder.id, test_filldir_callback, &folder_content, 0);
+    YUFSCore_iterate(TOKEN, s_folder.id, test_filldir_callback, &folder_content, 0);
 
 
     EXPECT_GE(folder_content.size(), 3);
@@ -116,32 +117,260 @@ TEST_F(YufsTest, DirectoryHierarchyAndIteration) {
 
 
     struct YUFS_stat lookup_res;
-    ASSERT_EQ(YUFSCore_lookup(s_folder.id, "nested.txt", &lookup_res), 0);
+    ASSERT_EQ(YUFSCore_lookup(TOKEN, s_folder.id, "nested.txt", &lookup_res), 0);
     EXPECT_EQ(lookup_res.id, s_nested.id);
 }
 
 
 TEST_F(YufsTest, DeleteLogic) {
     struct YUFS_stat s_dir, s_file;
-    YUFSCore_create(ROOT_ID, "mydir", 0755 | S_IFDIR, &s_dir);
-    YUFSCore_create(s_dir.id, "file.txt", 0644 | S_IFREG, &s_file);
+    YUFSCore_create(TOKEN, ROOT_ID, "mydir", 0755 | S_IFDIR, &s_dir);
+    YUFSCore_create(TOKEN, s_dir.id, "file.txt", 0644 | S_IFREG, &s_file);
 
 
-    int res = YUFSCore_rmdir(ROOT_ID, "mydir");
+    int res = YUFSCore_rmdir(TOKEN, ROOT_ID, "mydir");
     EXPECT_NE(res, 0);
 
 
-    res = YUFSCore_unlink(s_dir.id, "file.txt");
+    res = YUFSCore_unlink(TOKEN, s_dir.id, "file.txt");
     EXPECT_EQ(res, 0);
 
 
     struct YUFS_stat dummy;
-    EXPECT_NE(YUFSCore_lookup(s_dir.id, "file.txt", &dummy), 0);
+    EXPECT_NE(YUFSCore_lookup(TOKEN, s_dir.id, "file.txt", &dummy), 0);
 
 
-    res = YUFSCore_rmdir(ROOT_ID, "mydir");
+    res = YUFSCore_rmdir(TOKEN, ROOT_ID, "mydir");
     EXPECT_EQ(res, 0);
 
 
-    EXPECT_NE(YUFSCore_lookup(ROOT_ID, "mydir", &dummy), 0);
+    EXPECT_NE(YUFSCore_lookup(TOKEN, ROOT_ID, "mydir", &dummy), 0);
+}
+
+
+static void count_done(struct YUFS_op *op) {
+    (*static_cast<int *>(op->priv))++;
+}
+
+TEST_F(YufsTest, AsyncBatch) {
+    struct YUFS_op ops[3] = {};
+    ops[0].type = YUFS_OP_CREATE;
+    ops[0].parent_id = ROOT_ID;
+    ops[0].name = "async.txt";
+    ops[0].mode = 0644 | S_IFREG;
+    ops[1].type = YUFS_OP_LOOKUP;
+    ops[1].parent_id = ROOT_ID;
+    ops[1].name = "async.txt";
+    ops[2].type = YUFS_OP_LOOKUP;
+    ops[2].parent_id = ROOT_ID;
+    ops[2].name = "missing.txt";
+
+    ASSERT_EQ(YUFSCore_submit_batch(TOKEN, ops, 3), 0);
+    EXPECT_EQ(YUFSCore_wait(&ops[0]), 0);
+    EXPECT_EQ(YUFSCore_wait(&ops[1]), 0);
+    EXPECT_EQ(ops[1].stat.id, ops[0].stat.id);
+    EXPECT_NE(YUFSCore_wait(&ops[2]), 0);
+
+    const char *text = "async";
+    int completed = 0;
+    struct YUFS_op write_op = {};
+    write_op.type = YUFS_OP_WRITE;
+    write_op.id = ops[0].stat.id;
+    write_op.buf = const_cast<char *>(text);
+    write_op.size = strlen(text);
+    write_op.done = count_done;
+    write_op.priv = &completed;
+    ASSERT_EQ(YUFSCore_submit(TOKEN, &write_op), 0);
+    EXPECT_EQ(completed, 1);
+    EXPECT_EQ(write_op.ret, (int)strlen(text));
+}
+
+TEST_F(YufsTest, VersionAndConditionalRead) {
+    struct YUFS_stat stat;
+    ASSERT_EQ(YUFSCore_create(TOKEN, ROOT_ID, "versioned.txt", 0644 | S_IFREG, &stat), 0);
+    uint32_t fid = stat.id;
+    uint64_t created = stat.version;
+    EXPECT_NE(created, 0u);
+
+    const char *text = "v2";
+    ASSERT_EQ(YUFSCore_write(TOKEN, fid, text, strlen(text), 0), (int)strlen(text));
+    ASSERT_EQ(YUFSCore_getattr(TOKEN, fid, &stat), 0);
+    EXPECT_GT(stat.version, created);
+
+    struct YUFS_stat looked_up;
+    ASSERT_EQ(YUFSCore_lookup(TOKEN, ROOT_ID, "versioned.txt", &looked_up), 0);
+    EXPECT_EQ(looked_up.version, stat.version);
+
+    char buf[16] = {0};
+    EXPECT_EQ(YUFSCore_read_if(TOKEN, fid, buf, sizeof(buf), 0, stat.version), YUFS_NOT_MODIFIED);
+    EXPECT_EQ(YUFSCore_read_if(TOKEN, fid, buf, sizeof(buf), 0, created), (int)strlen(text));
+    EXPECT_STREQ(buf, text);
+}
+
+TEST_F(YufsTest, DirectoryVersionTracksEntries) {
+    struct YUFS_stat dir;
+    ASSERT_EQ(YUFSCore_create(TOKEN, ROOT_ID, "versioned_dir", 0755 | S_IFDIR, &dir), 0);
+    uint64_t version = dir.version;
+
+    struct YUFS_stat file;
+    ASSERT_EQ(YUFSCore_create(TOKEN, dir.id, "a", 0644 | S_IFREG, &file), 0);
+    ASSERT_EQ(YUFSCore_getattr(TOKEN, dir.id, &dir), 0);
+    EXPECT_GT(dir.version, version);
+    version = dir.version;
+
+    ASSERT_EQ(YUFSCore_link(TOKEN, file.id, dir.id, "b"), 0);
+    ASSERT_EQ(YUFSCore_getattr(TOKEN, dir.id, &dir), 0);
+    EXPECT_GT(dir.version, version);
+    version = dir.version;
+
+    ASSERT_EQ(YUFSCore_unlink(TOKEN, dir.id, "a"), 0);
+    ASSERT_EQ(YUFSCore_getattr(TOKEN, dir.id, &dir), 0);
+    EXPECT_GT(dir.version, version);
+    version = dir.version;
+
+    // a failed change leaves it alone
+    EXPECT_NE(YUFSCore_unlink(TOKEN, dir.id, "missing"), 0);
+    ASSERT_EQ(YUFSCore_getattr(TOKEN, dir.id, &dir), 0);
+    EXPECT_EQ(dir.version, version);
+}
+
+TEST_F(YufsTest, StatfsCounters) {
+    struct YUFS_statfs before;
+    ASSERT_EQ(YUFSCore_statfs(TOKEN, &before), 0);
+    EXPECT_GT(before.total_inodes, before.used_inodes);
+    EXPECT_GT(before.total_bytes, 0u);
+
+    struct YUFS_stat stat;
+    ASSERT_EQ(YUFSCore_create(TOKEN, ROOT_ID, "counted.bin", 0644 | S_IFREG, &stat), 0);
+    std::vector<char> data(10000, 'x');
+    ASSERT_EQ(YUFSCore_write(TOKEN, stat.id, data.data(), data.size(), 0), (int)data.size());
+    // overwriting in place takes no more space
+    ASSERT_EQ(YUFSCore_write(TOKEN, stat.id, data.data(), 100, 0), 100);
+
+    struct YUFS_statfs after;
+    ASSERT_EQ(YUFSCore_statfs(TOKEN, &after), 0);
+    EXPECT_EQ(after.used_inodes, before.used_inodes + 1);
+    EXPECT_EQ(after.used_bytes, before.used_bytes + data.size());
+
+    ASSERT_EQ(YUFSCore_unlink(TOKEN, ROOT_ID, "counted.bin"), 0);
+    ASSERT_EQ(YUFSCore_statfs(TOKEN, &after), 0);
+    EXPECT_EQ(after.used_inodes, before.used_inodes);
+    EXPECT_EQ(after.used_bytes, before.used_bytes);
+}
+
+TEST_F(YufsTest, ByteCapRejectsGrowth) {
+    struct YUFS_stat stat;
+    ASSERT_EQ(YUFSCore_configure("max_bytes", "4096"), 0);
+    ASSERT_EQ(YUFSCore_create(TOKEN, ROOT_ID, "capped.bin", 0644 | S_IFREG, &stat), 0);
+
+    std::vector<char> data(4096, 'x');
+    ASSERT_EQ(YUFSCore_write(TOKEN, stat.id, data.data(), data.size(), 0), (int)data.size());
+    EXPECT_LT(YUFSCore_write(TOKEN, stat.id, data.data(), 1, data.size()), 0);
+    EXPECT_EQ(YUFSCore_write(TOKEN, stat.id, data.data(), 10, 0), 10);
+}
+
+TEST_F(YufsTest, RenameMovesEntries) {
+    struct YUFS_stat dir, file, other, stat;
+    ASSERT_EQ(YUFSCore_create(TOKEN, ROOT_ID, "dir", 0755 | S_IFDIR, &dir), 0);
+    ASSERT_EQ(YUFSCore_create(TOKEN, ROOT_ID, "tmp", 0644 | S_IFREG, &file), 0);
+    ASSERT_EQ(YUFSCore_write(TOKEN, file.id, "new", 3, 0), 3);
+    ASSERT_EQ(YUFSCore_create(TOKEN, dir.id, "saved", 0644 | S_IFREG, &other), 0);
+
+    // atomic save: the temp file replaces the old one, the data stays with its inode
+    ASSERT_EQ(YUFSCore_rename(TOKEN, ROOT_ID, "tmp", dir.id, "saved", YUFS_RENAME_NOREPLACE), -EEXIST);
+    ASSERT_EQ(YUFSCore_rename(TOKEN, ROOT_ID, "tmp", dir.id, "saved", 0), 0);
+    EXPECT_NE(YUFSCore_lookup(TOKEN, ROOT_ID, "tmp", &stat), 0);
+    ASSERT_EQ(YUFSCore_lookup(TOKEN, dir.id, "saved", &stat), 0);
+    EXPECT_EQ(stat.id, file.id);
+    EXPECT_EQ(stat.size, 3u);
+    EXPECT_NE(YUFSCore_getattr(TOKEN, other.id, &stat), 0);
+
+    // a directory moves with its children, but not below itself
+    ASSERT_EQ(YUFSCore_create(TOKEN, ROOT_ID, "top", 0755 | S_IFDIR, &other), 0);
+    ASSERT_EQ(YUFSCore_rename(TOKEN, ROOT_ID, "dir", other.id, "moved", 0), 0);
+    ASSERT_EQ(YUFSCore_lookup(TOKEN, dir.id, "saved", &stat), 0);
+    EXPECT_EQ(YUFSCore_rename(TOKEN, ROOT_ID, "top", dir.id, "loop", 0), -EINVAL);
+
+    // a directory replaces only an empty one
+    ASSERT_EQ(YUFSCore_create(TOKEN, ROOT_ID, "empty", 0755 | S_IFDIR, &stat), 0);
+    EXPECT_EQ(YUFSCore_rename(TOKEN, ROOT_ID, "empty", other.id, "moved", 0), -ENOTEMPTY);
+    EXPECT_EQ(YUFSCore_rename(TOKEN, dir.id, "saved", ROOT_ID, "empty", 0), -EISDIR);
+    EXPECT_EQ(YUFSCore_rename(TOKEN, ROOT_ID, "empty", dir.id, "saved", 0), -ENOTDIR);
+    EXPECT_EQ(YUFSCore_rename(TOKEN, other.id, "moved", ROOT_ID, "empty", 0), 0);
+    ASSERT_EQ(YUFSCore_lookup(TOKEN, ROOT_ID, "empty", &stat), 0);
+    EXPECT_EQ(stat.id, dir.id);
+}
+
+TEST_F(YufsTest, RenameExchange) {
+    struct YUFS_stat a, b, stat;
+    ASSERT_EQ(YUFSCore_create(TOKEN, ROOT_ID, "a", 0644 | S_IFREG, &a), 0);
+    ASSERT_EQ(YUFSCore_create(TOKEN, ROOT_ID, "b", 0755 | S_IFDIR, &b), 0);
+    EXPECT_EQ(YUFSCore_rename(TOKEN, ROOT_ID, "a", ROOT_ID, "c", YUFS_RENAME_EXCHANGE), -ENOENT);
+
+    ASSERT_EQ(YUFSCore_getattr(TOKEN, ROOT_ID, &stat), 0);
+    uint64_t version = stat.version;
+    ASSERT_EQ(YUFSCore_rename(TOKEN, ROOT_ID, "a", ROOT_ID, "b", YUFS_RENAME_EXCHANGE), 0);
+    ASSERT_EQ(YUFSCore_lookup(TOKEN, ROOT_ID, "a", &stat), 0);
+    EXPECT_EQ(stat.id, b.id);
+    ASSERT_EQ(YUFSCore_lookup(TOKEN, ROOT_ID, "b", &stat), 0);
+    EXPECT_EQ(stat.id, a.id);
+    ASSERT_EQ(YUFSCore_getattr(TOKEN, ROOT_ID, &stat), 0);
+    EXPECT_GT(stat.version, version);
+}
+
+TEST_F(YufsTest, FallocateReservesAndPunches) {
+    struct YUFS_stat stat, changed;
+    struct YUFS_statfs before, after;
+    ASSERT_EQ(YUFSCore_create(TOKEN, ROOT_ID, "prealloc.bin", 0644 | S_IFREG, &stat), 0);
+    ASSERT_EQ(YUFSCore_statfs(TOKEN, &before), 0);
+
+    // KEEP_SIZE takes the space but leaves the size alone
+    ASSERT_EQ(YUFSCore_fallocate(TOKEN, stat.id, YUFS_FALLOC_KEEP_SIZE, 0, 8192), 0);
+    ASSERT_EQ(YUFSCore_getattr(TOKEN, stat.id, &stat), 0);
+    EXPECT_EQ(stat.size, 0u);
+    ASSERT_EQ(YUFSCore_statfs(TOKEN, &after), 0);
+    EXPECT_EQ(after.used_bytes, before.used_bytes + 8192);
+
+    // writes inside the reservation take nothing more
+    std::vector<char> data(4096, 'x');
+    ASSERT_EQ(YUFSCore_write(TOKEN, stat.id, data.data(), data.size(), 4096), (int)data.size());
+    ASSERT_EQ(YUFSCore_statfs(TOKEN, &after), 0);
+    EXPECT_EQ(after.used_bytes, before.used_bytes + 8192);
+    char buf[8];
+    ASSERT_EQ(YUFSCore_read(TOKEN, stat.id, buf, sizeof(buf), 0), (int)sizeof(buf));
+    EXPECT_EQ(std::string(buf, sizeof(buf)), std::string(sizeof(buf), '\0'));
+
+    // a plain allocation extends the size with zeroes
+    ASSERT_EQ(YUFSCore_fallocate(TOKEN, stat.id, 0, 8192, 100), 0);
+    ASSERT_EQ(YUFSCore_getattr(TOKEN, stat.id, &stat), 0);
+    EXPECT_EQ(stat.size, 8292u);
+
+    EXPECT_NE(YUFSCore_fallocate(TOKEN, stat.id, YUFS_FALLOC_PUNCH_HOLE, 0, 10), 0);
+    ASSERT_EQ(YUFSCore_fallocate(TOKEN, stat.id, YUFS_FALLOC_PUNCH_HOLE | YUFS_FALLOC_KEEP_SIZE, 4096, 4), 0);
+    ASSERT_EQ(YUFSCore_read(TOKEN, stat.id, buf, sizeof(buf), 4096), (int)sizeof(buf));
+    EXPECT_EQ(std::string(buf, sizeof(buf)), std::string(4, '\0') + "xxxx");
+    ASSERT_EQ(YUFSCore_getattr(TOKEN, stat.id, &changed), 0);
+    EXPECT_EQ(changed.size, stat.size);
+    EXPECT_GT(changed.version, stat.version);
+}
+
+TEST_F(YufsTest, CopyRange) {
+    struct YUFS_stat src, dst, stat;
+    ASSERT_EQ(YUFSCore_create(TOKEN, ROOT_ID, "src", 0644 | S_IFREG, &src), 0);
+    ASSERT_EQ(YUFSCore_create(TOKEN, ROOT_ID, "dst", 0644 | S_IFREG, &dst), 0);
+    ASSERT_EQ(YUFSCore_write(TOKEN, src.id, "0123456789", 10, 0), 10);
+
+    // short at the end of src, the gap in front of dst_offset reads as zeroes
+    ASSERT_EQ(YUFSCore_copy_range(TOKEN, src.id, 4, dst.id, 2, 100), 6);
+    char buf[8];
+    ASSERT_EQ(YUFSCore_read(TOKEN, dst.id, buf, sizeof(buf), 0), (int)sizeof(buf));
+    EXPECT_EQ(std::string(buf, sizeof(buf)), std::string("\0\0" "456789", 8));
+    EXPECT_EQ(YUFSCore_copy_range(TOKEN, src.id, 10, dst.id, 0, 5), 0);
+
+    // overlapping ranges of one file
+    ASSERT_EQ(YUFSCore_copy_range(TOKEN, src.id, 0, src.id, 2, 8), 8);
+    ASSERT_EQ(YUFSCore_read(TOKEN, src.id, buf, sizeof(buf), 0), (int)sizeof(buf));
+    EXPECT_EQ(std::string(buf, sizeof(buf)), "01012345");
+    ASSERT_EQ(YUFSCore_getattr(TOKEN, src.id, &stat), 0);
+    EXPECT_EQ(stat.size, 10u);
 }
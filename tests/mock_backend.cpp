@@ -0,0 +1,609 @@
+#include "mock_backend.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <set>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+const uint32_t ROOT_INO = 1000;
+const int64_t SESSION_STALE = -116;
+const int64_t NOT_MODIFIED = -304;
+// how long a write stripe waits for the one before it
+const auto CHAIN_WAIT = std::chrono::seconds(2);
+
+void sleep_us(unsigned us) {
+    if (us > 0) std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+template <typename T>
+void pack(std::string &out, T value) {
+    out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+// '<IIQQI' of pack_stat
+void pack_stat(std::string &out, uint32_t id, uint32_t mode, uint64_t size, uint64_t version, uint32_t nlink) {
+    pack(out, id);
+    pack(out, mode);
+    pack(out, size);
+    pack(out, version);
+    pack(out, nlink);
+}
+
+std::string url_decode(const std::string &in) {
+    std::string out;
+    for (size_t i = 0; i < in.size(); i++) {
+        if (in[i] == '%' && i + 2 < in.size()) {
+            out += (char)strtol(in.substr(i + 1, 2).c_str(), nullptr, 16);
+            i += 2;
+        } else if (in[i] == '+') {
+            out += ' ';
+        } else {
+            out += in[i];
+        }
+    }
+    return out;
+}
+
+uint64_t arg_u64(const std::map<std::string, std::string> &args, const char *key, uint64_t fallback = 0) {
+    auto it = args.find(key);
+    return it == args.end() ? fallback : strtoull(it->second.c_str(), nullptr, 10);
+}
+
+bool send_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t ret = send(fd, data, size, MSG_NOSIGNAL);
+        if (ret <= 0) return false;
+        data += ret;
+        size -= ret;
+    }
+    return true;
+}
+
+} // namespace
+
+MockBackend::~MockBackend() { stop(); }
+
+std::string MockBackend::start(bool uds) {
+    std::string spec;
+    stopping_ = false;
+
+    if (uds) {
+        char dir[] = "/tmp/yufs_mock.XXXXXX";
+        if (!mkdtemp(dir)) return "";
+        dir_ = dir;
+        struct sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/yufs.sock", dir);
+        listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_fd_ < 0 || bind(listen_fd_, (struct sockaddr *)&addr, sizeof(addr)) != 0) return "";
+        spec = std::string("unix:") + addr.sun_path;
+    } else {
+        struct sockaddr_in addr = {};
+        socklen_t len = sizeof(addr);
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_fd_ < 0 || bind(listen_fd_, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            getsockname(listen_fd_, (struct sockaddr *)&addr, &len) != 0)
+            return "";
+        spec = "127.0.0.1:" + std::to_string(ntohs(addr.sin_port));
+    }
+    if (listen(listen_fd_, 64) != 0) return "";
+
+    acceptor_ = std::thread([this] { accept_loop(); });
+    return spec;
+}
+
+void MockBackend::stop() {
+    if (listen_fd_ < 0) return;
+    stopping_ = true;
+    // wakes accept() and every recv() with an error
+    shutdown(listen_fd_, SHUT_RDWR);
+    acceptor_.join();
+    close(listen_fd_);
+    listen_fd_ = -1;
+
+    std::vector<std::thread> threads;
+    {
+        std::lock_guard<std::mutex> guard(conns_lock_);
+        for (int fd : conn_fds_) shutdown(fd, SHUT_RDWR);
+        threads.swap(conn_threads_);
+    }
+    for (auto &thread : threads) thread.join();
+
+    if (!dir_.empty()) {
+        unlink((dir_ + "/yufs.sock").c_str());
+        rmdir(dir_.c_str());
+        dir_.clear();
+    }
+}
+
+void MockBackend::forget_sessions() {
+    std::lock_guard<std::mutex> guard(lock_);
+    sessions_.clear();
+}
+
+void MockBackend::remote_write(const std::string &token, uint32_t id, const std::string &content) {
+    std::lock_guard<std::mutex> guard(lock_);
+    Inode &inode = tree(token).inodes[id];
+    inode.content = content;
+    inode.version++;
+}
+
+uint64_t MockBackend::requests(const std::string &cmd) {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto it = requests_.find(cmd);
+    return it == requests_.end() ? 0 : it->second;
+}
+
+void MockBackend::accept_loop() {
+    while (!stopping_) {
+        int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+        int one = 1;
+        // fails on unix sockets, which have no Nagle to begin with
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        std::lock_guard<std::mutex> guard(conns_lock_);
+        if (stopping_) {
+            close(fd);
+            break;
+        }
+        conn_fds_.push_back(fd);
+        conn_threads_.emplace_back([this, fd] { serve(fd); });
+    }
+}
+
+void MockBackend::serve(int fd) {
+    std::string buffer;
+    Request req;
+    while (read_request(fd, buffer, req)) {
+        std::string payload;
+        int64_t ret = handle(req, payload);
+        sleep_us(delay_us_);
+        if (!write_response(fd, ret, payload)) break;
+    }
+
+    std::lock_guard<std::mutex> guard(conns_lock_);
+    for (auto it = conn_fds_.begin(); it != conn_fds_.end(); ++it) {
+        if (*it == fd) {
+            conn_fds_.erase(it);
+            break;
+        }
+    }
+    close(fd);
+}
+
+bool MockBackend::read_request(int fd, std::string &buffer, Request &req) {
+    char chunk[64 * 1024];
+    size_t header_end;
+    size_t length = 0;
+
+    auto fill = [&]() {
+        size_t want = sizeof(chunk);
+        size_t slow = slow_read_bytes_;
+        if (slow > 0) {
+            sleep_us(slow_read_pause_us_);
+            want = std::min(want, slow);
+        }
+        ssize_t ret = recv(fd, chunk, want, 0);
+        if (ret <= 0) return false;
+        buffer.append(chunk, ret);
+        return true;
+    };
+
+    while ((header_end = buffer.find("\r\n\r\n")) == std::string::npos) {
+        if (!fill()) return false;
+    }
+    std::string header = buffer.substr(0, header_end);
+    buffer.erase(0, header_end + 4);
+
+    size_t line_end = header.find("\r\n");
+    std::string line = header.substr(0, line_end);
+    size_t path_start = line.find(' ');
+    size_t path_end = line.find(' ', path_start + 1);
+    if (path_start == std::string::npos || path_end == std::string::npos) return false;
+    std::string path = line.substr(path_start + 1, path_end - path_start - 1);
+
+    size_t pos = header.find("\r\nContent-Length:");
+    if (pos != std::string::npos) length = strtoull(header.c_str() + pos + 17, nullptr, 10);
+
+    req.args.clear();
+    size_t query = path.find('?');
+    req.cmd = path.substr(0, query);
+    if (req.cmd.rfind("/api/", 0) == 0) req.cmd.erase(0, 5);
+    while (query != std::string::npos) {
+        size_t next = path.find('&', query + 1);
+        std::string pair = path.substr(query + 1, next == std::string::npos ? std::string::npos : next - query - 1);
+        size_t eq = pair.find('=');
+        if (eq != std::string::npos) req.args[pair.substr(0, eq)] = url_decode(pair.substr(eq + 1));
+        query = next;
+    }
+
+    while (buffer.size() < length) {
+        if (!fill()) return false;
+    }
+    req.body = buffer.substr(0, length);
+    buffer.erase(0, length);
+    return true;
+}
+
+bool MockBackend::write_response(int fd, int64_t ret, const std::string &payload) {
+    std::string response = "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(sizeof(ret) + payload.size()) +
+                           "\r\n\r\n";
+    pack(response, ret);
+    response += payload;
+
+    int left = truncate_count_.load();
+    while (left > 0 && !truncate_count_.compare_exchange_weak(left, left - 1)) {
+    }
+    if (left > 0) {
+        send_all(fd, response.data(), std::min(response.size(), truncate_bytes_.load()));
+        shutdown(fd, SHUT_RDWR);
+        return false;
+    }
+    return send_all(fd, response.data(), response.size());
+}
+
+MockBackend::Tree &MockBackend::tree(const std::string &token) {
+    auto &slot = trees_[token];
+    if (!slot) {
+        slot.reset(new Tree);
+        slot->inodes[ROOT_INO].mode = S_IFDIR | 0777;
+    }
+    return *slot;
+}
+
+// Stripes of a chain arrive in any order over separate connections. Each
+// one waits for its predecessor and is refused once one of them failed.
+int64_t MockBackend::chained_write(std::unique_lock<std::mutex> &guard, const std::string &token,
+                                   const Request &req, std::string &payload) {
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = chains_.begin(); it != chains_.end();) {
+        if (now - it->second.touched > 2 * CHAIN_WAIT) it = chains_.erase(it);
+        else ++it;
+    }
+
+    ChainKey key{token, arg_u64(req.args, "id"), arg_u64(req.args, "chain")};
+    uint64_t seq = arg_u64(req.args, "seq");
+    chains_[key].touched = now;
+    bool ready = chain_wait_.wait_for(guard, CHAIN_WAIT, [&] {
+        const Chain &chain = chains_[key];
+        return chain.broken || chain.next == seq;
+    });
+
+    Chain &chain = chains_[key];
+    int64_t ret = ready && !chain.broken ? dispatch(tree(token), req, payload) : -1;
+    chain.touched = std::chrono::steady_clock::now();
+    if (ret == (int64_t)req.body.size()) chain.next++;
+    else chain.broken = true;
+    // a broken chain stays until it ages out, its later stripes still come
+    if (!chain.broken && arg_u64(req.args, "last")) chains_.erase(key);
+    chain_wait_.notify_all();
+    return ret;
+}
+
+int64_t MockBackend::handle(Request &req, std::string &payload) {
+    std::unique_lock<std::mutex> guard(lock_);
+    requests_[req.cmd]++;
+
+    auto sid = req.args.find("sid");
+    if (sid != req.args.end()) {
+        auto session = sessions_.find(strtoll(sid->second.c_str(), nullptr, 10));
+        if (session == sessions_.end()) return SESSION_STALE;
+        if (req.cmd == "session_close") {
+            sessions_.erase(session);
+            return 0;
+        }
+        if (req.cmd == "write" && req.args.count("chain")) return chained_write(guard, session->second, req, payload);
+        return dispatch(tree(session->second), req, payload);
+    }
+
+    auto token = req.args.find("token");
+    std::string name = token == req.args.end() ? "default" : token->second;
+    Tree &t = tree(name);
+    if (req.cmd == "session") {
+        int64_t id = next_session_++;
+        sessions_[id] = name;
+        return id;
+    }
+    if (req.cmd == "write" && req.args.count("chain")) return chained_write(guard, name, req, payload);
+    return dispatch(t, req, payload);
+}
+
+uint32_t MockBackend::allocate_ids(Tree &tree, uint32_t count) {
+    uint32_t first = std::max(tree.inodes.rbegin()->first + 1, tree.next_id);
+    tree.next_id = first + count;
+    return first;
+}
+
+int64_t MockBackend::dispatch(Tree &tree, const Request &req, std::string &payload) {
+    const auto &args = req.args;
+
+    if (req.cmd == "lookup" || req.cmd == "getattr") {
+        uint32_t id = arg_u64(args, "id");
+        if (req.cmd == "lookup") {
+            auto row = tree.names.find({(uint32_t)arg_u64(args, "parent_id"), args.count("name") ? args.at("name") : ""});
+            if (row == tree.names.end()) return -1;
+            id = tree.rows[row->second].id;
+        }
+        auto inode = tree.inodes.find(id);
+        if (inode == tree.inodes.end()) return -1;
+        pack_stat(payload, id, inode->second.mode, inode->second.content.size(), inode->second.version,
+                  inode->second.nlink);
+        return 0;
+    }
+    if (req.cmd == "lease") {
+        uint32_t count = arg_u64(args, "count");
+        if (count == 0) return -1;
+        return allocate_ids(tree, count);
+    }
+    if (req.cmd == "create") {
+        uint32_t parent = arg_u64(args, "parent_id");
+        uint32_t mode = arg_u64(args, "mode");
+        const std::string &name = args.count("name") ? args.at("name") : "";
+        uint32_t id = args.count("id") ? arg_u64(args, "id") : 0;
+        if (tree.names.count({parent, name}) || (id != 0 && tree.inodes.count(id))) return -1;
+        if (id == 0) id = allocate_ids(tree, 1);
+
+        tree.inodes[id].mode = mode;
+        tree.rows[tree.next_row] = {parent, id, name};
+        tree.names[{parent, name}] = tree.next_row++;
+        tree.inodes[parent].version++;
+        pack_stat(payload, id, mode, 0, 1, 1);
+        return 0;
+    }
+    if (req.cmd == "link") {
+        uint32_t parent = arg_u64(args, "parent_id");
+        uint32_t target = arg_u64(args, "target_id");
+        const std::string &name = args.count("name") ? args.at("name") : "";
+        auto inode = tree.inodes.find(target);
+        if (inode == tree.inodes.end() || S_ISDIR(inode->second.mode) || tree.names.count({parent, name})) return -1;
+        tree.rows[tree.next_row] = {parent, target, name};
+        tree.names[{parent, name}] = tree.next_row++;
+        inode->second.nlink++;
+        tree.inodes[parent].version++;
+        return 0;
+    }
+    if (req.cmd == "unlink" || req.cmd == "rmdir") {
+        uint32_t parent = arg_u64(args, "parent_id");
+        auto row = tree.names.find({parent, args.count("name") ? args.at("name") : ""});
+        if (row == tree.names.end()) return req.cmd == "rmdir" ? 0 : -1;
+        tree.inodes[tree.rows[row->second].id].nlink--;
+        tree.rows.erase(row->second);
+        tree.names.erase(row);
+        tree.inodes[parent].version++;
+        return 0;
+    }
+    if (req.cmd == "read") {
+        auto inode = tree.inodes.find(arg_u64(args, "id"));
+        if (inode != tree.inodes.end() && args.count("if_version") &&
+            inode->second.version == arg_u64(args, "if_version"))
+            return NOT_MODIFIED;
+        if (inode == tree.inodes.end()) return 0;
+        const std::string &content = inode->second.content;
+        uint64_t offset = arg_u64(args, "offset");
+        if (offset >= content.size()) return 0;
+        payload = content.substr(offset, arg_u64(args, "size"));
+        return payload.size();
+    }
+    if (req.cmd == "write") {
+        auto inode = tree.inodes.find(arg_u64(args, "id"));
+        if (inode == tree.inodes.end()) return -1;
+        std::string &content = inode->second.content;
+        uint64_t offset = arg_u64(args, "offset");
+        if ((int64_t)offset == fail_write_offset_) return -1;
+        if (offset + req.body.size() > content.size()) content.resize(offset + req.body.size(), '\0');
+        content.replace(offset, req.body.size(), req.body);
+        pack(payload, ++inode->second.version);
+        return req.body.size();
+    }
+    // both answer '<Q', the version they left the inode at
+    if (req.cmd == "fallocate") {
+        auto inode = tree.inodes.find(arg_u64(args, "id"));
+        uint64_t mode = arg_u64(args, "mode");
+        if (inode == tree.inodes.end() || S_ISDIR(inode->second.mode)) return -1;
+        if ((mode & ~(uint64_t)(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) ||
+            ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE)))
+            return -1;
+        std::string &content = inode->second.content;
+        uint64_t offset = arg_u64(args, "offset");
+        uint64_t end = offset + arg_u64(args, "len");
+        if (mode & FALLOC_FL_PUNCH_HOLE) {
+            end = std::min<uint64_t>(end, content.size());
+            if (offset >= end) {
+                pack(payload, inode->second.version);
+                return 0;
+            }
+            std::fill(content.begin() + offset, content.begin() + end, '\0');
+        } else if (!(mode & FALLOC_FL_KEEP_SIZE) && end > content.size()) {
+            content.resize(end, '\0');
+        } else {
+            pack(payload, inode->second.version);
+            return 0;
+        }
+        pack(payload, ++inode->second.version);
+        return 0;
+    }
+    if (req.cmd == "copy_range") {
+        auto src = tree.inodes.find(arg_u64(args, "src_id"));
+        auto dst = tree.inodes.find(arg_u64(args, "id"));
+        if (src == tree.inodes.end() || dst == tree.inodes.end()) return -1;
+        if (S_ISDIR(src->second.mode) || S_ISDIR(dst->second.mode)) return -1;
+        uint64_t src_offset = arg_u64(args, "src_offset");
+        uint64_t offset = arg_u64(args, "offset");
+        if (src_offset >= src->second.content.size()) {
+            pack(payload, dst->second.version);
+            return 0;
+        }
+        // a copy first, src and dst may be the same string
+        std::string chunk = src->second.content.substr(src_offset, arg_u64(args, "len"));
+        std::string &content = dst->second.content;
+        if (offset + chunk.size() > content.size()) content.resize(offset + chunk.size(), '\0');
+        content.replace(offset, chunk.size(), chunk);
+        pack(payload, ++dst->second.version);
+        return chunk.size();
+    }
+    if (req.cmd == "statfs") {
+        // '<QQQQ', a fixed 1 GB of space
+        uint64_t bytes = 0;
+        for (auto &inode : tree.inodes) bytes += inode.second.content.size();
+        pack(payload, (uint64_t)1 << 30);
+        pack(payload, bytes);
+        pack(payload, (uint64_t)0xFFFFFFFF - ROOT_INO);
+        pack(payload, (uint64_t)tree.inodes.size());
+        return 0;
+    }
+    if (req.cmd == "rename") return rename(tree, req, payload);
+    if (req.cmd == "iterate") return iterate(tree, req, payload);
+    if (req.cmd == "prefetch") return prefetch(tree, req, payload);
+    return -1;
+}
+
+// the row keeps its rowid, like the UPDATE of the python backend; a refusal
+// is -1 with '<i' errno
+int64_t MockBackend::rename(Tree &tree, const Request &req, std::string &payload) {
+    const auto &args = req.args;
+    std::pair<uint32_t, std::string> from{(uint32_t)arg_u64(args, "parent_id"), args.count("name") ? args.at("name") : ""};
+    std::pair<uint32_t, std::string> to{(uint32_t)arg_u64(args, "new_parent_id"),
+                                        args.count("new_name") ? args.at("new_name") : ""};
+    uint64_t flags = arg_u64(args, "flags");
+    auto refuse = [&payload](int32_t err) {
+        pack(payload, err);
+        return (int64_t)-1;
+    };
+
+    auto src = tree.names.find(from);
+    if (src == tree.names.end()) return refuse(ENOENT);
+    if (from == to) return 0;
+    auto dst = tree.names.find(to);
+    Dirent &moved = tree.rows[src->second];
+    bool src_dir = S_ISDIR(tree.inodes[moved.id].mode);
+
+    // is dir the directory id or one of its ancestors
+    auto ancestor = [&tree](uint32_t dir, uint32_t id) {
+        while (id != ROOT_INO) {
+            if (id == dir) return true;
+            auto row = tree.rows.begin();
+            while (row != tree.rows.end() && row->second.id != id) ++row;
+            if (row == tree.rows.end()) return false;
+            id = row->second.parent;
+        }
+        return dir == ROOT_INO;
+    };
+
+    if (flags & RENAME_EXCHANGE) {
+        if (dst == tree.names.end()) return refuse(ENOENT);
+        Dirent &other = tree.rows[dst->second];
+        if (src_dir && ancestor(moved.id, to.first)) return refuse(EINVAL);
+        if (S_ISDIR(tree.inodes[other.id].mode) && ancestor(other.id, from.first)) return refuse(EINVAL);
+        std::swap(moved.id, other.id);
+    } else {
+        if (dst != tree.names.end()) {
+            Dirent &other = tree.rows[dst->second];
+            if (flags & RENAME_NOREPLACE) return refuse(EEXIST);
+            if (other.id == moved.id) return 0;
+            bool dst_dir = S_ISDIR(tree.inodes[other.id].mode);
+            if (src_dir != dst_dir) return refuse(dst_dir ? EISDIR : ENOTDIR);
+            for (auto &row : tree.rows) {
+                if (dst_dir && row.second.parent == other.id) return refuse(ENOTEMPTY);
+            }
+        }
+        if (src_dir && ancestor(moved.id, to.first)) return refuse(EINVAL);
+        if (dst != tree.names.end()) {
+            tree.inodes[tree.rows[dst->second].id].nlink--;
+            tree.rows.erase(dst->second);
+            tree.names.erase(dst);
+        }
+        uint64_t row = src->second;
+        tree.names.erase(src);
+        moved.parent = to.first;
+        moved.name = to.second;
+        tree.names[to] = row;
+    }
+    tree.inodes[from.first].version++;
+    if (to.first != from.first) tree.inodes[to.first].version++;
+    return 0;
+}
+
+// '<IIH' records + name from offset on, as many as fit into size: '.',
+// '..', then the children in rowid order. 0 records past the end.
+int64_t MockBackend::iterate(Tree &tree, const Request &req, std::string &payload) {
+    uint32_t id = arg_u64(req.args, "id");
+    uint64_t offset = arg_u64(req.args, "offset");
+    int64_t budget = (int64_t)arg_u64(req.args, "size");
+    std::vector<std::pair<uint32_t, std::string>> entries = {{id, "."}, {id, ".."}};
+    int64_t count = 0;
+
+    for (auto &row : tree.rows) {
+        if (row.second.parent == id) entries.emplace_back(row.second.id, row.second.name);
+    }
+    for (uint64_t i = offset; i < entries.size(); i++) {
+        const std::string &name = entries[i].second;
+        uint32_t mode = i < 2 ? S_IFDIR | 0777 : tree.inodes[entries[i].first].mode;
+        int64_t size = 4 + 4 + 2 + name.size();
+        if (size > budget) break;
+        budget -= size;
+        pack(payload, entries[i].first);
+        pack(payload, mode);
+        pack(payload, (uint16_t)name.size());
+        payload += name;
+        count++;
+    }
+    return count;
+}
+
+// <q cursor> then '<IIIQQIH' records + name, as many as fit into size
+int64_t MockBackend::prefetch(Tree &tree, const Request &req, std::string &payload) {
+    uint32_t root = arg_u64(req.args, "root", ROOT_INO);
+    uint64_t cursor = arg_u64(req.args, "after");
+    int64_t budget = (int64_t)arg_u64(req.args, "size") - 8;
+    std::set<uint32_t> dirs = {root};
+    std::string records;
+    int64_t count = 0;
+
+    if (root != ROOT_INO) {
+        // rowids only grow, so a parent always precedes its children
+        for (auto &row : tree.rows) {
+            if (dirs.count(row.second.parent) && S_ISDIR(tree.inodes[row.second.id].mode)) dirs.insert(row.second.id);
+        }
+    }
+    for (auto row = tree.rows.upper_bound(cursor); row != tree.rows.end(); ++row) {
+        const Dirent &d = row->second;
+        if (root != ROOT_INO && !dirs.count(d.parent)) continue;
+        const Inode &inode = tree.inodes[d.id];
+        int64_t size = 4 + 4 + 4 + 8 + 8 + 4 + 2 + d.name.size();
+        if (size > budget) break;
+        budget -= size;
+        pack(records, d.parent);
+        pack(records, d.id);
+        pack(records, inode.mode);
+        pack(records, (uint64_t)inode.content.size());
+        pack(records, inode.version);
+        pack(records, inode.nlink);
+        pack(records, (uint16_t)d.name.size());
+        records += d.name;
+        cursor = row->first;
+        count++;
+    }
+    pack(payload, (int64_t)cursor);
+    payload += records;
+    return count;
+}
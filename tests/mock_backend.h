@@ -0,0 +1,129 @@
+#pragma once
+
+// In-process stand-in for backend/main.py: the same /api/* protocol served
+// from memory over loopback tcp or a unix socket, so the web engine can be
+// tested and benchmarked without python or sqlite in the picture.
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+class MockBackend {
+public:
+    MockBackend() = default;
+    ~MockBackend();
+    MockBackend(const MockBackend &) = delete;
+    MockBackend &operator=(const MockBackend &) = delete;
+
+    // Returns the backends= spec to hand to YUFSCore_configure, or "" if
+    // the socket couldn't be set up.
+    std::string start(bool uds = false);
+    void stop();
+
+    // Faults, they apply to responses written after the call.
+    // Every response waits this long before it is written.
+    void set_delay_us(unsigned delay) { delay_us_ = delay; }
+    // The next count responses are cut after bytes bytes and the
+    // connection is closed, as if the backend died mid-response.
+    void truncate_next(int count, size_t bytes) {
+        truncate_bytes_ = bytes;
+        truncate_count_ = count;
+    }
+    // Requests are read at most bytes at a time with a pause in between,
+    // a large write then fills the socket buffers and blocks the sender.
+    void set_slow_reader(size_t bytes, unsigned pause_us) {
+        slow_read_pause_us_ = pause_us;
+        slow_read_bytes_ = bytes;
+    }
+    // Drops every session like a backend restart, the next request of
+    // each client gets SESSION_STALE.
+    void forget_sessions();
+    // Writes at this offset fail, as if the backend ran out of space there.
+    void fail_writes_at(int64_t offset) { fail_write_offset_ = offset; }
+    // Another client replaces the content of id, the engine under test
+    // learns about it only from the backend.
+    void remote_write(const std::string &token, uint32_t id, const std::string &content);
+
+    // requests served for cmd ("lookup", "write", ...)
+    uint64_t requests(const std::string &cmd);
+
+private:
+    struct Inode {
+        uint32_t mode = 0;
+        uint32_t nlink = 1;
+        uint64_t version = 1;
+        std::string content;
+    };
+    struct Dirent {
+        uint32_t parent;
+        uint32_t id;
+        std::string name;
+    };
+    // one tenant, like the token column of the python backend
+    struct Tree {
+        std::map<uint32_t, Inode> inodes;
+        // rowid order is the iterate and prefetch order
+        std::map<uint64_t, Dirent> rows;
+        std::map<std::pair<uint32_t, std::string>, uint64_t> names;
+        uint64_t next_row = 1;
+        uint32_t next_id = 0;
+    };
+    struct Request {
+        std::string cmd;
+        std::map<std::string, std::string> args;
+        std::string body;
+    };
+    // write stripes of one chain, applied in seq order
+    struct Chain {
+        uint64_t next = 0;
+        bool broken = false;
+        std::chrono::steady_clock::time_point touched;
+    };
+    using ChainKey = std::tuple<std::string, uint64_t, uint64_t>;
+
+    void accept_loop();
+    void serve(int fd);
+    bool read_request(int fd, std::string &buffer, Request &req);
+    bool write_response(int fd, int64_t ret, const std::string &payload);
+
+    int64_t handle(Request &req, std::string &payload);
+    int64_t chained_write(std::unique_lock<std::mutex> &guard, const std::string &token, const Request &req,
+                          std::string &payload);
+    Tree &tree(const std::string &token);
+    uint32_t allocate_ids(Tree &tree, uint32_t count);
+    int64_t dispatch(Tree &tree, const Request &req, std::string &payload);
+    int64_t rename(Tree &tree, const Request &req, std::string &payload);
+    int64_t iterate(Tree &tree, const Request &req, std::string &payload);
+    int64_t prefetch(Tree &tree, const Request &req, std::string &payload);
+
+    int listen_fd_ = -1;
+    std::string dir_;
+    std::thread acceptor_;
+    std::mutex conns_lock_;
+    std::vector<int> conn_fds_;
+    std::vector<std::thread> conn_threads_;
+    std::atomic<bool> stopping_{false};
+
+    std::atomic<unsigned> delay_us_{0};
+    std::atomic<int> truncate_count_{0};
+    std::atomic<size_t> truncate_bytes_{0};
+    std::atomic<size_t> slow_read_bytes_{0};
+    std::atomic<unsigned> slow_read_pause_us_{0};
+    std::atomic<int64_t> fail_write_offset_{-1};
+
+    std::mutex lock_;
+    std::map<std::string, std::unique_ptr<Tree>> trees_;
+    std::map<int64_t, std::string> sessions_;
+    int64_t next_session_ = 1;
+    std::map<ChainKey, Chain> chains_;
+    std::condition_variable chain_wait_;
+    std::map<std::string, uint64_t> requests_;
+};
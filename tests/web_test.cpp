@@ -0,0 +1,460 @@
+#include <gtest/gtest.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "yufs_core.h"
+}
+
+#include "mock_backend.h"
+
+const uint32_t ROOT_ID = 1000;
+const char *TOKEN = "web";
+
+// the web engine against the in-process mock, over tcp and over a unix socket
+class YufsWebTest : public ::testing::TestWithParam<bool> {
+protected:
+    void SetUp() override {
+        spec = backend.start(GetParam());
+        ASSERT_FALSE(spec.empty());
+        ASSERT_EQ(YUFSCore_init(), 0);
+        ASSERT_EQ(YUFSCore_configure("backends", spec.c_str()), 0);
+        ASSERT_EQ(YUFSCore_open_session(TOKEN), 0);
+    }
+
+    void TearDown() override {
+        YUFSCore_close_session(TOKEN);
+        YUFSCore_destroy();
+        backend.stop();
+    }
+
+    // engine tunables are pinned while a session is open, like a remount
+    void reconfigure(const char *key, const char *value) {
+        YUFSCore_close_session(TOKEN);
+        ASSERT_EQ(YUFSCore_configure(key, value), 0);
+        ASSERT_EQ(YUFSCore_open_session(TOKEN), 0);
+    }
+
+    uint32_t create_file(const char *name) {
+        struct YUFS_stat stat;
+        EXPECT_EQ(YUFSCore_create(TOKEN, ROOT_ID, name, 0644 | S_IFREG, &stat), 0);
+        return stat.id;
+    }
+
+    MockBackend backend;
+    std::string spec;
+};
+
+static bool count_entry(void *ctx, const char *, int, uint32_t, umode_t) {
+    ++*static_cast<int *>(ctx);
+    return true;
+}
+
+TEST_P(YufsWebTest, CreateLookupIterate) {
+    uint32_t fid = create_file("hello.txt");
+    EXPECT_NE(fid, 0u);
+
+    struct YUFS_stat stat;
+    ASSERT_EQ(YUFSCore_lookup(TOKEN, ROOT_ID, "hello.txt", &stat), 0);
+    EXPECT_EQ(stat.id, fid);
+    EXPECT_TRUE(S_ISREG(stat.mode));
+    EXPECT_NE(YUFSCore_lookup(TOKEN, ROOT_ID, "missing.txt", &stat), 0);
+
+    int entries = 0;
+    ASSERT_EQ(YUFSCore_iterate(TOKEN, ROOT_ID, count_entry, &entries, 0), 0);
+    EXPECT_EQ(entries, 3);
+}
+
+TEST_P(YufsWebTest, BackendsArePinnedWhileMounted) {
+    // a second mount with the same backends shares them, other ones are refused
+    EXPECT_EQ(YUFSCore_configure("backends", spec.c_str()), 0);
+    EXPECT_EQ(YUFSCore_configure("backends", "127.0.0.1:1"), -EBUSY);
+    EXPECT_NE(create_file("still.txt"), 0u);
+
+    YUFSCore_close_session(TOKEN);
+    EXPECT_EQ(YUFSCore_configure("backends", "127.0.0.1:1"), 0);
+    EXPECT_EQ(YUFSCore_configure("backends", spec.c_str()), 0);
+    ASSERT_EQ(YUFSCore_open_session(TOKEN), 0);
+}
+
+TEST_P(YufsWebTest, TunablesArePinnedWhileMounted) {
+    // another mount may repeat the striping, not change it under this one
+    EXPECT_EQ(YUFSCore_configure("stripe_size", "65536"), 0);
+    EXPECT_EQ(YUFSCore_configure("stripe_size", "4096"), -EBUSY);
+    EXPECT_EQ(YUFSCore_configure("create_lease", "16"), -EBUSY);
+    EXPECT_EQ(YUFSCore_configure("dir_ttl", "0"), -EBUSY);
+
+    // the last unmount takes its values along
+    reconfigure("stripe_size", "4096");
+    YUFSCore_close_session(TOKEN);
+    EXPECT_EQ(YUFSCore_configure("stripe_size", "65536"), 0);
+    ASSERT_EQ(YUFSCore_open_session(TOKEN), 0);
+    EXPECT_EQ(YUFSCore_configure("stripe_size", "65536"), 0);
+}
+
+TEST_P(YufsWebTest, StatsArePerToken) {
+    const char *other = "web-other";
+    std::vector<char> stats(64 * 1024);
+    struct YUFS_stat stat;
+
+    ASSERT_EQ(YUFSCore_open_session(other), 0);
+    create_file("counted.txt");
+    YUFSCore_stats(TOKEN, stats.data(), stats.size());
+    EXPECT_NE(std::string(stats.data()).find("create: sent="), std::string::npos);
+    YUFSCore_stats(other, stats.data(), stats.size());
+    EXPECT_EQ(std::string(stats.data()).find("create: sent="), std::string::npos);
+
+    // a reset of one mount leaves the other's counters alone
+    ASSERT_EQ(YUFSCore_getattr(other, ROOT_ID, &stat), 0);
+    YUFSCore_reset_stats(TOKEN);
+    YUFSCore_stats(TOKEN, stats.data(), stats.size());
+    EXPECT_EQ(std::string(stats.data()).find("getattr: sent="), std::string::npos);
+    YUFSCore_stats(other, stats.data(), stats.size());
+    EXPECT_NE(std::string(stats.data()).find("getattr: sent="), std::string::npos);
+    YUFSCore_close_session(other);
+}
+
+TEST_P(YufsWebTest, StripedReadWrite) {
+    uint32_t fid = create_file("big.bin");
+    std::vector<char> data(3 * 1024 * 1024 + 123);
+    for (size_t i = 0; i < data.size(); i++) data[i] = (char)(i * 31 + 7);
+
+    ASSERT_EQ(YUFSCore_write(TOKEN, fid, data.data(), data.size(), 0), (int)data.size());
+    std::vector<char> back(data.size());
+    ASSERT_EQ(YUFSCore_read(TOKEN, fid, back.data(), back.size(), 0), (int)back.size());
+    EXPECT_TRUE(back == data);
+    EXPECT_GT(backend.requests("write"), 1u);
+}
+
+TEST_P(YufsWebTest, StripedWriteStopsAtFailedStripe) {
+    uint32_t fid = create_file("partial.bin");
+    std::vector<char> data(4 * 4096, 'x');
+    struct YUFS_stat stat;
+
+    // the second stripe fails, the two after it must not land either
+    reconfigure("stripe_size", "4096");
+    backend.set_delay_us(2000);
+    backend.fail_writes_at(4096);
+    EXPECT_EQ(YUFSCore_write(TOKEN, fid, data.data(), data.size(), 0), 4096);
+    backend.fail_writes_at(-1);
+    backend.set_delay_us(0);
+    ASSERT_EQ(YUFSCore_getattr(TOKEN, fid, &stat), 0);
+    EXPECT_EQ(stat.size, 4096u);
+}
+
+TEST_P(YufsWebTest, FailedLeasedCreateIsRetired) {
+    uint32_t first = create_file("dup.txt");
+    struct YUFS_stat stat;
+
+    // the leased create completes locally, the backend then refuses the name
+    reconfigure("create_lease", "16");
+    ASSERT_EQ(YUFSCore_create(TOKEN, ROOT_ID, "dup.txt", 0644 | S_IFREG, &stat), 0);
+    EXPECT_NE(stat.id, first);
+
+    // ops on the name see the backend's answer, the error waits for sync
+    ASSERT_EQ(YUFSCore_lookup(TOKEN, ROOT_ID, "dup.txt", &stat), 0);
+    EXPECT_EQ(stat.id, first);
+    EXPECT_NE(YUFSCore_sync(TOKEN, 0), 0);
+    EXPECT_EQ(YUFSCore_sync(TOKEN, 0), 0);
+}
+
+TEST_P(YufsWebTest, StripedWriteWaitsForLeasedCreate) {
+    std::vector<char> data(4 * 65536 + 7, 'l');
+    struct YUFS_stat stat;
+
+    // the stripes must not reach the backend before the create they write to
+    reconfigure("create_lease", "16");
+    for (int i = 0; i < 8; i++) {
+        std::string name = "leased" + std::to_string(i);
+        ASSERT_EQ(YUFSCore_create(TOKEN, ROOT_ID, name.c_str(), 0644 | S_IFREG, &stat), 0);
+        ASSERT_EQ(YUFSCore_write(TOKEN, stat.id, data.data(), data.size(), 0), (int)data.size());
+        ASSERT_EQ(YUFSCore_getattr(TOKEN, stat.id, &stat), 0);
+        EXPECT_EQ(stat.size, data.size());
+    }
+    EXPECT_EQ(YUFSCore_sync(TOKEN, 0), 0);
+}
+
+TEST_P(YufsWebTest, ConditionalRead) {
+    uint32_t fid = create_file("versioned.txt");
+    const char *text = "v2";
+    ASSERT_EQ(YUFSCore_write(TOKEN, fid, text, strlen(text), 0), (int)strlen(text));
+
+    struct YUFS_stat stat;
+    ASSERT_EQ(YUFSCore_getattr(TOKEN, fid, &stat), 0);
+    char buf[16] = {0};
+    EXPECT_EQ(YUFSCore_read_if(TOKEN, fid, buf, sizeof(buf), 0, stat.version), YUFS_NOT_MODIFIED);
+    EXPECT_EQ(YUFSCore_read_if(TOKEN, fid, buf, sizeof(buf), 0, stat.version - 1), (int)strlen(text));
+    EXPECT_STREQ(buf, text);
+}
+
+TEST_P(YufsWebTest, WriteReportsVersion) {
+    uint32_t fid = create_file("own.bin");
+    std::vector<char> data(3 * 65536 + 5, 'v');
+    struct YUFS_stat stat;
+    uint64_t version = 0;
+
+    // one op and a striped chain, both end where getattr sees the inode
+    ASSERT_EQ(YUFSCore_write_v(TOKEN, fid, "x", 1, 0, &version), 1);
+    ASSERT_EQ(YUFSCore_getattr(TOKEN, fid, &stat), 0);
+    EXPECT_EQ(version, stat.version);
+    ASSERT_EQ(YUFSCore_write_v(TOKEN, fid, data.data(), data.size(), 0, &version), (int)data.size());
+    ASSERT_EQ(YUFSCore_getattr(TOKEN, fid, &stat), 0);
+    EXPECT_EQ(version, stat.version);
+
+    // fallocate and copy_range tell theirs too, changed or not
+    ASSERT_EQ(YUFSCore_fallocate_v(TOKEN, fid, 0, 0, data.size() + 10, &version), 0);
+    ASSERT_EQ(YUFSCore_getattr(TOKEN, fid, &stat), 0);
+    EXPECT_EQ(version, stat.version);
+    ASSERT_EQ(YUFSCore_fallocate_v(TOKEN, fid, YUFS_FALLOC_KEEP_SIZE, 0, 10, &version), 0);
+    EXPECT_EQ(version, stat.version);
+    uint32_t copy = create_file("copy.bin");
+    ASSERT_EQ(YUFSCore_copy_range_v(TOKEN, fid, 0, copy, 0, 100, &version), 100);
+    ASSERT_EQ(YUFSCore_getattr(TOKEN, copy, &stat), 0);
+    EXPECT_EQ(version, stat.version);
+}
+
+TEST_P(YufsWebTest, FreshGetattrBypassesPrefetch) {
+    uint32_t fid = create_file("shared.txt");
+    struct YUFS_stat stat;
+
+    ASSERT_GT(YUFSCore_prefetch(TOKEN, ROOT_ID), 0);
+    backend.remote_write(TOKEN, fid, "changed elsewhere");
+    ASSERT_EQ(YUFSCore_getattr(TOKEN, fid, &stat), 0);
+    EXPECT_EQ(stat.size, 0u);
+
+    // the backend's answer, and the cache learns it too
+    ASSERT_EQ(YUFSCore_getattr_fresh(TOKEN, fid, &stat), 0);
+    EXPECT_EQ(stat.size, strlen("changed elsewhere"));
+    ASSERT_EQ(YUFSCore_getattr(TOKEN, fid, &stat), 0);
+    EXPECT_EQ(stat.size, strlen("changed elsewhere"));
+
+    // names cached under a directory go once its version is checked
+    uint64_t lookups = backend.requests("lookup");
+    ASSERT_EQ(YUFSCore_lookup(TOKEN, ROOT_ID, "shared.txt", &stat), 0);
+    EXPECT_EQ(backend.requests("lookup"), lookups);
+    ASSERT_EQ(YUFSCore_getattr_fresh(TOKEN, ROOT_ID, &stat), 0);
+    ASSERT_EQ(YUFSCore_lookup(TOKEN, ROOT_ID, "shared.txt", &stat), 0);
+    EXPECT_EQ(backend.requests("lookup"), lookups + 1);
+}
+
+TEST_P(YufsWebTest, StaleSessionIsRenewed) {
+    uint32_t fid = create_file("renew.txt");
+    uint64_t sessions = backend.requests("session");
+    backend.forget_sessions();
+
+    char buf[4];
+    EXPECT_EQ(YUFSCore_read(TOKEN, fid, buf, sizeof(buf), 0), 0);
+    EXPECT_EQ(backend.requests("session"), sessions + 1);
+}
+
+TEST_P(YufsWebTest, TruncatedResponseFailsThenRecovers) {
+    uint32_t fid = create_file("cut.txt");
+    const char *text = "payload";
+    ASSERT_EQ(YUFSCore_write(TOKEN, fid, text, strlen(text), 0), (int)strlen(text));
+
+    // inside the headers and inside the body
+    for (size_t cut : {10, 50}) {
+        char buf[16] = {0};
+        backend.truncate_next(1, cut);
+        EXPECT_LT(YUFSCore_read(TOKEN, fid, buf, sizeof(buf), 0), 0) << "cut at " << cut;
+        // the broken connection is dropped, a new one serves the retry
+        EXPECT_EQ(YUFSCore_read(TOKEN, fid, buf, sizeof(buf), 0), (int)strlen(text));
+        EXPECT_STREQ(buf, text);
+    }
+}
+
+TEST_P(YufsWebTest, DelayedBackend) {
+    uint32_t fid = create_file("slow.txt");
+    backend.set_delay_us(20 * 1000);
+
+    char buf[4];
+    auto start = std::chrono::steady_clock::now();
+    EXPECT_EQ(YUFSCore_read(TOKEN, fid, buf, sizeof(buf), 0), 0);
+    EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(20));
+}
+
+TEST_P(YufsWebTest, SlowReaderBlocksLargeWrite) {
+    uint32_t fid = create_file("throttled.bin");
+    std::vector<char> data(512 * 1024, 'x');
+    backend.set_slow_reader(16 * 1024, 200);
+
+    ASSERT_EQ(YUFSCore_write(TOKEN, fid, data.data(), data.size(), 0), (int)data.size());
+    struct YUFS_stat stat;
+    ASSERT_EQ(YUFSCore_getattr(TOKEN, fid, &stat), 0);
+    EXPECT_EQ(stat.size, data.size());
+}
+
+TEST_P(YufsWebTest, DirectoryVersionTracksEntries) {
+    struct YUFS_stat dir;
+    ASSERT_EQ(YUFSCore_create(TOKEN, ROOT_ID, "dir", 0755 | S_IFDIR, &dir), 0);
+    uint64_t version = dir.version;
+
+    struct YUFS_stat file;
+    ASSERT_EQ(YUFSCore_create(TOKEN, dir.id, "a", 0644 | S_IFREG, &file), 0);
+    ASSERT_EQ(YUFSCore_getattr(TOKEN, dir.id, &dir), 0);
+    EXPECT_GT(dir.version, version);
+    version = dir.version;
+
+    ASSERT_EQ(YUFSCore_unlink(TOKEN, dir.id, "a"), 0);
+    ASSERT_EQ(YUFSCore_getattr(TOKEN, dir.id, &dir), 0);
+    EXPECT_GT(dir.version, version);
+}
+
+TEST_P(YufsWebTest, LinkCountFollowsNames) {
+    uint32_t fid = create_file("first");
+    struct YUFS_stat stat;
+
+    ASSERT_EQ(YUFSCore_lookup(TOKEN, ROOT_ID, "first", &stat), 0);
+    EXPECT_EQ(stat.nlink, 1u);
+    ASSERT_EQ(YUFSCore_link(TOKEN, fid, ROOT_ID, "second"), 0);
+    ASSERT_EQ(YUFSCore_lookup(TOKEN, ROOT_ID, "second", &stat), 0);
+    EXPECT_EQ(stat.nlink, 2u);
+
+    // the cached stat of the remaining name must not keep the old count
+    ASSERT_EQ(YUFSCore_lookup(TOKEN, ROOT_ID, "first", &stat), 0);
+    ASSERT_EQ(YUFSCore_unlink(TOKEN, ROOT_ID, "second"), 0);
+    ASSERT_EQ(YUFSCore_lookup(TOKEN, ROOT_ID, "first", &stat), 0);
+    EXPECT_EQ(stat.nlink, 1u);
+    ASSERT_EQ(YUFSCore_getattr(TOKEN, fid, &stat), 0);
+    EXPECT_EQ(stat.nlink, 1u);
+}
+
+TEST_P(YufsWebTest, ListingIsCached) {
+    create_file("a");
+    create_file("b");
+
+    int entries = 0;
+    ASSERT_EQ(YUFSCore_iterate(TOKEN, ROOT_ID, count_entry, &entries, 0), 0);
+    EXPECT_EQ(entries, 4);
+    uint64_t calls = backend.requests("iterate");
+
+    // again, and a continuation past '.' and '..', without the backend
+    entries = 0;
+    ASSERT_EQ(YUFSCore_iterate(TOKEN, ROOT_ID, count_entry, &entries, 0), 0);
+    EXPECT_EQ(entries, 4);
+    entries = 0;
+    ASSERT_EQ(YUFSCore_iterate(TOKEN, ROOT_ID, count_entry, &entries, 2), 0);
+    EXPECT_EQ(entries, 2);
+    EXPECT_EQ(backend.requests("iterate"), calls);
+
+    // a local change shows up at once
+    create_file("c");
+    entries = 0;
+    ASSERT_EQ(YUFSCore_iterate(TOKEN, ROOT_ID, count_entry, &entries, 0), 0);
+    EXPECT_EQ(entries, 5);
+    ASSERT_EQ(YUFSCore_unlink(TOKEN, ROOT_ID, "a"), 0);
+    entries = 0;
+    ASSERT_EQ(YUFSCore_iterate(TOKEN, ROOT_ID, count_entry, &entries, 0), 0);
+    EXPECT_EQ(entries, 4);
+
+    reconfigure("dir_ttl", "0");
+    calls = backend.requests("iterate");
+    ASSERT_EQ(YUFSCore_iterate(TOKEN, ROOT_ID, count_entry, &entries, 0), 0);
+    EXPECT_GT(backend.requests("iterate"), calls);
+}
+
+TEST_P(YufsWebTest, ListingIsFetchedInPages) {
+    for (int i = 0; i < 2000; i++) create_file(("entry_with_a_longer_name_" + std::to_string(i)).c_str());
+
+    // cached and uncached, a reply carries many entries
+    for (const char* ttl : {"5", "0"}) {
+        reconfigure("dir_ttl", ttl);
+        uint64_t calls = backend.requests("iterate");
+        int entries = 0;
+        ASSERT_EQ(YUFSCore_iterate(TOKEN, ROOT_ID, count_entry, &entries, 0), 0);
+        EXPECT_EQ(entries, 2002);
+        EXPECT_LE(backend.requests("iterate") - calls, 4u);
+    }
+}
+
+TEST_P(YufsWebTest, RenameReplacesAndExchanges) {
+    uint32_t tmp = create_file("tmp");
+    create_file("saved");
+    struct YUFS_stat stat;
+    // cached listing and lookup must not survive the rename
+    int entries = 0;
+    ASSERT_EQ(YUFSCore_iterate(TOKEN, ROOT_ID, count_entry, &entries, 0), 0);
+
+    EXPECT_EQ(YUFSCore_rename(TOKEN, ROOT_ID, "tmp", ROOT_ID, "saved", YUFS_RENAME_NOREPLACE), -EEXIST);
+    ASSERT_EQ(YUFSCore_rename(TOKEN, ROOT_ID, "tmp", ROOT_ID, "saved", 0), 0);
+    ASSERT_EQ(YUFSCore_lookup(TOKEN, ROOT_ID, "saved", &stat), 0);
+    EXPECT_EQ(stat.id, tmp);
+    EXPECT_NE(YUFSCore_lookup(TOKEN, ROOT_ID, "tmp", &stat), 0);
+    entries = 0;
+    ASSERT_EQ(YUFSCore_iterate(TOKEN, ROOT_ID, count_entry, &entries, 0), 0);
+    EXPECT_EQ(entries, 3);
+
+    struct YUFS_stat dir;
+    ASSERT_EQ(YUFSCore_create(TOKEN, ROOT_ID, "dir", 0755 | S_IFDIR, &dir), 0);
+    EXPECT_EQ(YUFSCore_rename(TOKEN, ROOT_ID, "dir", dir.id, "inside", 0), -EINVAL);
+    ASSERT_EQ(YUFSCore_rename(TOKEN, ROOT_ID, "dir", ROOT_ID, "saved", YUFS_RENAME_EXCHANGE), 0);
+    ASSERT_EQ(YUFSCore_lookup(TOKEN, ROOT_ID, "dir", &stat), 0);
+    EXPECT_EQ(stat.id, tmp);
+    ASSERT_EQ(YUFSCore_lookup(TOKEN, ROOT_ID, "saved", &stat), 0);
+    EXPECT_EQ(stat.id, dir.id);
+
+    // the backend's reason comes through, a lost answer is an I/O error
+    EXPECT_EQ(YUFSCore_rename(TOKEN, ROOT_ID, "gone", ROOT_ID, "other", 0), -ENOENT);
+    EXPECT_EQ(YUFSCore_rename(TOKEN, ROOT_ID, "dir", ROOT_ID, "saved", 0), -EISDIR);
+    ASSERT_EQ(YUFSCore_create(TOKEN, dir.id, "child", 0644 | S_IFREG, &stat), 0);
+    struct YUFS_stat empty;
+    ASSERT_EQ(YUFSCore_create(TOKEN, ROOT_ID, "empty", 0755 | S_IFDIR, &empty), 0);
+    EXPECT_EQ(YUFSCore_rename(TOKEN, ROOT_ID, "empty", ROOT_ID, "saved", 0), -ENOTEMPTY);
+    backend.truncate_next(16, 4);
+    EXPECT_EQ(YUFSCore_rename(TOKEN, ROOT_ID, "dir", ROOT_ID, "moved", 0), -EIO);
+}
+
+TEST_P(YufsWebTest, FallocateExtendsAndPunches) {
+    uint32_t fid = create_file("holes.bin");
+    ASSERT_EQ(YUFSCore_write(TOKEN, fid, "abcdef", 6, 0), 6);
+
+    struct YUFS_stat stat;
+    ASSERT_EQ(YUFSCore_fallocate(TOKEN, fid, YUFS_FALLOC_KEEP_SIZE, 0, 4096), 0);
+    ASSERT_EQ(YUFSCore_getattr(TOKEN, fid, &stat), 0);
+    EXPECT_EQ(stat.size, 6u);
+    ASSERT_EQ(YUFSCore_fallocate(TOKEN, fid, 0, 0, 4096), 0);
+    ASSERT_EQ(YUFSCore_getattr(TOKEN, fid, &stat), 0);
+    EXPECT_EQ(stat.size, 4096u);
+
+    ASSERT_EQ(YUFSCore_fallocate(TOKEN, fid, YUFS_FALLOC_PUNCH_HOLE | YUFS_FALLOC_KEEP_SIZE, 1, 2), 0);
+    char buf[6];
+    ASSERT_EQ(YUFSCore_read(TOKEN, fid, buf, sizeof(buf), 0), (int)sizeof(buf));
+    EXPECT_EQ(std::string(buf, sizeof(buf)), std::string("a\0\0def", 6));
+}
+
+TEST_P(YufsWebTest, CopyRangeStaysOnBackend) {
+    uint32_t src = create_file("src.bin");
+    uint32_t dst = create_file("dst.bin");
+    std::vector<char> data(1024 * 1024);
+    for (size_t i = 0; i < data.size(); i++) data[i] = (char)(i * 13 + 1);
+    ASSERT_EQ(YUFSCore_write(TOKEN, src, data.data(), data.size(), 0), (int)data.size());
+
+    uint64_t reads = backend.requests("read");
+    uint64_t writes = backend.requests("write");
+    ASSERT_EQ(YUFSCore_copy_range(TOKEN, src, 0, dst, 0, data.size()), (int)data.size());
+    EXPECT_EQ(backend.requests("copy_range"), 1u);
+    EXPECT_EQ(backend.requests("read"), reads);
+    EXPECT_EQ(backend.requests("write"), writes);
+
+    struct YUFS_stat stat;
+    ASSERT_EQ(YUFSCore_getattr(TOKEN, dst, &stat), 0);
+    EXPECT_EQ(stat.size, data.size());
+    std::vector<char> back(data.size());
+    ASSERT_EQ(YUFSCore_read(TOKEN, dst, back.data(), back.size(), 0), (int)back.size());
+    EXPECT_TRUE(back == data);
+}
+
+TEST_P(YufsWebTest, StatfsIsCached) {
+    struct YUFS_statfs st;
+    ASSERT_EQ(YUFSCore_statfs(TOKEN, &st), 0);
+    EXPECT_GT(st.total_bytes, 0u);
+    EXPECT_GE(st.used_inodes, 1u);
+    ASSERT_EQ(YUFSCore_statfs(TOKEN, &st), 0);
+    EXPECT_EQ(backend.requests("statfs"), 1u);
+}
+
+INSTANTIATE_TEST_SUITE_P(Transport, YufsWebTest, ::testing::Values(false, true),
+                         [](const ::testing::TestParamInfo<bool> &info) {
+                             return info.param ? std::string("Unix") : std::string("Tcp");
+                         });